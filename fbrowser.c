@@ -10,13 +10,39 @@
 /*====================================================================*/
 /* COMPILER DIRECTIVES AND INCLUDES */
 /*====================================================================*/
+#define _GNU_SOURCE		// O_PATH
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <setjmp.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <pwd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FILTER_SIMD 1		// SSE2 always, AVX2 when the CPU has it
+#endif
 /*====================================================================*/
 /* CONSTANTS */
 /*====================================================================*/
@@ -40,30 +66,156 @@
 #define F_BLUE 34
 #define FH_WHITE 97
 #define FILL_CHAR ' '
+#define DEFAULT_COLUMNS 80
+#define DEFAULT_ROWS 24
+#define SHORT_GAP 6		// Unchanged cells rewritten instead of a jump
 //Keys used.
 #define K_ENTER 10
 #define K_ESCAPE 27
+#define K_TAB 9
+#define K_BACKSPACE 127
+#define K_CTRL_H 8		// Backspace on some terminals
 #define K_UP_ARROW 'A'		// K_ESCAPE + 'A' -> UP_ARROW
 #define K_DOWN_ARROW 'B'	// K_ESCAPE + 'B' -> DOWN_ARROW
+#define K_HOME_KEY 'H'		// K_ESCAPE + 'H' -> HOME
+#define K_END_KEY 'F'		// K_ESCAPE + 'F' -> END
+//Decoded keys returned by readKey(), above any character code.
+#define K_UP 0x101
+#define K_DOWN 0x102
+#define K_PAGE_UP 0x103
+#define K_PAGE_DOWN 0x104
+#define K_HOME 0x105
+#define K_END 0x106
+#define K_DIR_CHANGED 0x110	// Not a key: the open directory changed
+#define K_SCAN_PROGRESS 0x111	// Not a key: the background scan moved on
+#define K_RESIZE 0x112		// Not a key: the terminal changed size
+#define K_QUIT 0x113		// Not a key: a quit signal, replay over
+#define REFRESH_LIST -2		// selectorMenu(): list changed under it
+#define NEW_LIST -3		// selectorMenu(): another list is to be shown
+#define QUIT_LIST -4		// selectorMenu(): the browser is to be closed
+#define INPUT_BUFFER_SIZE 4096
+#define ESCAPE_TIMEOUT 25	// ms to tell a lone Esc from a sequence
 //Directories
 #define CURRENTDIR "."
 #define CHANGEDIR ".."
-#define MAX_ITEM_LENGTH 15
+#define DEFAULT_ITEM_WIDTH 15	// Columns of a name in the list (-w)
+#define MAX_ITEM_WIDTH 200
 #define DIRECTORY 1
 #define FILEITEM 0
 #define MAX 1024
+//Scanner
+#define SCAN_BUFFER_SIZE 65536	// Bytes requested per getdents64 batch
+#define STAT_BATCH 256		// DT_UNKNOWN entries resolved per batch
+#define SCAN_FIRST_WAIT 50	// ms a scan may take before we show progress
+#define SCAN_NOTIFY_MS 100	// Minimum ms between progress updates
+//Filter
+#define MAX_FILTER 64		// Characters in the filter text
+#define FILTER_ARENA_SIZE ((size_t)1 << 33)	// Packed names and matches
+#define NAME_SEPARATOR '/'	// Between packed names: never in a name
+#define SORT_NAME 0		// Byte order of the names
+#define SORT_NATURAL 1		// Digit runs compare as numbers: a2 < a10
+#define SORT_SIZE 2		// Largest first
+#define SORT_MTIME 3		// Newest first
+#define SORT_EXT 4		// By extension, then name
+#define SORT_MODES 5
+#define STAT_CHUNK 4096		// Items per stat thread, at least
+#define MAX_STAT_THREADS 8
+//Tree walk (du)
+#define MAX_DU_THREADS 16
+#define MAX_OPEN_DIRS 256	// Queued directories held open; deeper ones
+				// are walked by the thread that found them
+#define DU_COLUMN 6		// Width of the totals column
+#define DU_NOTIFY_MS 100	// Minimum ms between live updates
+//Search
+#define SEARCH_SUBSTRING 0	// Anywhere in the name, any case
+#define SEARCH_GLOB 1		// fnmatch() pattern, any case
+#define SEARCH_REGEX 2		// Extended regex, any case
+#define SEARCH_CONTENT 3	// Bytes inside the files, exact
+#define SEARCH_MODES 4
+#define MAX_SEARCH 128		// Characters in the search text
+#define MAX_SEARCH_THREADS 16
+#define GREP_READ_SIZE 262144	// Files up to this are read, not mapped
+#define GREP_CHUNK (16 << 20)	// Bytes of a big file mapped at once
+//Metadata columns
+#define META_SIZE 1
+#define META_MTIME 2
+#define META_PERMS 4
+#define META_OWNER 8
+#define META_ALL (META_SIZE | META_MTIME | META_PERMS | META_OWNER)
+#define META_LOOKAHEAD 16	// Rows stat'ed above and below the page
+#define META_BATCH 64		// Most items in one request to the worker
+#define META_OWNERS 64		// User names remembered
+#define META_FAILED 0xFFFFFFFFu	// LISTCHOICE.mode when statx failed
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000	// Network mounts: no round trip
+#endif
+//Navigation
+#define DIRSTACK_OPEN_FDS 64	// Levels of the stack kept open; those
+				// above are reopened through ".."
+//Replay
+#define REPLAY_KEY_SIZE 64	// Longest scripted key or text: token
+//Performance HUD
+#define PERF_BUCKETS 160	// Latency histogram: 4 steps per power of 2
+//Streaming output
+#define STREAM_PLAIN 0		// One path per line
+#define STREAM_NUL 1		// NUL after each path
+#define STREAM_JSON 2		// One JSON object per line
+#define STREAM_BUFFER_SIZE ((size_t)1 << 20)	// Bytes per write()
+#define STREAM_ARENA_SIZE ((size_t)1 << 30)	// Read buffers, one per level
+//Benchmark
+#define BENCH_SIZES "1k,10k,100k,1m"	// Entries per generated directory
+#define BENCH_DIR_PERCENT 10	// Share of subdirectories
+#define BENCH_FINDS 1000	// Name lookups timed, fewer when huge
+#define PREFETCH_DELAY 150	// ms the selector rests before reading ahead
+#define PREFETCH_SHARE 4	// A read-ahead may use 1/4 of the cache budget
+//Arenas. Address space is reserved up front and only touched pages
+//become resident, so entries never move and a reset costs nothing.
+#define ENTRY_ARENA_SIZE ((size_t)1 << 31)	// LISTCHOICE records
+#define NAME_ARENA_SIZE ((size_t)1 << 33)	// Item names
+#define META_ARENA_SIZE ((size_t)1 << 31)	// LISTMETA of stat'ed items
+#define SCRATCH_ARENA_SIZE ((size_t)1 << 32)	// Per-scan buffers
+#define COUNT_ARENA_SIZE ((size_t)1 << 30)	// Matches of search results
+#define ARENA_KEEP ((size_t)4 << 20)	// Resident bytes kept on reset
+#define DEFAULT_NAMES_MB 256	// Names of a listing kept in RAM, then
+				// they go to a temp file (--names-mb)
+#define DEFAULT_SPILL_DIR "/var/tmp"	// Unless TMPDIR is set
+//Directory cache
+#define CACHE_BUCKETS 1024	// Hash buckets, power of two
+#define CACHE_MAX_LISTINGS 512	// Bounds reserved address space
+#define DEFAULT_CACHE_MB 64	// Default memory budget
+//Persistent index
+#define INDEX_MAGIC "FBINDEX"	// First bytes of the file
+#define INDEX_VERSION 2		// Other versions are started over
+#define INDEX_LIVE 0x4556494cu	// Record header: current
+#define INDEX_DEAD 0x44414544u	// Record header: replaced or gone
+#define INDEX_UNSORTED -1	// Record sortMode: in directory order
+#define INDEX_MAP_SIZE ((size_t)1 << 38)	// Address space for the file
+#define INDEX_SLOTS 1024	// First size of the (dev, ino) table
+#define INDEX_COMPACT_MIN ((size_t)16 << 20)	// Dead bytes before a rewrite
+#define INDEX_COPY_CHUNK ((size_t)4 << 20)	// Names copied per batch
+#define INDEX_QUEUE_MAX ((size_t)256 << 20)	// Records left to the thread
+#define FROM_INDEX 2		// openListing(): *cacheHit for an index hit
+//Directory watch
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		      | IN_ATTRIB | IN_CLOSE_WRITE | IN_ONLYDIR)
+#define EVENT_BUFFER_SIZE 65536
 
 /*====================================================================*/
 /* TYPEDEF STRUCTS DEFINITIONS */
 /*====================================================================*/
 typedef struct _listchoice {
   unsigned index;		// Item number
-  char   *item;			// Item string
-  char   *path;			// Item path
-  unsigned isDirectory;		// Kind of item
-  struct _listchoice *next;	// Pointer to next item
-  struct _listchoice *back;	// Pointer to previous item
-} LISTCHOICE;
+  unsigned isDirectory:1;	// Kind of item
+  unsigned meta:31;		// Slot + 1 in the listing's metas, 0 = none
+  char   *path;			// Item name, in the listing's name table
+} LISTCHOICE;			// Items are contiguous: next is aux + 1
+
+typedef struct _listmeta {
+  long long size;		// Bytes, -1 until the item is stat'ed
+  long long mtime;		// Modification time in ns
+  unsigned mode;		// st_mode, 0 until fetched for the columns
+  unsigned uid;			// Owner
+} LISTMETA;			// Only for items that were stat'ed
 
 typedef struct _scrolldata {
   unsigned scrollActive;	//To know whether scroll is active or not.
@@ -83,14 +235,498 @@ typedef struct _scrolldata {
   char   *item;
   char   *path;
   unsigned itemIndex;
+  unsigned maxDisplay;		//displayLimit requested by the caller.
 } SCROLLDATA;
 
+typedef struct _arena {
+  char   *base;			// Start of the reserved region
+  size_t  used;			// Bytes handed out (bump pointer)
+  size_t  size;			// Bytes of address space reserved
+  size_t  peak;			// Highest used value since last trim
+  size_t  allocs;		// Allocations since it was reserved
+  size_t  spill;		// Pages from here on are file-backed, 0 = none
+} ARENA;
+
+typedef struct _dirlisting {
+  dev_t   dev;			// Key: device of the directory
+  ino_t   ino;			// Key: inode of the directory
+  struct timespec mtime;	// Directory mtime when it was scanned
+  struct timespec ctime;	// Directory ctime when it was scanned
+  ARENA   entries;		// LISTCHOICE records, contiguous
+  ARENA   names;		// Name blob: the names, packed
+  ARENA   metas;		// LISTMETA of the items stat'ed so far
+  unsigned length;		// Items published to readers (atomic)
+  unsigned prefetched;		// Read ahead and not opened yet
+  int     sortMode;		// Order the items are in
+  size_t  accounted;		// Bytes of it in dirCache.bytes, 0 if none
+  int     unspilled;		// No file for the names: they stay in RAM
+  struct _dirlisting *hashNext;	// Next listing in the same bucket
+  struct _dirlisting *lruNext;	// Towards least recently used
+  struct _dirlisting *lruBack;	// Towards most recently used
+} DIRLISTING;
+
+typedef struct _dircache {
+  DIRLISTING *buckets[CACHE_BUCKETS];	// Keyed by (dev, ino)
+  DIRLISTING *mru;		// Most recently used
+  DIRLISTING *lru;		// Least recently used, evicted first
+  DIRLISTING *pinned;		// Listing on display, never evicted
+  size_t  bytes;		// Memory held by all listings
+  size_t  budget;		// Memory budget in bytes
+  unsigned count;		// Listings in the cache
+  unsigned long hits;		// Lookups served from memory
+  unsigned long misses;		// Lookups that needed a scan
+  unsigned long stale;		// Misses caused by a changed directory
+  unsigned long evictions;	// Listings dropped to stay in budget
+} DIRCACHE;
+
+typedef struct _indexheader {
+  char    magic[8];		// INDEX_MAGIC
+  unsigned version;		// INDEX_VERSION
+  unsigned headerSize;		// sizeof(INDEXHEADER): records start here
+  unsigned long long end;	// Records end here; anything after is torn
+  unsigned long long live;	// Bytes of live records
+} INDEXHEADER;
+
+typedef struct _indexrecord {
+  unsigned magic;		// INDEX_LIVE or INDEX_DEAD
+  unsigned count;		// Items, "." and ".." included
+  unsigned long long length;	// Bytes of the record, header included
+  unsigned long long checksum;	// Of the record, this field as 0
+  unsigned long long dev;	// Directory the record is of
+  unsigned long long ino;
+  long long mtime;		// Its mtime and ctime when it was read, ns
+  long long ctime;
+  unsigned long long nameBytes;	// Size of the name blob
+  unsigned metaCount;		// LISTMETA slots
+  unsigned pathLength;		// Path of the directory, for revalidation
+  int     sortMode;		// Order of the items, or INDEX_UNSORTED
+  unsigned reserved;
+} INDEXRECORD;			// Then the path, the items, the metas and
+				// the names, each padded to 8 bytes
+
+typedef struct _indexitem {
+  unsigned name;		// Offset in the record's name blob
+  unsigned isDirectory:1;
+  unsigned meta:31;		// Slot + 1 in the record's metas, 0 = none
+} INDEXITEM;
+
+typedef struct _indexstore {
+  struct _indexstore *next;	// Queued after this one
+} INDEXSTORE;			// Then the record, as it goes in the file
+
+typedef struct _indexslot {
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long offset;	// Live record, 0 = empty, 1 = removed
+} INDEXSLOT;
+
+typedef struct _dirindex {
+  int     fd;			// Index file, -1 if there is none
+  int     writable;		// 0 while another process holds it
+  char   *path;
+  char   *map;			// The file, INDEX_MAP_SIZE reserved
+  unsigned long long end;	// As in the header
+  unsigned long long live;
+  pthread_mutex_t lock;		// Guards the file, the map and the slots
+  INDEXSLOT *slots;		// (dev, ino) -> record, open addressing
+  unsigned slotCount;		// Slots taken, removed ones included
+  unsigned slotSize;
+  pthread_mutex_t queueLock;	// Guards the queue, never held for I/O
+  pthread_cond_t queued;	// A record was queued, or cancel was set
+  INDEXSTORE *queue;		// Records the thread is to append, oldest
+  INDEXSTORE *queueLast;	// first
+  size_t  queueBytes;
+  struct _scanjob *job;		// Its rescans; cancel stops it
+  pthread_t thread;
+  int     started;
+  unsigned long hits;		// Listings served from the index
+  unsigned long stores;		// Records written
+  unsigned long checked;	// Directories revalidated (atomic)
+  unsigned long refreshed;	// Of those, read again (atomic)
+  unsigned long dropped;	// Of those, gone
+  unsigned long compactions;	// Rewrites of the file
+} DIRINDEX;
+
+typedef struct _cell {
+  char    ch;			// Character displayed
+  unsigned char fg;		// Foreground color
+  unsigned char bg;		// Background color
+} CELL;
+
+typedef struct _screen {
+  CELL   *back;			// Frame being composed
+  CELL   *front;		// What the terminal currently shows
+  int     columns;
+  int     rows;
+  int     cursorX;		// Composition cursor (1-based, gotoxy)
+  int     cursorY;
+  unsigned char fg;		// Composition colors (outputcolor)
+  unsigned char bg;
+  char   *out;			// Escape stream of the frame being flushed
+  size_t  outSize;
+  char    scrollOps[MAX];	// Scroll-region sequences for next flush
+  size_t  scrollUsed;
+  unsigned long frameBytes;	// Bytes emitted by the last frame
+  unsigned long totalBytes;	// Bytes emitted since start
+  unsigned long frames;		// Frames flushed
+} SCREEN;
+
+typedef struct _inputbuffer {
+  unsigned char data[INPUT_BUFFER_SIZE];	// Bytes read from stdin
+  int     start;		// Next byte to decode
+  int     end;			// End of valid data
+  int     eof;			// stdin was closed
+  int     dirEvent;		// inotify has events for the open directory
+  int     scanEvent;		// the background scan has news
+  int     resized;		// SIGWINCH came in
+  int     quit;			// SIGINT, SIGTERM, SIGHUP or end of replay
+} INPUTBUFFER;
+
+typedef struct _replay {
+  int     active;		// Keys come from a script, not the terminal
+  int     columns;		// Size of the fake terminal
+  int     rows;
+  char   *script;		// Whole script, NUL-terminated
+  size_t  pos;			// Next token
+  char    key[REPLAY_KEY_SIZE];	// Bytes of the current token
+  int     keyLength;
+  int     keyPos;		// Next character of a text: token
+  int     text;			// The token is typed a character at a time
+  unsigned long repeat;		// Times the current token is still due
+  int     pending;		// A key is in, its frame is not out yet
+  struct timespec injected;	// When it went in
+  unsigned long bytesBefore;	// screen.totalBytes at that moment
+  struct timespec waitUntil;	// Scripted pause: events only
+  int     reportFd;		// The real stdout: results go there
+  double *latency;		// Per key, microseconds
+  unsigned long *frameBytes;	// Per key
+  unsigned long count;
+  unsigned long size;
+  struct timespec start;
+} REPLAY;
+
+typedef struct _stream {
+  int     format;		// STREAM_PLAIN, STREAM_NUL or STREAM_JSON
+  int     recursive;		// Walk the whole tree
+  char   *out;			// Output buffer, STREAM_BUFFER_SIZE bytes
+  size_t  used;
+  int     failed;		// stdout cannot be written any more
+  char   *path;			// Directory being read, relative, '/' ended
+  size_t  pathSize;
+  ARENA   buffers;		// getdents64 buffers of the open levels
+  unsigned long entries;	// Entries printed
+  unsigned long errors;		// Directories that could not be read
+} STREAM;
+
+typedef struct _perf {
+  unsigned long keys;		// Keys whose frame was painted
+  unsigned long latency[PERF_BUCKETS];	// Key-to-paint, by microseconds
+  double  latencySum;		// Microseconds
+  double  latencyLast;
+  double  latencyMax;
+  int     keyPending;		// A key is in, its frame is not out yet
+  struct timespec keyAt;	// When it was read
+  unsigned long scans;		// Scans of the directory on display
+  unsigned long scanEntries;	// Entries they read, all together
+  double  scanSeconds;
+  const char *outPath;		// --perf-out: counters written on exit
+} PERF;
+
+typedef struct _dirwatch {
+  int     inotifyFd;		// inotify instance, -1 if unavailable
+  int     wd;			// Watch on the directory on display
+  int     dirFd;		// Directory on display, for fstatat()
+  DIRLISTING *listing;		// Listing kept in sync with the events
+  unsigned long events;		// Events applied
+  unsigned long rescans;	// Full rescans after a queue overflow
+  LISTCHOICE *known;		// Its items by name, for the size and mtime
+				// orders; NULL until needed
+  unsigned knownMask;		// Slots of known - 1
+  unsigned knownCount;		// Slots taken
+} DIRWATCH;
+
+typedef struct _dirlevel {
+  int     fd;			// O_PATH fd of the directory, -1 if closed
+  size_t  pathLength;		// Length of dirStack.path at this level
+} DIRLEVEL;
+
+typedef struct _dirstack {
+  DIRLEVEL *levels;		// levels[count - 1] is on display
+  unsigned count;
+  unsigned size;
+  char   *path;			// Path of the top, for display only
+  size_t  pathSize;
+  unsigned long hops;		// Directories entered or left
+} DIRSTACK;
+
+typedef struct _scanstats {
+  unsigned long entries;	// Entries read in the last scan
+  unsigned long statCalls;	// fstatat() fallbacks for DT_UNKNOWN
+  unsigned long batches;	// getdents64 calls issued
+  double  seconds;		// Duration of the last scan
+  int     cancelled;		// Stopped before the end: incomplete
+} SCANSTATS;
+
+typedef struct _scanjob {
+  DIRLISTING *listing;		// Listing being filled
+  int     fd;			// Directory being read
+  int     cancel;		// Set by the UI to stop the scan (atomic)
+  int     done;			// Set by the scanner when it ends (atomic)
+  int     progress;		// Signal the UI after every batch (atomic)
+  size_t  budget;		// Give up past these bytes, 0 = none (atomic)
+  pthread_t thread;
+  SCANSTATS stats;		// Counters of this scan
+  int     parentFd;		// Read-ahead: directory name is in, or -1
+  char   *name;			// Read-ahead: directory to open (owned)
+  struct stat st;		// Read-ahead: name once opened
+  struct _scanjob *next;	// Next job let go of, not joined yet
+  char    buffer[SCAN_BUFFER_SIZE];	// getdents64 batch
+} SCANJOB;
+
+typedef struct _prefetch {
+  SCANJOB *job;			// Read-ahead running or not yet collected
+  char   *want;			// Path of the directory under the selector
+  int     pending;		// want has not been read ahead yet
+  unsigned long started;	// Read-aheads started
+  unsigned long ready;		// Read-aheads that completed
+  unsigned long dropped;	// Cancelled or over budget
+  unsigned long opens;		// Directories opened after the first
+  unsigned long hits;		// Opens served by a read-ahead
+} PREFETCH;
+
+typedef struct _sortkey {
+  unsigned long long prefix;	// Orders like the item; radix sorted
+  unsigned record;		// Position of the item before sorting
+  unsigned text;		// Key string in scratchArena, if not the name
+} SORTKEY;			// 16 bytes: two arrays of them per sort
+
+typedef struct _sortcontext {
+  LISTCHOICE *items;		// Names, by record
+  const char *texts;		// scratchArena.base, NULL: keys are names
+} SORTCONTEXT;
+
+typedef struct _filter {
+  int     active;		// The list shows the filter's view
+  int     fuzzy;		// Subsequence instead of substring
+  char    text[MAX_FILTER + 1];	// Typed, lower case
+  unsigned length;
+  DIRLISTING *listing;		// Listing the names were packed from
+  unsigned packed;		// Items packed
+  ARENA   arena;		// names, offsets, then one match set per level
+  char   *names;		// Lower-case names, NAME_SEPARATOR after each
+  unsigned *offsets;		// Item i is names[offsets[i]..offsets[i+1]-1)
+  unsigned *matches[MAX_FILTER + 1];	// Items matching text[0..level)
+  unsigned counts[MAX_FILTER + 1];	// matches[0] is NULL: everything
+  size_t  marks[MAX_FILTER + 1];	// arena.used after each level
+  ARENA   views;		// The view: "." "..", then copies of matches
+  LISTCHOICE *view;
+  unsigned viewCount;
+  double  seconds;		// Matching time of the last keystroke
+  double  viewSeconds;		// Time to build the view after it
+} FILTER;
+
+typedef struct _dutotal {
+  unsigned long long apparent;	// Sum of st_size (atomic)
+  unsigned long long allocated;	// Sum of st_blocks * 512 (atomic)
+  unsigned long long files;	// Files below (atomic)
+  unsigned long long dirs;	// Directories below (atomic)
+} DUTOTAL;
+
+typedef struct _dutask {
+  int     fd;			// Directory to read, owned by the task
+  DUTOTAL *total;		// Where what is below goes; NULL at the top
+} DUTASK;
+
+typedef struct _dudeque {
+  pthread_mutex_t lock;
+  DUTASK *tasks;		// Ring buffer
+  unsigned head;		// Oldest task: thieves take from here
+  unsigned count;
+  unsigned size;
+} DUDEQUE;
+
+typedef struct _duwalk {
+  DIRLISTING *listing;		// Listing the totals belong to, NULL if idle
+  unsigned threads;
+  pthread_t thread[MAX_DU_THREADS];
+  DUDEQUE queue[MAX_DU_THREADS];	// One per thread, work stealing
+  int     pending;		// Tasks queued or being walked (atomic)
+  pthread_mutex_t idleLock;	// idle, and waiting on work
+  pthread_cond_t work;		// Something was queued, or the walk is over
+  unsigned idle;		// Threads waiting on work
+  int     openDirs;		// Fds held by queued tasks (atomic)
+  int     cancel;		// Set by the UI to stop (atomic)
+  int     finished;		// Threads that returned (atomic)
+  ARENA   names;		// Items of the listing when the walk started
+  char  **itemNames;
+  DUTOTAL *totals;		// One per item
+  unsigned count;
+  unsigned *slots;		// Name hash: item + 1, 0 = empty
+  unsigned slotMask;
+  DUTOTAL all;			// The whole tree
+  unsigned long long errors;	// Entries that could not be read (atomic)
+  long long lastSignal;		// ms of the last live update (atomic)
+  pthread_mutex_t linkLock;	// Hard links already counted
+  unsigned long long *links;	// (ino, dev) pairs, open addressing
+  unsigned linkCount;
+  unsigned linkSize;
+  struct timespec start;
+  double  seconds;
+} DUWALK;
+
+typedef struct _grepfile {
+  char   *path;			// Relative to where the search started
+  off_t   size;
+  unsigned long long count;	// Matches so far (atomic)
+  unsigned chunks;		// Chunks not scanned yet (atomic)
+} GREPFILE;
+
+typedef struct _searchtask {
+  char   *path;			// Directory or file to read, owned by the task
+  GREPFILE *file;		// Or the file a chunk is of
+  off_t   offset;		// Start of the chunk
+  unsigned itemType;		// DIRECTORY or FILEITEM
+} SEARCHTASK;
+
+typedef struct _search {
+  int     prompt;		// The prompt is on line 5
+  int     promptMode;		// SEARCH_SUBSTRING ... SEARCH_CONTENT
+  char    text[MAX_SEARCH + 1];	// As typed
+  unsigned length;
+  const char *error;		// Why the last Enter did not start
+  int     mode;			// Of the search running or shown
+  char    pattern[MAX_SEARCH + 1];	// Its text
+  char    lower[MAX_SEARCH + 1];	// Lower case, for SEARCH_SUBSTRING
+  unsigned patternLength;
+  regex_t regex;
+  int     compiled;		// regex is to be freed
+  DIRLISTING *listing;		// Results, NULL if there is no search
+  int     stopping;		// Stopped, threads not joined: not shown
+  ARENA   counts;		// Matches of each result, for content
+  pthread_mutex_t listLock;	// Appends to listing and counts
+  int     rootFd;		// Where the search started
+  unsigned threads;
+  pthread_t thread[MAX_SEARCH_THREADS];
+  char   *buffers;		// Read buffers of each thread
+  pthread_mutex_t lock;		// stack, count, size and pending
+  pthread_cond_t wake;		// A task was queued, or none is left
+  SEARCHTASK *stack;		// Tasks not started yet
+  unsigned count;
+  unsigned size;
+  unsigned pending;		// Tasks queued or being done
+  int     cancel;		// Set by the UI to stop (atomic)
+  int     finished;		// Threads that returned (atomic)
+  unsigned long long dirs;	// Directories read (atomic)
+  unsigned long long files;	// Files scanned, for content (atomic)
+  unsigned long long bytes;	// Bytes of them scanned (atomic)
+  unsigned long long errors;	// What could not be read (atomic)
+  long long lastSignal;		// ms of the last update (atomic)
+  struct timespec start;
+  double  seconds;
+  char   *jump;			// Path of the match entered
+  const char *select;		// Its name, to select once there
+} SEARCH;
+
+typedef struct _metabatch {
+  LISTCHOICE *head;		// List the indices are in (listing or view)
+  int     fd;			// Directory of the names, owned by the batch
+  unsigned count;
+  unsigned index[META_BATCH];	// Rows wanted
+  char   *path[META_BATCH];	// Their names as listed: records may move
+  unsigned offset[META_BATCH];	// Copies of the names in names[]
+  char    names[META_BATCH * 256];
+} METABATCH;
+
+typedef struct _metaresult {
+  LISTCHOICE *head;
+  unsigned index;
+  char   *path;
+  long long size;
+  long long mtime;
+  unsigned mode;
+  unsigned uid;
+} METARESULT;
+
+typedef struct _metaworker {
+  pthread_t thread;
+  int     started;
+  int     quit;
+  pthread_mutex_t lock;		// Guards everything below
+  pthread_cond_t wake;
+  METABATCH request;		// Latest rows wanted by the UI
+  int     requested;		// request not taken by the worker yet
+  METABATCH work;		// Rows being stat'ed
+  METARESULT results[META_BATCH];	// Not collected by the UI yet
+  unsigned resultCount;		// (atomic)
+  int     busy;			// A request is queued or in work (atomic)
+  unsigned ownerCount;
+  unsigned ownerUid[META_OWNERS];
+  char    ownerName[META_OWNERS][9];
+  unsigned long long calls;	// statx() issued (atomic)
+  unsigned long long batches;	// (atomic)
+  LISTCHOICE *postedHead;	// Last request, UI side only
+  char   *posted[META_BATCH];
+  unsigned postedCount;
+} METAWORKER;
+
+typedef struct _statjob {
+  LISTCHOICE *items;		// Items to stat
+  LISTMETA *metas;		// Their slots
+  unsigned count;
+  int     dirFd;		// Directory they are in
+  pthread_t thread;
+} STATJOB;
+
+/* Raw record returned by the getdents64 system call */
+struct linux_dirent64 {
+  unsigned long long d_ino;	// Inode number
+  long long d_off;		// Offset to next record
+  unsigned short d_reclen;	// Length of this record
+  unsigned char d_type;		// DT_DIR, DT_REG, DT_UNKNOWN...
+  char    d_name[];		// Null-terminated name
+};
+
 /*====================================================================*/
 /* GLOBAL VARIABLES */
 /*====================================================================*/
 
 static struct termios old, new;
+static int rawTerminal = 0;	//initTermios() is in effect.
+SCREEN  screen;			//Off-screen frame buffer.
+INPUTBUFFER input;		//Keys read from the terminal in bulk.
 LISTCHOICE *listBox1 = NULL;	//Head pointer.
+SCANSTATS scanStats;		//Counters of the last directory scan.
+ARENA   scratchArena;		//getdents64 buffer and deferred names.
+DIRCACHE dirCache;		//Scanned directories, LRU.
+DIRLISTING *listing1 = NULL;	//Listing shown in listBox1.
+DIRLISTING emptyListing;	//Only "." and "..", for unreadable dirs.
+DIRWATCH dirWatch = { .inotifyFd = -1, .wd = -1, .dirFd = -1 };	//On listing1.
+DIRINDEX dirIndex = { .fd = -1 };	//--index: listings kept on disk.
+SCANJOB *activeScan = NULL;	//Background scan of listing1.
+SCANJOB *scanOrphans = NULL;	//Cancelled scans still running.
+int     scanEventFd = -1;	//eventfd the scanner signals.
+int     signalFd = -1;		//signalfd for SIGWINCH and the quit signals.
+int     listingCached = 0;	//listing1 came from the cache.
+PREFETCH prefetch;		//Read-ahead of the directory under the selector.
+int     sortMode = SORT_NAME;	//Order of the listings.
+double  sortSeconds = 0;	//Duration of the last sort.
+FILTER  filter;			//Type-to-filter on listing1.
+DUWALK  du;			//Recursive totals of listing1.
+SEARCH  search = { .rootFd = -1 };	//Name search below the directory shown.
+__thread sigjmp_buf *grepJump = NULL;	//Chunk this thread is scanning.
+DIRSTACK dirStack;		//Directories from the start to the one shown.
+REPLAY  replay;			//Headless run from a key script.
+METAWORKER meta;		//Stats the rows on display for the columns.
+unsigned metaColumns = META_ALL;	//Columns the m key shows.
+int     metaShown = 0;		//Columns on display.
+int     itemWidth = DEFAULT_ITEM_WIDTH;	//Columns of the names in the list.
+size_t  nameBudget = (size_t)DEFAULT_NAMES_MB << 20;	//Names in RAM, per listing.
+const char *spillDir = DEFAULT_SPILL_DIR;	//Where the rest goes.
+PERF    perf;			//Counters behind the HUD and --perf-out.
+int     hudShown = 0;		//HUD on lines 3-4.
+const char *sortNames[SORT_MODES] = { "name", "natural", "size", "mtime",
+  "ext"
+};
 
 /*====================================================================*/
 /* PROTOTYPES OF FUNCTIONS                                            */
@@ -103,13 +739,85 @@ void    cleanLine(int line, int backcolor, int forecolor);
 void    outputcolor(int foreground, int background);
 void    initTermios(int echo);
 void    resetTermios(void);
+void    restoreTerminal(void);
 char    getch();
+int     fillInput(int timeout);
+int     decodeKey(int *length);
+int     readKey(unsigned *count);
 void    draw_window(int x1, int y1, int x2, int y2, int backcolor);
 
+//FRAME BUFFER FUNCTIONS
+int     screenInit(void);
+void    screenEnd(void);
+void    screenFill(int x1, int y1, int x2, int y2, int fg, int bg);
+int     screenPrintf(const char *format, ...);
+void    screenFlush(void);
+void    screenScroll(int top, int bottom, int lines);
+int     screenResize(void);
+void    showTitle(void);
+
+//ARENA FUNCTIONS
+int     arenaInit(ARENA * arena, size_t size);
+void   *arenaAlloc(ARENA * arena, size_t size);
+char   *arenaStrdup(ARENA * arena, const char *string);
+void   *arenaAppend(ARENA * arena, const void *data, size_t size);
+void    arenaReset(ARENA * arena);
+void    arenaFree(ARENA * arena);
+int     arenaSpill(ARENA * arena, const char *dir);
+void    arenaTrim(ARENA * arena, size_t from);
+
 //DYNAMIC LINKED LIST FUNCTIONS
-void    deleteList(LISTCHOICE ** head);
+void    deleteList(DIRLISTING * listing);
 LISTCHOICE *addend(LISTCHOICE * head, LISTCHOICE * newp);
-LISTCHOICE *newelement(char *text, char *itemPath, unsigned itemType);
+LISTCHOICE *newelement(DIRLISTING * listing, const char *name,
+		       unsigned itemType);
+LISTCHOICE *listingHead(DIRLISTING * listing);
+unsigned listingLength(DIRLISTING * listing);
+unsigned listingCount(DIRLISTING * listing);
+unsigned listingDirs(DIRLISTING * listing);
+int     listingFind(DIRLISTING * listing, const char *name);
+int     listingInsert(DIRLISTING * listing, unsigned pos,
+		      const char *name, unsigned itemType);
+void    listingRemove(DIRLISTING * listing, unsigned pos);
+void    listingMove(DIRLISTING * listing, unsigned from, unsigned to);
+
+//DIRECTORY WATCH FUNCTIONS
+void    watchDirectory(DIRLISTING * listing);
+int     applyDirEvents(SCROLLDATA * scrollData);
+int     watchFind(DIRLISTING * listing, const char *name,
+		  unsigned itemType);
+LISTCHOICE *watchKnown(DIRLISTING * listing, const char *name);
+int     watchRemember(LISTCHOICE * item);
+void    watchForget(const char *name);
+void    watchForgetAll(void);
+
+//DIRECTORY CACHE FUNCTIONS
+DIRLISTING *openListing(int fd, int *cacheHit);
+DIRLISTING *newListing(void);
+void    freeListing(DIRLISTING * listing);
+int     listingFresh(DIRLISTING * listing, struct stat *st);
+DIRLISTING *cacheLookup(struct stat *st);
+void    cacheInsert(DIRLISTING * listing);
+void    cacheTouch(DIRLISTING * listing);
+void    cacheUnlink(DIRLISTING * listing);
+void    cacheEvict(void);
+size_t  listingBytes(DIRLISTING * listing);
+void    cacheAccount(DIRLISTING * listing);
+void    listingSpill(DIRLISTING * listing, size_t from);
+const LISTMETA *itemMeta(DIRLISTING * listing, LISTCHOICE * item);
+LISTMETA *itemMetaSlot(DIRLISTING * listing, LISTCHOICE * item);
+
+//PERSISTENT INDEX FUNCTIONS
+int     indexOpen(const char *path);
+void    indexClose(void);
+int     indexFresh(struct stat *st);
+int     indexLoad(DIRLISTING * listing, struct stat *st);
+void    indexStore(DIRLISTING * listing, const char *path);
+INDEXSTORE *indexBuild(DIRLISTING * listing, const char *path, int order);
+int     indexWrite(DIRLISTING * listing, const char *path, int order);
+void    indexCompact(void);
+void    indexRevalidate(void);
+void   *indexThread(void *arg);
 
 //LISTBOX FUNCTIONS
 char    listBox(LISTCHOICE * selector, unsigned whereX, unsigned whereY,
@@ -122,16 +830,179 @@ void    loadlist(LISTCHOICE * head, SCROLLDATA * scrollData,
 void    gotoIndex(LISTCHOICE ** aux, SCROLLDATA * scrollData,
 		  unsigned indexAt);
 int     query_length(LISTCHOICE ** head);
-int     move_selector(LISTCHOICE ** head, SCROLLDATA * scrollData);
+int     move_selector(LISTCHOICE ** head, SCROLLDATA * scrollData,
+		      unsigned rows);
+int     selectIndex(LISTCHOICE ** selector, SCROLLDATA * scrollData,
+		    unsigned target);
 char    selectorMenu(LISTCHOICE * aux, SCROLLDATA * scrollData);
 void    displayItem(LISTCHOICE * aux, SCROLLDATA * scrollData, int select);
+void    setScroll(SCROLLDATA * scrollData, unsigned length);
 
 //LISTFILES FUNCTIONS
-int     listFiles(LISTCHOICE ** listBox1, char *directory);
-int     addSpaces(char temp[MAX_ITEM_LENGTH]);
-void    cleanString(char *string, int max);
-void    changeDir(SCROLLDATA * scrollData, char fullPath[MAX],
-		  char newDir[MAX]);
+int     listFiles(DIRLISTING * listing, int fd);
+void    addDots(DIRLISTING * listing);
+void    scanEntries(DIRLISTING * listing, int fd, char *buffer,
+		    SCANSTATS * stats, SCANJOB * job);
+void    listingPartition(DIRLISTING * listing);
+
+//FILTER FUNCTIONS
+int     filterStart(void);
+void    filterPack(void);
+void    filterLevel(unsigned level);
+void    filterRebuild(void);
+void    filterView(void);
+void    filterClear(void);
+int     filterKey(int key, SCROLLDATA * scrollData);
+unsigned filterSource(unsigned viewIndex);
+unsigned filterFind(unsigned listingIndex);
+long    findSubstring(const char *haystack, size_t length,
+		      const char *needle, size_t needleLength);
+unsigned scanNames(const char *text, size_t textLength, unsigned *matches);
+int     matchFuzzy(const char *name, size_t length, const char *text,
+		   size_t textLength);
+void    showFilterStatus(void);
+
+//TREE WALK FUNCTIONS
+int     duStart(void);
+void    duStop(void);
+void    duReap(void);
+int     duProgress(void);
+void   *duThread(void *arg);
+void    duWalkDir(DUTASK * task, unsigned self, char *buffer);
+void    duPush(unsigned self, DUTASK * task);
+int     duPop(unsigned self, DUTASK * task);
+int     duSteal(unsigned self, DUTASK * task);
+DUTOTAL *duLookup(const char *name);
+int     duFirstLink(dev_t dev, ino_t ino);
+void    duSignal(void);
+void    duWake(int all);
+void    formatSize(char out[DU_COLUMN], unsigned long long bytes);
+void    showDuStatus(void);
+
+//SEARCH FUNCTIONS
+int     searchKey(int key);
+int     searchStart(void);
+void    searchStop(void);
+void    searchReap(void);
+int     searchRunning(void);
+int     searchProgress(void);
+int     searchSelect(SCROLLDATA * scrollData);
+void   *searchThread(void *arg);
+void    searchDir(const char *path, char *buffer);
+void    searchPush(SEARCHTASK * task);
+int     searchPop(SEARCHTASK * task);
+void    searchDrop(SEARCHTASK * task);
+int     searchMatch(const char *name, size_t length);
+void    searchHit(const char *path, unsigned itemType,
+		  unsigned long long matches);
+unsigned long long searchCount(LISTCHOICE * item);
+void    formatCount(char out[DU_COLUMN], unsigned long long count);
+void    searchSignal(void);
+void    showSearchStatus(void);
+void    grepFile(char *path, char *buffer);
+void    grepChunk(GREPFILE * file, off_t offset, int fd);
+void    grepDone(GREPFILE * file);
+unsigned long long grepCount(const char *data, size_t length,
+			     size_t limit);
+void    grepBus(int number);
+
+//METADATA COLUMN FUNCTIONS
+void    metaRequest(SCROLLDATA * scrollData);
+int     metaCollect(SCROLLDATA * scrollData);
+void   *metaThread(void *arg);
+void    metaStat(int dirFd, const char *name, METARESULT * out);
+void    metaOwner(unsigned uid, char out[9]);
+void    metaStop(void);
+int     metaWidth(void);
+void    metaFormat(LISTCHOICE * aux, char *out, size_t size);
+unsigned parseMetaColumns(const char *text);
+void    drawListWindow(void);
+int     windowRight(void);
+
+//SORT FUNCTIONS
+void    listingArrange(DIRLISTING * listing, int dirFd, unsigned *follow);
+unsigned listingSettle(DIRLISTING * listing, unsigned index, int dirFd,
+		       unsigned *follow);
+int     compareItems(DIRLISTING * listing, LISTCHOICE * item,
+		     LISTCHOICE * probe, const char *probeKey);
+unsigned long long metaPrefix(const LISTMETA * info, int order);
+void    listingSort(DIRLISTING * listing, unsigned from, unsigned to,
+		    int dirFd);
+void    listingStat(DIRLISTING * listing, LISTCHOICE * items,
+		    unsigned count, int dirFd);
+void   *statThread(void *arg);
+char   *naturalKey(ARENA * arena, const char *name);
+char   *extensionKey(ARENA * arena, const char *name);
+unsigned long long keyPrefix(const char *text);
+void    radixSort(SORTKEY * keys, SORTKEY * temp, unsigned count);
+int     compareKeys(const void *a, const void *b, void *context);
+int     parseSortMode(const char *name);
+void    showSortStatus(void);
+
+//BACKGROUND SCAN FUNCTIONS
+int     startScan(DIRLISTING * listing, int fd);
+void   *scanThread(void *arg);
+int     waitScan(int timeout);
+void    finishScan(void);
+void    cancelScan(void);
+void    scanOrphan(SCANJOB * job);
+void    scanReap(void);
+void    scanJobFree(SCANJOB * job);
+int     scanProgress(SCROLLDATA * scrollData);
+void    showScanStatus(int cacheHit);
+
+//PREFETCH FUNCTIONS
+void    prefetchRequest(LISTCHOICE * item);
+int     prefetchPending(void);
+void    prefetchStart(void);
+void   *prefetchThread(void *arg);
+int     prefetchRead(SCANJOB * job);
+void    prefetchCollect(void);
+void    prefetchDrop(void);
+int     prefetchClaim(struct stat *st);
+void    showPrefetchStatus(void);
+void    formatItem(char *temp, const char *name, unsigned itemType,
+		   int width);
+unsigned resolveType(int dirFd, const char *name, unsigned char d_type);
+double  elapsedSeconds(struct timespec *start);
+int     changeDir(SCROLLDATA * scrollData);
+
+//REPLAY FUNCTIONS
+int     replayInit(const char *scriptPath, const char *outPath,
+		   const char *size);
+int     replayStep(int timeout);
+int     replayToken(void);
+void    replayReport(void);
+
+//PERFORMANCE HUD FUNCTIONS
+void    perfKey(void);
+void    perfPaint(void);
+double  perfPercentile(double fraction);
+void    showHud(void);
+void    perfDump(void);
+
+//STREAMING OUTPUT FUNCTIONS
+int     streamMain(const char *where, int format, int recursive);
+void    streamDir(STREAM * stream, int fd, size_t pathLength);
+void    streamEntry(STREAM * stream, size_t pathLength, const char *name,
+		    unsigned itemType, unsigned long long ino);
+
+//BENCHMARK FUNCTIONS
+int     benchMain(const char *sizes, const char *where, int dirPercent);
+int     benchGenerate(int parentFd, const char *name, unsigned long count,
+		      int dirPercent, unsigned long long *seed);
+void    benchRemove(int parentFd, const char *name);
+void    benchReport(const char *phase, DIRLISTING * listing,
+		    unsigned long count, struct timespec *start,
+		    size_t allocs, unsigned long ops);
+
+//NAVIGATION FUNCTIONS
+int     dirStackInit(void);
+int     dirStackTop(void);
+int     dirOpenTop(void);
+int     dirEnter(const char *name);
+int     dirLeave(void);
+void    showPath(void);
 
   /*====================================================================*/
 /* CODE */
@@ -140,68 +1011,662 @@ void    changeDir(SCROLLDATA * scrollData, char fullPath[MAX],
 /* ------------------------------ */
 /* Terminal manipulation routines */
 /* ------------------------------ */
+/*
+Nothing is written to the terminal while a frame is being composed:
+gotoxy(), outputcolor() and screenPrintf() draw into screen.back. Before
+waiting for a key, screenFlush() compares it with screen.front (what the
+terminal shows) and emits only the cells that changed, in one write().
+*/
 void clear() {
-  printf("\033[2J\033[1;1H");
+  screenFill(1, 1, screen.columns, screen.rows, F_WHITE, screen.bg);
+  gotoxy(1, 1);
 }
 
 void gotoxy(int x, int y)
 //Sets the cursor at the desired position.
 {
-  printf("%c[%d;%df", 0x1B, y, x);
+  screen.cursorX = x < 1 ? 1 : x;
+  screen.cursorY = y < 1 ? 1 : y;
 }
 
 void outputcolor(int foreground, int background)
 //Changes format foreground and background colors of display.
 {
-  printf("%c[%d;%dm", 0x1b, foreground, background);
+  screen.fg = foreground;
+  screen.bg = background;
 }
 
 /* Initialize new terminal i/o settings */
+/* Called once: the terminal stays in this mode for the whole session. */
 void initTermios(int echo) {
   tcgetattr(0, &old);		/* grab old terminal i/o settings */
   new = old;			/* make new settings same as old settings */
   new.c_lflag &= ~ICANON;	/* disable buffered i/o */
   new.c_lflag &= echo ? ECHO : ~ECHO;	/* set echo mode */
+  new.c_cc[VMIN] = 1;		/* read() returns as soon as a key is in */
+  new.c_cc[VTIME] = 0;
   tcsetattr(0, TCSANOW, &new);	/* use these new terminal i/o settings now */
+  rawTerminal = 1;
 }
 
 /* Restore old terminal i/o settings */
 void resetTermios(void) {
   tcsetattr(0, TCSANOW, &old);
+  rawTerminal = 0;
+}
+
+void restoreTerminal(void) {
+//atexit() hook for the ways out that skip screenEnd(): puts back the
+//scroll region, colors, cursor and terminal settings.
+  const char *reset = "\033[r\033[0m\033[?25h";
+
+  if(!rawTerminal)
+    return;
+  write(STDOUT_FILENO, reset, strlen(reset));
+  resetTermios();
+}
+
+int fillInput(int timeout) {
+/*
+Reads whatever the terminal has queued into the input buffer with one
+read(). Waits up to timeout ms (-1 = forever); the frame is flushed only
+when we are about to block, so keys that are already queued are handled
+without painting intermediate frames. Returns bytes available.
+*/
+  struct pollfd pfd[4];
+  struct signalfd_siginfo info;
+  ssize_t n;
+
+  if(input.start == input.end)
+    input.start = input.end = 0;
+  else if(input.start > 0) {
+    memmove(input.data, input.data + input.start, input.end - input.start);
+    input.end -= input.start;
+    input.start = 0;
+  }
+  pfd[0].fd = replay.active ? -1 : STDIN_FILENO;
+  pfd[0].events = POLLIN;
+  //Negative fds are ignored. inotify events wait until the scanner
+  //is done with the listing.
+  pfd[1].fd = activeScan == NULL ? dirWatch.inotifyFd : -1;
+  pfd[1].events = POLLIN;
+  pfd[2].fd = activeScan != NULL || prefetch.job != NULL
+      || scanOrphans != NULL || du.threads > 0 || search.threads > 0
+      || __atomic_load_n(&meta.busy, __ATOMIC_ACQUIRE)
+      || __atomic_load_n(&meta.resultCount, __ATOMIC_ACQUIRE) ?
+      scanEventFd : -1;
+  pfd[2].events = POLLIN;
+  pfd[3].fd = signalFd;
+  pfd[3].events = POLLIN;
+  pfd[0].revents = pfd[1].revents = pfd[2].revents = pfd[3].revents = 0;
+  if(poll(pfd, 4, 0) <= 0) {
+    if(timeout == 0)
+      return input.end - input.start;
+    screenFlush();		//Show the frame before waiting.
+    perfPaint();
+    if(replay.active)
+      timeout = replayStep(timeout);	//Next scripted key, or a pause
+    if(input.start != input.end || poll(pfd, 4, timeout) <= 0)
+      return input.end - input.start;
+  }
+  if(pfd[1].revents & POLLIN)
+    input.dirEvent = 1;
+  if(pfd[2].revents & POLLIN)
+    input.scanEvent = 1;
+  if(pfd[3].revents & POLLIN) {
+    while(read(signalFd, &info, sizeof(info)) > 0) {
+      if(info.ssi_signo == SIGWINCH)
+	input.resized = 1;
+      else
+	input.quit = 1;		//Left through the normal exit path
+    }
+  }
+  if(!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+    return input.end - input.start;
+  n = read(STDIN_FILENO, input.data + input.end,
+	   INPUT_BUFFER_SIZE - input.end);
+  if(n > 0) {
+    input.end += n;
+    perfKey();
+  } else if(n == 0)
+    input.eof = 1;
+  return input.end - input.start;
 }
 
 /* Read 1 character - no echo */
 char getch() {
-  char    ch;
-  initTermios(0);
-  ch = getchar();
-  resetTermios();
-  return ch;
+  while(input.start == input.end) {
+    fillInput(-1);
+    if(input.eof && input.start == input.end)
+      return K_ENTER;		//stdin closed: behave as enter
+  }
+  return input.data[input.start++];
+}
+
+int decodeKey(int *length) {
+//Decodes the key at the start of the buffer without consuming it.
+//Sets *length to the bytes it spans; 0 if the sequence is incomplete.
+  unsigned char *p = input.data + input.start;
+  int     avail = input.end - input.start;
+  int     i;
+
+  *length = 0;
+  if(avail == 0)
+    return 0;
+  if(p[0] != K_ESCAPE) {
+    *length = 1;
+    return p[0];
+  }
+  if(avail == 1) {
+    *length = 1;
+    return K_ESCAPE;
+  }
+  if(p[1] != '[' && p[1] != 'O') {
+    *length = 1;
+    return K_ESCAPE;
+  }
+  //CSI / SS3: parameters then a final byte
+  for(i = 2; i < avail; i++) {
+    if(p[i] >= 0x40 && p[i] <= 0x7e)
+      break;
+  }
+  if(i == avail)
+    return 0;			//Incomplete
+  *length = i + 1;
+  switch (p[i]) {
+    case K_UP_ARROW:
+      return K_UP;
+    case K_DOWN_ARROW:
+      return K_DOWN;
+    case K_HOME_KEY:
+      return K_HOME;
+    case K_END_KEY:
+      return K_END;
+    case '~':
+      switch (p[2]) {
+	case '1':
+	case '7':
+	  return K_HOME;
+	case '4':
+	case '8':
+	  return K_END;
+	case '5':
+	  return K_PAGE_UP;
+	case '6':
+	  return K_PAGE_DOWN;
+      }
+      break;
+  }
+  return -1;			//Unknown sequence, skipped
+}
+
+int readKey(unsigned *count) {
+/*
+Returns the next key. Movement keys that are already queued behind it
+(key repeat) are consumed too and reported in *count, so the caller can
+move several rows with a single repaint.
+*/
+  int     key, next, length;
+
+  *count = 1;
+  do {
+    while(input.start == input.end) {
+      //Keys first; directory changes are reported once input is idle
+      if(input.quit)
+	return K_QUIT;
+      if(input.resized) {
+	input.resized = 0;
+	return K_RESIZE;
+      }
+      if(input.scanEvent) {
+	input.scanEvent = 0;
+	return K_SCAN_PROGRESS;
+      }
+      if(input.dirEvent) {
+	input.dirEvent = 0;
+	return K_DIR_CHANGED;
+      }
+      if(prefetchPending()) {
+	//The selector rests on a directory: read it ahead
+	if(fillInput(PREFETCH_DELAY) == 0 && !input.scanEvent
+	   && !input.dirEvent && !input.resized && !input.eof)
+	  prefetchStart();
+	continue;
+      }
+      fillInput(-1);
+      if(input.eof && input.start == input.end)
+	return K_ENTER;		//stdin closed: behave as enter
+    }
+    key = decodeKey(&length);
+    if(length == 0 || key == K_ESCAPE) {
+      //Sequence split across reads, or a lone Esc: wait briefly
+      fillInput(ESCAPE_TIMEOUT);
+      key = decodeKey(&length);
+      if(length == 0) {
+	length = 1;
+	key = K_ESCAPE;
+      }
+    }
+    input.start += length;
+  } while(key < 0);
+
+  if(key == K_UP || key == K_DOWN || key == K_PAGE_UP
+     || key == K_PAGE_DOWN) {
+    fillInput(0);
+    while((next = decodeKey(&length)) == key && length > 0) {
+      input.start += length;
+      (*count)++;
+      if(input.start == input.end)
+	fillInput(0);
+    }
+  }
+  return key;
 }
 
 //draw window area 
 
 void draw_window(int x1, int y1, int x2, int y2, int backcolor) {
-  int     i, j;
-  
   //window
-  for(j = y1; j <= y2; j++)
-    for(i = x1; i <= x2; i++) {
-      gotoxy(i, j);
-      outputcolor(F_WHITE, backcolor);
-      printf("%c", FILL_CHAR);
-    }
+  screenFill(x1, y1, x2, y2, F_WHITE, backcolor);
 }
 
 void cleanLine(int line, int backcolor, int forecolor) {
 //Cleans line of console.
-  int     i;
-  for(i = 0; i < 80; i++) {
-    //clean line where path is displayed.
-    outputcolor(forecolor, backcolor);
-    gotoxy(i, line);
-    printf("%c", FILL_CHAR);	//space
+  screenFill(1, line, screen.columns, line, forecolor, backcolor);
+}
+
+/* --------------------- */
+/* Frame buffer routines */
+/* --------------------- */
+
+int screenInit(void) {
+//Sizes the buffers to the terminal. The front buffer starts with cells
+//that can never be drawn, so the first frame paints everything.
+  struct winsize w;
+  size_t  cells;
+
+  screen.columns = DEFAULT_COLUMNS;
+  screen.rows = DEFAULT_ROWS;
+  if(replay.active) {
+    screen.columns = replay.columns;
+    screen.rows = replay.rows;
+  } else if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0
+	    && w.ws_row > 0) {
+    screen.columns = w.ws_col;
+    screen.rows = w.ws_row;
+  }
+  cells = (size_t)screen.columns * screen.rows;
+  screen.back = (CELL *) malloc(cells * sizeof(CELL));
+  screen.front = (CELL *) malloc(cells * sizeof(CELL));
+  //Worst case per cell: cursor jump + color change + character
+  screen.outSize = cells * 24 + 64;
+  screen.out = (char *)malloc(screen.outSize);
+  if(screen.back == NULL || screen.front == NULL || screen.out == NULL)
+    return -1;
+  memset(screen.front, 0, cells * sizeof(CELL));
+  screen.fg = F_WHITE;
+  screen.bg = B_BLACK;
+  screenFill(1, 1, screen.columns, screen.rows, F_WHITE, B_BLACK);
+  gotoxy(1, 1);
+  screen.frameBytes = screen.totalBytes = screen.frames = 0;
+  screen.scrollUsed = 0;
+  //Hide the cursor while browsing
+  write(STDOUT_FILENO, "\033[?25l", 6);
+  return 0;
+}
+
+int screenResize(void) {
+/*
+Called after SIGWINCH. Sizes the buffers to the terminal again and
+keeps what is composed where it still fits; the rest is background.
+Every cell is painted on the next flush. Returns 1 if the size changed,
+0 if not, -1 if the new buffers could not be had (the old ones stay).
+*/
+  struct winsize w;
+  CELL   *back, *front, blank = { FILL_CHAR, F_WHITE, B_BLUE };
+  char   *out;
+  size_t  cells, outSize;
+  int     x, y;
+
+  if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 || w.ws_col == 0
+     || w.ws_row == 0
+     || (w.ws_col == screen.columns && w.ws_row == screen.rows))
+    return 0;
+  cells = (size_t)w.ws_col * w.ws_row;
+  outSize = cells * 24 + 64;
+  back = (CELL *) malloc(cells * sizeof(CELL));
+  front = (CELL *) malloc(cells * sizeof(CELL));
+  out = (char *)malloc(outSize);
+  if(back == NULL || front == NULL || out == NULL) {
+    free(back);
+    free(front);
+    free(out);
+    return -1;
+  }
+  for(y = 0; y < w.ws_row; y++)
+    for(x = 0; x < w.ws_col; x++)
+      back[(size_t)y * w.ws_col + x] = y < screen.rows && x < screen.columns ?
+	  screen.back[(size_t)y * screen.columns + x] : blank;
+  memset(front, 0, cells * sizeof(CELL));
+  free(screen.back);
+  free(screen.front);
+  free(screen.out);
+  screen.back = back;
+  screen.front = front;
+  screen.out = out;
+  screen.outSize = outSize;
+  screen.columns = w.ws_col;
+  screen.rows = w.ws_row;
+  screen.scrollUsed = 0;	//Regions of the old size
+  return 1;
+}
+
+void screenEnd(void) {
+//Restore colors and cursor, clear the terminal.
+  const char *reset = "\033[0m\033[37;40m\033[2J\033[1;1H\033[?25h";
+  write(STDOUT_FILENO, reset, strlen(reset));
+  free(screen.back);
+  free(screen.front);
+  free(screen.out);
+  screen.back = screen.front = NULL;
+}
+
+void screenFill(int x1, int y1, int x2, int y2, int fg, int bg) {
+//Fill a rectangle (1-based, inclusive) with FILL_CHAR.
+  int     i, j;
+  CELL   *row;
+  if(x1 < 1)
+    x1 = 1;
+  if(y1 < 1)
+    y1 = 1;
+  if(x2 > screen.columns)
+    x2 = screen.columns;
+  if(y2 > screen.rows)
+    y2 = screen.rows;
+  for(j = y1; j <= y2; j++) {
+    row = screen.back + (size_t)(j - 1) * screen.columns;
+    for(i = x1; i <= x2; i++) {
+      row[i - 1].ch = FILL_CHAR;
+      row[i - 1].fg = fg;
+      row[i - 1].bg = bg;
+    }
+  }
+}
+
+int screenPrintf(const char *format, ...) {
+//printf() into the frame buffer at the cursor with the current colors.
+//Text is clipped at the right edge; '\n' moves to the next line.
+  char    text[MAX * 2];
+  va_list args;
+  int     len, i;
+  CELL   *cell;
+
+  va_start(args, format);
+  len = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if(len > (int)sizeof(text) - 1)
+    len = sizeof(text) - 1;
+  for(i = 0; i < len; i++) {
+    if(text[i] == '\n') {
+      screen.cursorX = 1;
+      screen.cursorY++;
+      continue;
+    }
+    if(screen.cursorY <= screen.rows && screen.cursorX <= screen.columns) {
+      cell = screen.back + (size_t)(screen.cursorY - 1) * screen.columns +
+	  screen.cursorX - 1;
+      cell->ch = (text[i] < ' ') ? ' ' : text[i];
+      cell->fg = screen.fg;
+      cell->bg = screen.bg;
+    }
+    screen.cursorX++;
+  }
+  return len;
+}
+
+void screenFlush(void) {
+/*
+Emits the difference between the composed frame and the terminal.
+Changed cells are sent in runs; the cursor is only moved when a run does
+not start where the previous one ended (short gaps of unchanged cells
+are simply rewritten) and colors are only sent when they change.
+*/
+  int     x, y, gap, termX = -1, termY = -1;
+  int     termFg = -1, termBg = -1;
+  size_t  used = 0, offset;
+  ssize_t n;
+  CELL   *back, *front;
+
+  if(screen.back == NULL)
+    return;
+  //Pending scroll-region moves go first; screen.front already
+  //reflects them.
+  memcpy(screen.out, screen.scrollOps, screen.scrollUsed);
+  used = screen.scrollUsed;
+  screen.scrollUsed = 0;
+  for(y = 0; y < screen.rows; y++) {
+    back = screen.back + (size_t)y * screen.columns;
+    front = screen.front + (size_t)y * screen.columns;
+    for(x = 0; x < screen.columns; x++) {
+      if(back[x].ch == front[x].ch && back[x].fg == front[x].fg
+	 && back[x].bg == front[x].bg)
+	continue;
+      gap = x - termX;
+      if(termY == y && gap > 0 && gap <= SHORT_GAP) {
+	//Rewrite the few unchanged cells in between, if same colors
+	while(termX < x && back[termX].fg == termFg
+	      && back[termX].bg == termBg) {
+	  screen.out[used++] = back[termX].ch;
+	  termX++;
+	}
+      }
+      if(termY != y || termX != x)
+	used += sprintf(screen.out + used, "\033[%d;%dH", y + 1, x + 1);
+      if(back[x].fg != termFg || back[x].bg != termBg) {
+	if(back[x].bg != termBg && back[x].fg != termFg)
+	  used += sprintf(screen.out + used, "\033[%d;%dm", back[x].fg,
+			  back[x].bg);
+	else if(back[x].fg != termFg)
+	  used += sprintf(screen.out + used, "\033[%dm", back[x].fg);
+	else
+	  used += sprintf(screen.out + used, "\033[%dm", back[x].bg);
+	termFg = back[x].fg;
+	termBg = back[x].bg;
+      }
+      screen.out[used++] = back[x].ch;
+      front[x] = back[x];
+      termX = x + 1;
+      termY = y;
+      if(termX >= screen.columns)
+	termY = -1;		//Cursor position after last column is unreliable
+    }
+  }
+  //One write per frame
+  for(offset = 0; offset < used; offset += n) {
+    n = write(STDOUT_FILENO, screen.out + offset, used - offset);
+    if(n <= 0)
+      break;
+  }
+  if(used > 0) {
+    screen.frameBytes = used;
+    screen.totalBytes += used;
+    screen.frames++;
+  }
+}
+
+void screenScroll(int top, int bottom, int lines) {
+/*
+Moves rows top..bottom (1-based) of the terminal up (lines > 0) or down
+(lines < 0) with a scroll region (DECSTBM + SU/SD). The same move is
+applied to screen.front and the rows it exposes are marked unknown, so
+the next flush only has to paint those rows. The terminal scrolls whole
+lines: whatever the caller renders into the back buffer is still
+compared cell by cell, so cells outside the scrolled area stay right.
+*/
+  int     n, y, from;
+  size_t  rowBytes = (size_t)screen.columns * sizeof(CELL);
+
+  if(top < 1)
+    top = 1;
+  if(bottom > screen.rows)
+    bottom = screen.rows;
+  n = lines < 0 ? -lines : lines;
+  if(n == 0 || top >= bottom || n > bottom - top
+     || screen.scrollUsed + 32 > sizeof(screen.scrollOps))
+    return;
+
+  screen.scrollUsed +=
+      sprintf(screen.scrollOps + screen.scrollUsed, "\033[%d;%dr\033[%d%c\033[r",
+	      top, bottom, n, lines > 0 ? 'S' : 'T');
+  if(lines > 0) {
+    memmove(screen.front + (size_t)(top - 1) * screen.columns,
+	    screen.front + (size_t)(top - 1 + n) * screen.columns,
+	    rowBytes * (bottom - top + 1 - n));
+    from = bottom - n + 1;
+  } else {
+    memmove(screen.front + (size_t)(top - 1 + n) * screen.columns,
+	    screen.front + (size_t)(top - 1) * screen.columns,
+	    rowBytes * (bottom - top + 1 - n));
+    from = top;
+  }
+  for(y = from; y < from + n; y++)
+    memset(screen.front + (size_t)(y - 1) * screen.columns, 0, rowBytes);
+}
+
+/* -------------- */
+/* Arena routines */
+/* -------------- */
+
+int arenaInit(ARENA * arena, size_t size) {
+//Reserves address space for a bump allocator. Pages are populated on
+//first touch; if the reservation is refused it is halved until it fits.
+  void   *base = MAP_FAILED;
+
+  while(size >= ARENA_KEEP) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base != MAP_FAILED)
+      break;
+    size /= 2;
+  }
+  if(base == MAP_FAILED)
+    return -1;
+  arena->base = (char *)base;
+  arena->used = 0;
+  arena->size = size;
+  arena->peak = 0;
+  arena->allocs = 0;
+  arena->spill = 0;
+  return 0;
+}
+
+void   *arenaAlloc(ARENA * arena, size_t size) {
+//Bump allocation, aligned to pointer size.
+  char   *p;
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if(arena->base == NULL || arena->used + size > arena->size)
+    return NULL;
+  p = arena->base + arena->used;
+  arena->used += size;
+  arena->allocs++;
+  if(arena->used > arena->peak)
+    arena->peak = arena->used;
+  return p;
+}
+
+char   *arenaStrdup(ARENA * arena, const char *string) {
+  size_t  len = strlen(string) + 1;
+  char   *p = (char *)arenaAlloc(arena, len);
+  if(p != NULL)
+    memcpy(p, string, len);
+  return p;
+}
+
+void   *arenaAppend(ARENA * arena, const void *data, size_t size) {
+//Unaligned copy to the end of the arena, for packed byte streams.
+  char   *p;
+  if(arena->base == NULL || arena->used + size > arena->size)
+    return NULL;
+  p = arena->base + arena->used;
+  memcpy(p, data, size);
+  arena->used += size;
+  arena->allocs++;
+  if(arena->used > arena->peak)
+    arena->peak = arena->used;
+  return p;
+}
+
+void arenaFree(ARENA * arena) {
+  if(arena->base != NULL)
+    munmap(arena->base, arena->size);
+  arena->base = NULL;
+  arena->used = arena->size = arena->peak = 0;
+}
+
+void arenaReset(ARENA * arena) {
+//Releases everything at once. After a very large directory the pages
+//above ARENA_KEEP are given back to the system.
+  if(arena->spill > 0) {
+    //Anonymous memory again: the temp file goes with the mapping
+    mmap(arena->base + arena->spill, arena->size - arena->spill,
+	 PROT_READ | PROT_WRITE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    arena->spill = 0;
+  }
+  if(arena->peak > ARENA_KEEP) {
+    madvise(arena->base + ARENA_KEEP, arena->peak - ARENA_KEEP,
+	    MADV_DONTNEED);
   }
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+int arenaSpill(ARENA * arena, const char *dir) {
+/*
+Backs the rest of the reservation, from the first untouched page on,
+with an unlinked file in dir. What is written there can be written back
+and dropped from memory (arenaTrim()) instead of staying in RAM, and is
+read back when touched. Addresses do not change. -1 if it cannot be.
+*/
+  size_t  page = sysconf(_SC_PAGESIZE), at;
+  char    path[MAX];
+  int     fd;
+
+  at = (arena->used + page - 1) & ~(page - 1);
+  if(arena->base == NULL || arena->spill > 0 || at >= arena->size)
+    return -1;
+  fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if(fd < 0) {
+    snprintf(path, sizeof(path), "%s/fbrowser-names.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if(fd >= 0)
+      unlink(path);
+  }
+  if(fd < 0)
+    return -1;
+  if(ftruncate(fd, arena->size - at) != 0
+     || mmap(arena->base + at, arena->size - at, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  close(fd);			//The mapping keeps the file
+  arena->spill = at;
+  return 0;
+}
+
+void arenaTrim(ARENA * arena, size_t from) {
+//Drops the file-backed pages of from..used from memory. Nothing is lost:
+//they are in the file, and come back when they are touched.
+  size_t  page = sysconf(_SC_PAGESIZE);
+
+  if(arena->spill == 0 || arena->used <= arena->spill)
+    return;
+  if(from < arena->spill)
+    from = arena->spill;
+  from &= ~(page - 1);
+  if(from < arena->used)
+    madvise(arena->base + from, arena->used - from, MADV_DONTNEED);
 }
 
 /* --------------------- */
@@ -209,55 +1674,147 @@ void cleanLine(int line, int backcolor, int forecolor) {
 /* --------------------- */
 
 // create new list element of type LISTCHOICE from the supplied text string
-LISTCHOICE *newelement(char *text, char *itemPath, unsigned itemType) {
+// Records are carved from the listing's entry arena, so consecutive items
+// are adjacent in memory; both strings live in its name blob.
+LISTCHOICE *newelement(DIRLISTING * listing, const char *name,
+		       unsigned itemType) {
+//The name is stored once, packed after the previous one; what the list
+//shows is made from it by formatItem() when the row is drawn.
   LISTCHOICE *newp;
-  newp = (LISTCHOICE *) malloc(sizeof(LISTCHOICE));
-  newp->item = (char *)malloc(strlen(text) + 1);
-  newp->path = (char *)malloc(strlen(itemPath) + 1);
-  strcpy(newp->item, text);
-  strcpy(newp->path, itemPath);
+  newp = (LISTCHOICE *) arenaAlloc(&listing->entries, sizeof(LISTCHOICE));
+  if(newp == NULL)
+    return NULL;
+  newp->path = (char *)arenaAppend(&listing->names, name, strlen(name) + 1);
+  if(newp->path == NULL)
+    return NULL;
   newp->isDirectory = itemType;
-  newp->next = NULL;
-  newp->back = NULL;
+  newp->meta = 0;
   return newp;
 }
 
 // deleleteList: remove list from memory
-/* Function to delete the entire linked list */
-void deleteList(LISTCHOICE **head) 
+/* The whole list lives in the arenas, so deleting it is just a reset. */
+void deleteList(DIRLISTING * listing) 
 { 
-   /* deref head_ref to get the real head */
-   LISTCHOICE *current = *head; 
-   LISTCHOICE *next = NULL; 
-  
-   while (current != NULL)  
-   { 
-       next = current->next; 
-       free(current->item);
-       free(current->path);
-       free(current);
-       current = next; 
-   } 
-    
-   /* deref head_ref to affect the real head back 
-      in the caller. */
-   *head = NULL; 
+   arenaReset(&listing->entries);
+   arenaReset(&listing->names);
+   arenaReset(&listing->metas);
+   listing->unspilled = 0;
+   __atomic_store_n(&listing->length, 0, __ATOMIC_RELEASE);
 } 
 
+LISTCHOICE *listingHead(DIRLISTING * listing) {
+//First item of a listing, NULL if empty.
+  if(listing->entries.used == 0)
+    return NULL;
+  return (LISTCHOICE *) listing->entries.base;
+}
+
+unsigned listingLength(DIRLISTING * listing) {
+//No. of items published to readers. While a scanner thread is filling
+//the listing, records below this length are complete.
+  return __atomic_load_n(&listing->length, __ATOMIC_ACQUIRE);
+}
+
+unsigned listingCount(DIRLISTING * listing) {
+//No. of records written, for the thread writing them: the entry arena
+//holds nothing but the list, so its fill level is the length.
+  return listing->entries.used / sizeof(LISTCHOICE);
+}
+
+unsigned listingDirs(DIRLISTING * listing) {
+//No. of directories. They come first, so this is a binary search.
+  LISTCHOICE *head = listingHead(listing);
+  unsigned low = 0, high = listingLength(listing), middle;
+  while(low < high) {
+    middle = low + (high - low) / 2;
+    if(head[middle].isDirectory == DIRECTORY)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+int listingFind(DIRLISTING * listing, const char *name) {
+//Index of the item called name, -1 if not listed.
+  LISTCHOICE *head = listingHead(listing);
+  unsigned i, length = listingLength(listing);
+  for(i = 0; i < length; i++)
+    if(strcmp(head[i].path, name) == 0)
+      return i;
+  return -1;
+}
+
+int listingInsert(DIRLISTING * listing, unsigned pos, const char *name,
+		  unsigned itemType) {
+//Inserts a new item at pos, moving the following records up by one.
+//The name blob is append-only: names of removed items stay until the
+//listing is reset.
+  LISTCHOICE *head, *newp;
+  unsigned i, length = listingLength(listing);
+
+  if(pos > length)
+    pos = length;
+  if(arenaAlloc(&listing->entries, sizeof(LISTCHOICE)) == NULL)
+    return -1;
+  head = listingHead(listing);
+  memmove(head + pos + 1, head + pos, (length - pos) * sizeof(LISTCHOICE));
+  newp = head + pos;
+  newp->path = (char *)arenaAppend(&listing->names, name, strlen(name) + 1);
+  newp->isDirectory = itemType;
+  newp->meta = 0;
+  if(newp->path == NULL) {
+    listingRemove(listing, pos);
+    return -1;
+  }
+  for(i = pos; i <= length; i++)
+    head[i].index = i;
+  __atomic_store_n(&listing->length, length + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void listingRemove(DIRLISTING * listing, unsigned pos) {
+//Removes the item at pos, moving the following records down by one.
+  LISTCHOICE *head = listingHead(listing);
+  unsigned i, length = listingLength(listing);
+
+  if(pos >= length)
+    return;
+  memmove(head + pos, head + pos + 1,
+	  (length - pos - 1) * sizeof(LISTCHOICE));
+  listing->entries.used -= sizeof(LISTCHOICE);
+  for(i = pos; i < length - 1; i++)
+    head[i].index = i;
+  __atomic_store_n(&listing->length, length - 1, __ATOMIC_RELEASE);
+}
+
+void listingMove(DIRLISTING * listing, unsigned from, unsigned to) {
+//Moves the item at from to to, shifting the ones in between by one.
+  LISTCHOICE *head = listingHead(listing), item = head[from];
+  unsigned i, low = from < to ? from : to, high = from < to ? to : from;
+
+  if(from < to)
+    memmove(head + from, head + from + 1, (to - from) * sizeof(LISTCHOICE));
+  else
+    memmove(head + to + 1, head + to, (from - to) * sizeof(LISTCHOICE));
+  head[to] = item;
+  for(i = low; i <= high; i++)
+    head[i].index = i;
+}
+
 /* addend: add new LISTCHOICE to the end of a list  */
 /* usage example: listBox1 = (addend(listBox1, newelement("Item")); */
+/* Records are bump-allocated in order, so newp already sits right after
+   the tail: appending only has to number it. */
 LISTCHOICE *addend(LISTCHOICE * head, LISTCHOICE * newp) {
-  LISTCHOICE *p2;
+  if(newp == NULL)
+    return head;		//Arena exhausted, drop item.
   if(head == NULL) {
     newp->index = 0;
-    newp->back = NULL;
     return newp;
   }
-// now find the end of list
-  for(p2 = head; p2->next != NULL; p2 = p2->next) ;
-  p2->next = newp;
-  newp->back = p2;
-  newp->index = newp->back->index + 1;
+  newp->index = newp - head;
   return head;
 }
 
@@ -270,15 +1827,9 @@ void gotoIndex(LISTCHOICE ** aux, SCROLLDATA * scrollData,
 //Go to a specific location on the list.
 {
   LISTCHOICE *aux2;
-  unsigned counter = 0;
-  *aux = listBox1;
-  aux2 = *aux;
-  while(counter != indexAt) {
-    aux2 = aux2->next;
-    counter++;
-  }
-  //Highlight current item
+  aux2 = listBox1 + indexAt;	//Items are contiguous.
 
+  //Highlight current item
   displayItem(aux2, scrollData, SELECT_ITEM);
 
   //Update pointer
@@ -294,251 +1845,382 @@ in scrollData.
   LISTCHOICE *aux;
   unsigned wherey, counter = 0;
 
-  aux = head;
-  gotoIndex(&aux, scrollData, indexAt);
+  aux = head + indexAt;		//Items are contiguous.
   /* Save values */
   //wherex = scrollData->wherex;
   wherey = scrollData->wherey;
+  scrollData->selector = wherey;
   do {
     displayItem(aux, scrollData, UNSELECT_ITEM);
-    aux = aux->next;
+    aux++;
     counter++;
     scrollData->selector++;	// wherey++
   } while(counter != scrollData->displayLimit);
+  //Blank the rows left over when the list got shorter
+  for(; counter < scrollData->maxDisplay; counter++)
+    screenFill(scrollData->wherex, wherey + counter,
+	       scrollData->wherex + itemWidth + DU_COLUMN - 2 +
+	       metaWidth(), wherey + counter, scrollData->foreColor0,
+	       scrollData->backColor0);
   scrollData->selector = wherey;	//restore value
 }
 
 int query_length(LISTCHOICE ** head) {
-//Return no. items in a list.
-  {
-    LISTCHOICE *aux;
+//Return no. items in a list. While the filter is on the list is its
+//view, so *head is moved to the view and back.
+  LISTCHOICE *first;
+  unsigned length;
 
-    unsigned itemCount = 0;
-    aux = *head;
-    while(aux->next != NULL) {
-      aux = aux->next;
-      itemCount++;
-    }
-    return itemCount;
+  if(filter.active) {
+    *head = filter.view;
+    return filter.viewCount;
   }
-
+  if(listing1 == NULL)
+    return 0;
+  first = listingHead(listing1);
+  length = listingLength(listing1);
+  if(*head < first || *head >= first + length)
+    *head = first;
+  if(*head == NULL)
+    return 0;
+  return length - (*head - first);
 }
 
 void displayItem(LISTCHOICE * aux, SCROLLDATA * scrollData, int select)
 //Select or unselect item animation
 {
+  DUTOTAL *total = NULL;
+  char    size[DU_COLUMN], columns[64], name[MAX_ITEM_WIDTH + 1];
+
+  //While the tree is walked, its size follows each item
+  if(du.listing != NULL && du.listing == listing1) {
+    total = strcmp(aux->path, CURRENTDIR) == 0 ? &du.all :
+	duLookup(aux->path);
+    if(total != NULL)
+      formatSize(size, __atomic_load_n(&total->allocated,
+				       __ATOMIC_RELAXED));
+    gotoxy(scrollData->wherex + itemWidth, scrollData->selector);
+    outputcolor(F_BLUE, scrollData->backColor0);
+    screenPrintf("%*s", DU_COLUMN - 1, total != NULL ? size : "");
+  } else if(listing1 == search.listing && search.mode == SEARCH_CONTENT) {
+    //Matches in each file of a content search
+    if(aux->index >= 2)
+      formatCount(size, searchCount(aux));
+    gotoxy(scrollData->wherex + itemWidth, scrollData->selector);
+    outputcolor(F_BLUE, scrollData->backColor0);
+    screenPrintf("%*s", DU_COLUMN - 1, aux->index >= 2 ? size : "");
+  }
+  formatItem(name, aux->path, aux->isDirectory, itemWidth);
   switch (select) {
 
     case SELECT_ITEM:
       gotoxy(scrollData->wherex, scrollData->selector);
       outputcolor(scrollData->foreColor1, scrollData->backColor1);
-      printf("%s\n", aux->item);
+      screenPrintf("%s", name);
       break;
 
     case UNSELECT_ITEM:
       gotoxy(scrollData->wherex, scrollData->selector);
       outputcolor(scrollData->foreColor0, scrollData->backColor0);
-      printf("%s\n", aux->item);
+      screenPrintf("%s", name);
       break;
   }
+  //Metadata columns, in the colors of the row
+  if(metaShown) {
+    metaFormat(aux, columns, sizeof(columns));
+    gotoxy(scrollData->wherex + itemWidth + DU_COLUMN - 1,
+	   scrollData->selector);
+    screenPrintf("%s", columns);
+  }
 }
-int move_selector(LISTCHOICE ** selector, SCROLLDATA * scrollData) {
-/* 
-Creates animation by moving a selector highlighting next item and
-unselecting previous item
+int selectIndex(LISTCHOICE ** selector, SCROLLDATA * scrollData,
+		unsigned target) {
+/*
+Moves the highlight to item target. If it is inside the rows on display
+the previous item is unselected and the new one selected; otherwise the
+new top index is stored in scrollData and 1 is returned so that
+listBox() reloads the page around it.
 */
+  LISTCHOICE *aux = *selector;
+  unsigned top = scrollData->currentListIndex;
 
-  LISTCHOICE *aux;
-  unsigned scrollControl = 0, continueScroll = 0, circular =
-      CIRCULAR_INACTIVE;
-  //Auxiliary pointer points to selector.
-  aux = *selector;
-
-  //Circular list animation when not scrolling.
-  if(aux->index == scrollData->listLength - 1
-     && scrollData->scrollActive == SCROLL_INACTIVE
-     && scrollData->scrollDirection == DOWN_SCROLL) {
-    //After last item go back to the top.
-    displayItem(aux, scrollData, UNSELECT_ITEM);
-    scrollData->selector = scrollData->wherey;
-    gotoIndex(&aux, scrollData, 0);
-    *selector = aux;
-    circular = CIRCULAR_ACTIVE;
+  if(target >= scrollData->listLength)
+    target = scrollData->listLength - 1;
+
+  if(target < top || target >= top + scrollData->displayLimit) {
+    if(target < top)
+      scrollData->currentListIndex = target;
+    else
+      scrollData->currentListIndex = target - scrollData->displayLimit + 1;
+    scrollData->itemIndex = target;
+    return 1;
   }
 
-  if(aux->index == 0 && scrollData->scrollActive == SCROLL_INACTIVE
-     && scrollData->scrollDirection == UP_SCROLL) {
-    //Before first item go back to the bottom.
-    displayItem(aux, scrollData, UNSELECT_ITEM);
-    scrollData->selector = scrollData->wherey + scrollData->listLength - 1;
-    gotoIndex(&aux, scrollData, scrollData->listLength - 1);
-    *selector = aux;
-    circular = CIRCULAR_ACTIVE;
-  }
-  //Check if we do the circular list animation.
-  //If active, we skip the code one time.
-
-  if(circular == CIRCULAR_INACTIVE) {
-
-    //Check if we are within boundaries.
-    if((aux->next != NULL && scrollData->scrollDirection == DOWN_SCROLL)
-       || (aux->back != NULL && scrollData->scrollDirection == UP_SCROLL)) {
-
-      //Unselect previous item
-      displayItem(aux, scrollData, UNSELECT_ITEM);
-
-      //Check whether we move UP or Down
-      switch (scrollData->scrollDirection) {
-
-	case UP_SCROLL:
-	  //Calculate new top index if scroll is active 
-	  //otherwise it defaults to 0 (top)
-	  if(scrollData->scrollActive == SCROLL_ACTIVE)
-	    scrollControl = scrollData->currentListIndex;
-	  else
-	    scrollControl = 0;
-
-	  //Move selector
-	  if(aux->back->index >= scrollControl) {
-	    scrollData->selector--;	//whereY--
-	    aux = aux->back;	//Go to previous item
-	  } else {
-	    if(scrollData->scrollActive == SCROLL_ACTIVE)
-	      continueScroll = 1;
-	    else
-	      continueScroll = 0;
-	  }
-	  break;
+  //Unselect previous item
+  displayItem(aux, scrollData, UNSELECT_ITEM);
+  aux = aux - aux->index + target;	//O(1): items are contiguous
+  scrollData->selector = scrollData->wherey + (target - top);
+  scrollData->itemIndex = target;
 
-	case DOWN_SCROLL:
-	  //Calculate bottom index limit if scroll is ACTIVE
-	  //Otherwise it defaults to scrollData->ListLength-1
-
-	  if(scrollData->scrollActive == SCROLL_ACTIVE)
-	    scrollControl =
-		scrollData->currentListIndex + (scrollData->displayLimit -
-						1);
-	  else
-	    scrollControl = scrollData->listLength - 1;
-
-	  //Move selector
-	  if(aux->next->index <= scrollControl) {
-	    aux = aux->next;	//Go to next item
-	    scrollData->selector++;	//whereY++;
-	  } else {
-	    if(scrollData->scrollActive == SCROLL_ACTIVE)
-	      continueScroll = 1;
-	    else
-	      continueScroll = 0;
-	  }
-	  break;
-      }
+  //Highlight new item
+  displayItem(aux, scrollData, SELECT_ITEM);
 
-      //Metrics
-      cleanLine(4, B_BLUE, F_BLUE);
-      outputcolor(F_WHITE, B_BLUE);
-      gotoxy(6, 3);
-      printf("Index:%u/%u|Memory addr:%p", aux->index,
-	     scrollData->listLength - 1, aux);
-      gotoxy(6, 4);
-      printf("Scroll Limit: %u|IsScActive?:%u|Path: %s",
-	     scrollControl, scrollData->scrollActive, aux->path);
+  //Update selector pointer
+  *selector = aux;
+  return 0;
+}
 
-      //Highlight new item
-      displayItem(aux, scrollData, SELECT_ITEM);
+int move_selector(LISTCHOICE ** selector, SCROLLDATA * scrollData,
+		  unsigned rows) {
+/* 
+Creates animation by moving a selector highlighting next item and
+unselecting previous item. Moves rows items in scrollData->scrollDirection
+at once. When there is no scroll the list is circular.
+Returns 1 if the page has to scroll.
+*/
+  unsigned index = (*selector)->index;
+  unsigned length = scrollData->listLength;
+  unsigned target;
 
-      //Update selector pointer
-      *selector = aux;
-    }
+  if(scrollData->scrollDirection == DOWN_SCROLL) {
+    if(scrollData->scrollActive == SCROLL_INACTIVE)
+      target = (index + rows) % length;	//After last item go to the top.
+    else
+      target = (rows >= length - index) ? length - 1 : index + rows;
+  } else {
+    if(scrollData->scrollActive == SCROLL_INACTIVE)
+      target = (index + length - rows % length) % length;	//Before first go to the bottom.
+    else
+      target = (rows > index) ? 0 : index - rows;
   }
-  circular = CIRCULAR_INACTIVE;
-  return continueScroll;
+  if(target == index)
+    return 0;
+  return selectIndex(selector, scrollData, target);
 }
 
 char selectorMenu(LISTCHOICE * aux, SCROLLDATA * scrollData) {
-  char    ch=0;
-  int control = 0;
-  int continueScroll=0;
-  unsigned counter = 0;
+  int     key = 0;
+  int     control = 0;
+  unsigned count, row;
+  int     changed;
 
   //Go to and select expected item at the beginning
+  aux = aux + scrollData->itemIndex - scrollData->currentListIndex;
+  scrollData->selector = scrollData->wherey +
+      (scrollData->itemIndex - scrollData->currentListIndex);
+  displayItem(aux, scrollData, SELECT_ITEM);
 
-  gotoIndex(&aux, scrollData, scrollData->currentListIndex);
-
-  if(scrollData->scrollDirection == DOWN_SCROLL
-     && scrollData->currentListIndex != 0) {
-    //If we are going down we'll select the last item 
-    //to create a better scrolling transition (animation)
-    for(counter = 0; counter < scrollData->displayLimit; counter++) {
-      scrollData->scrollDirection = DOWN_SCROLL;
-      move_selector(&aux, scrollData);
+  //It breaks the loop every time the page has to move,
+  //to reload a new list and show the scroll animation.
+  while(control != CONTINUE_SCROLL && control != K_ENTER
+	&& control != REFRESH_LIST && control != NEW_LIST
+	&& control != QUIT_LIST) {
+    prefetchRequest(aux);
+    metaRequest(scrollData);
+    if(hudShown)
+      showHud();
+    key = readKey(&count);
+    //Same for the search prompt; Enter there shows the results instead
+    if((changed = searchKey(key)) >= 0) {
+      if(changed > 0)
+	control = NEW_LIST;
+      continue;
     }
-
-  } else {
-    //Do nothing if we are going up. Selector is always at the top item.
-  }
-
-  //It break the loop everytime the boundaries are reached.
-  //to reload a new list to show the scroll animation.
-  while(control != CONTINUE_SCROLL) {
-    ch = getch();
-
-    //if enter key pressed - break loop
-    if(ch == K_ENTER)
-      control = CONTINUE_SCROLL;	//Break the loop
-
-    //Check arrow keys
-    if(ch == K_ESCAPE)		// escape key
-    {
-      getch();			// read key again for arrow key combinations
-      switch (getch()) {
-	case K_UP_ARROW:	// escape key + A => arrow key up
-	  //Move selector up
-	  scrollData->scrollDirection = UP_SCROLL;
-	  continueScroll = move_selector(&aux, scrollData);
-	  //Break the loop if we are scrolling
-	  if(scrollData->scrollActive == SCROLL_ACTIVE
-	     && continueScroll == 1) {
-	    control = CONTINUE_SCROLL;
-	    //Update data
-	    scrollData->currentListIndex =
-		scrollData->currentListIndex - 1;
-	    scrollData->selector = scrollData->wherey;
-	    scrollData->itemIndex = aux->index;
-	    //Return value
-	    ch = control;
-	  }
+    //While the filter prompt is open, letters are filter text
+    row = scrollData->itemIndex - scrollData->currentListIndex;
+    if(filterKey(key, scrollData) > 0) {
+      scrollData->currentListIndex =
+	  scrollData->itemIndex > row ? scrollData->itemIndex - row : 0;
+      control = REFRESH_LIST;
+      continue;
+    }
+    switch (key) {
+      case K_ENTER:		//if enter key pressed - break loop
+	control = K_ENTER;
+	break;
+      case K_QUIT:		//Interrupted: close the browser
+	control = QUIT_LIST;
+	break;
+      case K_UP:		//Move selector up
+	scrollData->scrollDirection = UP_SCROLL;
+	if(move_selector(&aux, scrollData, count))
+	  control = CONTINUE_SCROLL;
+	break;
+      case K_DOWN:		//Move selector down
+	scrollData->scrollDirection = DOWN_SCROLL;
+	if(move_selector(&aux, scrollData, count))
+	  control = CONTINUE_SCROLL;
+	break;
+      case K_PAGE_UP:
+	scrollData->scrollDirection = UP_SCROLL;
+	if(selectIndex(&aux, scrollData,
+		       aux->index > count * scrollData->displayLimit ?
+		       aux->index - count * scrollData->displayLimit : 0))
+	  control = CONTINUE_SCROLL;
+	break;
+      case K_PAGE_DOWN:
+	scrollData->scrollDirection = DOWN_SCROLL;
+	if(selectIndex(&aux, scrollData,
+		       aux->index + count * scrollData->displayLimit))
+	  control = CONTINUE_SCROLL;
+	break;
+      case K_HOME:
+	scrollData->scrollDirection = UP_SCROLL;
+	if(selectIndex(&aux, scrollData, 0))
+	  control = CONTINUE_SCROLL;
+	break;
+      case K_END:
+	scrollData->scrollDirection = DOWN_SCROLL;
+	if(selectIndex(&aux, scrollData, scrollData->listLength - 1))
+	  control = CONTINUE_SCROLL;
+	break;
+      case 's':		//Next sort order, same scan
+	sortMode = (sortMode + 1) % SORT_MODES;
+	showSortStatus();
+	if(activeScan != NULL)
+	  break;		//finishScan() sorts it
+	if(searchRunning())
+	  break;		//Results still coming: sorted on the next s
+	if(listing1 == search.listing && search.mode == SEARCH_CONTENT)
+	  break;		//Counts are by position
+	row = scrollData->itemIndex - scrollData->currentListIndex;
+	listingArrange(listing1, dirStackTop(), &scrollData->itemIndex);
+	showSortStatus();
+	scrollData->currentListIndex =
+	    scrollData->itemIndex > row ? scrollData->itemIndex - row : 0;
+	control = REFRESH_LIST;
+	break;
+      case 'd':		//Walk the tree below, or stop
+	if(listing1 == search.listing)
+	  break;		//Not a directory
+	if(du.listing != NULL) {
+	  duStop();
+	  screenFill(scrollData->wherex + itemWidth,
+		     scrollData->wherey,
+		     scrollData->wherex + itemWidth + DU_COLUMN - 2,
+		     scrollData->wherey + scrollData->maxDisplay - 1,
+		     scrollData->foreColor0, scrollData->backColor0);
+	} else if(duStart())
+	  showDuStatus();
+	control = REFRESH_LIST;
+	break;
+      case 'm':		//Metadata columns on or off
+	metaShown = !metaShown && metaColumns != 0;
+	screenFill(8, 6, screen.columns, 19, F_WHITE, B_BLUE);
+	drawListWindow();
+	showDuStatus();
+	control = REFRESH_LIST;
+	break;
+      case K_ESCAPE:		//Stop reading a slow directory
+	if(searchRunning()) {
+	  //Collected by searchProgress() like a scan
+	  __atomic_store_n(&search.cancel, 1, __ATOMIC_RELEASE);
+	  showSearchStatus();
 	  break;
-	case K_DOWN_ARROW:	// escape key + B => arrow key down
-	  //Move selector down
-	  scrollData->scrollDirection = DOWN_SCROLL;
-	  continueScroll = move_selector(&aux, scrollData);
-	  //Break the loop if we are scrolling
-	  if(scrollData->scrollActive == SCROLL_ACTIVE
-	     && continueScroll == 1) {
-	    control = CONTINUE_SCROLL;
-	    //Update data  
-	    scrollData->currentListIndex =
-		scrollData->currentListIndex + 1;
-	    scrollData->selector = scrollData->wherey;
-	    scrollData->itemIndex = aux->index;
-	    scrollData->scrollDirection = DOWN_SCROLL;
-	  }
-	  //Return value  
-	  ch = control;
+	}
+	if(activeScan == NULL)
 	  break;
-      }
+	//The scanner stops at its next batch; scanProgress() collects it,
+	//so a hung read never blocks the keys.
+	__atomic_store_n(&activeScan->cancel, 1, __ATOMIC_RELEASE);
+	showScanStatus(0);
+	break;
+      case K_RESIZE:		//Repaint everything at the new size
+	if(screenResize() <= 0)
+	  break;
+	showTitle();
+	showSortStatus();
+	showFilterStatus();
+	showSearchStatus();
+	drawListWindow();
+	showDuStatus();
+	showPath();
+	showScanStatus(listingCached);
+	if(hudShown)
+	  showHud();
+	control = REFRESH_LIST;
+	break;
+      case 'p':		//Performance HUD on or off
+	hudShown = !hudShown;
+	if(hudShown)
+	  break;		//Drawn before the next key
+	cleanLine(3, B_BLUE, F_BLUE);
+	cleanLine(4, B_BLUE, F_BLUE);
+	break;
+      case K_SCAN_PROGRESS:
+	//More items arrived, or the scan is over
+	row = scrollData->itemIndex - scrollData->currentListIndex;
+	scrollData->itemIndex = filterSource(scrollData->itemIndex);
+	changed = scanProgress(scrollData);
+	if(duProgress())
+	  changed = 1;
+	if(searchProgress())
+	  changed = 1;
+	if(changed && filter.active)
+	  filterRebuild();
+	scrollData->itemIndex = filterFind(scrollData->itemIndex);
+	if(changed) {
+	  scrollData->currentListIndex =
+	      scrollData->itemIndex > row ? scrollData->itemIndex - row : 0;
+	  control = REFRESH_LIST;
+	}
+	if(metaCollect(scrollData))
+	  control = REFRESH_LIST;
+	break;
+      case K_DIR_CHANGED:
+	//Keep the selector on the same item and the same row
+	row = scrollData->itemIndex - scrollData->currentListIndex;
+	scrollData->itemIndex = filterSource(scrollData->itemIndex);
+	changed = applyDirEvents(scrollData) > 0;
+	if(changed && filter.active)
+	  filterRebuild();
+	scrollData->itemIndex = filterFind(scrollData->itemIndex);
+	if(changed) {
+	  scrollData->currentListIndex =
+	      scrollData->itemIndex > row ? scrollData->itemIndex - row : 0;
+	  control = REFRESH_LIST;
+	}
+	break;
     }
   }
-  if(ch == K_ENTER)		// enter key
+  if(control == K_ENTER)	// enter key
   {
     //Pass data of last item selected.
-    scrollData->item = aux->item;
+    scrollData->item = aux->path;
     scrollData->itemIndex = aux->index;
     scrollData->path = aux->path;
     scrollData->isDirectory = aux->isDirectory;
+    return K_ENTER;
   }
-  return ch;
+  return control;
+}
+
+void setScroll(SCROLLDATA * scrollData, unsigned length) {
+//Works out whether the list scrolls for its current length and keeps
+//the page and the selected item within bounds.
+  scrollData->listLength = length;
+  scrollData->displayLimit = scrollData->maxDisplay;
+  if(length > scrollData->maxDisplay && scrollData->maxDisplay > 0) {
+    //Scroll is possible  
+    scrollData->scrollActive = SCROLL_ACTIVE;
+    scrollData->scrollLimit = length - scrollData->maxDisplay;
+  } else {
+    //Scroll is not possible.
+    //Display all the elements.
+    scrollData->scrollActive = SCROLL_INACTIVE;
+    scrollData->scrollLimit = 0;
+    scrollData->displayLimit = length;	//Default to list_length
+  }
+  if(scrollData->itemIndex >= length)
+    scrollData->itemIndex = length - 1;
+  if(scrollData->currentListIndex > scrollData->scrollLimit)
+    scrollData->currentListIndex = scrollData->scrollLimit;
+  if(scrollData->itemIndex < scrollData->currentListIndex)
+    scrollData->currentListIndex = scrollData->itemIndex;
+  if(scrollData->itemIndex >=
+     scrollData->currentListIndex + scrollData->displayLimit)
+    scrollData->currentListIndex =
+	scrollData->itemIndex - scrollData->displayLimit + 1;
 }
 
 char listBox(LISTCHOICE * head,
@@ -547,192 +2229,5351 @@ char listBox(LISTCHOICE * head,
 	     unsigned fColor0, unsigned bColor1, unsigned fColor1,
 	     unsigned displayLimit) {
 
-  unsigned list_length = 0;
-  //unsigned currentIndex = 0;
-  int     scrollLimit = 0;
-  unsigned currentListIndex = 0;
-  char    ch=0;
-  LISTCHOICE *aux=NULL;
+  unsigned currentListIndex = 0, shownIndex = 0;
+  char    ch = 0;
 
-  // Query size of the list
-  list_length = query_length(&head) + 1;
+  //Save calculations for SCROLL and store DATA
+  scrollData->maxDisplay = displayLimit;
+  scrollData->wherex = whereX;
+  scrollData->wherey = whereY;
+  scrollData->selector = whereY;
+  scrollData->backColor0 = bColor0;
+  scrollData->backColor1 = bColor1;
+  scrollData->foreColor0 = fColor0;
+  scrollData->foreColor1 = fColor1;
+  scrollData->currentListIndex = 0;	//We start at the top index,
+  setScroll(scrollData, query_length(&head));	//or at least show itemIndex.
+  shownIndex = scrollData->currentListIndex;
+
+  //Scroll loop animation. Finish with ENTER.
+  do {
+    if(ch == REFRESH_LIST) {
+      //Items were added or removed: same page, new contents
+      setScroll(scrollData, query_length(&head));
+      shownIndex = scrollData->currentListIndex;
+    }
+    currentListIndex = scrollData->currentListIndex;
+    //One-line moves shift what is on screen with a scroll region,
+    //so only the exposed row has to be sent to the terminal.
+    if(currentListIndex == shownIndex + 1)
+      screenScroll(whereY, whereY + scrollData->displayLimit - 1, 1);
+    else if(currentListIndex + 1 == shownIndex)
+      screenScroll(whereY, whereY + scrollData->displayLimit - 1, -1);
+    shownIndex = currentListIndex;
+    loadlist(head, scrollData, currentListIndex);
+    ch = selectorMenu(head + currentListIndex, scrollData);
+  } while(ch != K_ENTER && ch != NEW_LIST && ch != QUIT_LIST);
+  return ch;
+}
+
+/* ---------------- */
+/* List files       */
+/* ---------------- */
+
+void formatItem(char *temp, const char *name, unsigned itemType,
+		int width) {
+//Builds the display string of an item in temp (width + 1 bytes): cropped
+//and padded to width. Directories are displayed between brackets
+//[directory], "." and ".." as they are. Only called for rows drawn.
+  size_t  length = strlen(name), room = width;
+  int     brackets = itemType == DIRECTORY && strcmp(name, CURRENTDIR) != 0
+      && strcmp(name, CHANGEDIR) != 0;
+
+  memset(temp, ' ', width);
+  temp[width] = '\0';
+  if(brackets)
+    room -= 2;
+  if(length > room)
+    length = room;		//Name is long. CROP
+  if(brackets) {
+    temp[0] = '[';
+    memcpy(temp + 1, name, length);
+    temp[length + 1] = ']';
+  } else
+    memcpy(temp, name, length);
+}
+
+unsigned resolveType(int dirFd, const char *name, unsigned char d_type) {
+//Classifies an entry. Filesystems that do not fill d_type (some NFS and
+//overlayfs setups) return DT_UNKNOWN and need an fstatat() relative to
+//the directory being scanned. Returns DIRECTORY, FILEITEM or -1 to skip.
+  struct stat st;
+
+  if(d_type == DT_DIR)
+    return DIRECTORY;
+  if(d_type == DT_REG)
+    return FILEITEM;
+  if(d_type != DT_UNKNOWN)
+    return (unsigned)-1;
+  if(fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    return (unsigned)-1;
+  if(S_ISDIR(st.st_mode))
+    return DIRECTORY;
+  if(S_ISREG(st.st_mode))
+    return FILEITEM;
+  return (unsigned)-1;
+}
+
+double elapsedSeconds(struct timespec *start) {
+//Seconds elapsed since start (monotonic clock).
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+      (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void addDots(DIRLISTING * listing) {
+//Add elements to switch directory at the beginning for convenience.
+  LISTCHOICE *head = NULL;
+
+  head = addend(head, newelement(listing, CURRENTDIR, DIRECTORY));	// "."
+  head = addend(head, newelement(listing, CHANGEDIR, DIRECTORY));	// ".."
+  __atomic_store_n(&listing->length, listingCount(listing),
+		   __ATOMIC_RELEASE);
+}
+
+void scanEntries(DIRLISTING * listing, int fd, char *buffer,
+		 SCANSTATS * stats, SCANJOB * job) {
+/*
+Reads the directory open on fd in a single pass with large getdents64
+batches and appends directories and files in the order they come.
+Entries whose d_type is DT_UNKNOWN are collected per batch and resolved
+with fstatat() once the batch has been walked. After every batch the new
+length is published, so a reader on another thread can display the
+items already there; with a job, the UI is also signalled (at most every
+SCAN_NOTIFY_MS) if job->progress is set, and the scan stops when
+job->cancel is set or the listing grows past job->budget.
+*/
+  int     nread, pos;
+  LISTCHOICE *head = (LISTCHOICE *) listing->entries.base;
+  struct linux_dirent64 *dir = NULL;
+  struct linux_dirent64 *pending[STAT_BATCH];
+  unsigned npending = 0, i, itemType, notified = 0;
+  struct timespec start, last;
+  unsigned long long one = 1;
+  size_t  budget, named;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last = start;
+  stats->entries = 0;
+  stats->statCalls = 0;
+  stats->batches = 0;
+
+  while((job == NULL || !__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE))
+	&& (nread = syscall(SYS_getdents64, fd, buffer,
+			    SCAN_BUFFER_SIZE)) > 0) {
+    stats->batches++;
+    named = listing->names.used;
+    pos = 0;
+    while(pos < nread || npending > 0) {
+      if(pos < nread) {
+	dir = (struct linux_dirent64 *)(buffer + pos);
+	pos += dir->d_reclen;
+	//Skip CURRENTDIR and CHANGEDIR, they are already in the list
+	if(strcmp(dir->d_name, CURRENTDIR) == 0
+	   || strcmp(dir->d_name, CHANGEDIR) == 0)
+	  continue;
+	stats->entries++;
+	if(dir->d_type == DT_UNKNOWN) {
+	  //Resolve later, while the batch is still in the buffer
+	  pending[npending++] = dir;
+	  if(npending < STAT_BATCH && pos < nread)
+	    continue;
+	} else {
+	  itemType = resolveType(fd, dir->d_name, dir->d_type);
+	  if(itemType == DIRECTORY || itemType == FILEITEM)
+	    addend(head, newelement(listing, dir->d_name, itemType));
+	  continue;
+	}
+      }
+      for(i = 0; i < npending; i++) {
+	dir = pending[i];
+	stats->statCalls++;
+	itemType = resolveType(fd, dir->d_name, DT_UNKNOWN);
+	if(itemType == DIRECTORY || itemType == FILEITEM)
+	  addend(head, newelement(listing, dir->d_name, itemType));
+      }
+      npending = 0;
+    }
+    //Publish the batch
+    __atomic_store_n(&listing->length, listingCount(listing),
+		     __ATOMIC_RELEASE);
+    listingSpill(listing, named);
+    if(job == NULL)
+      continue;
+    if(__atomic_load_n(&job->progress, __ATOMIC_ACQUIRE)
+       && (notified == 0 || elapsedSeconds(&last) * 1000 >= SCAN_NOTIFY_MS)) {
+      write(scanEventFd, &one, sizeof(one));
+      clock_gettime(CLOCK_MONOTONIC, &last);
+      notified = 1;
+    }
+    budget = __atomic_load_n(&job->budget, __ATOMIC_ACQUIRE);
+    if(budget > 0 && listingBytes(listing) > budget)
+      __atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+  }
+  stats->seconds = elapsedSeconds(&start);
+}
+
+void listingPartition(DIRLISTING * listing) {
+//Stable partition: directories first, then files, each in the order
+//they were read. Files are parked in the scratch arena meanwhile.
+  LISTCHOICE *head = listingHead(listing), *files;
+  unsigned i, dirs = 0, nfiles = 0, length = listingLength(listing);
+
+  arenaReset(&scratchArena);
+  files = (LISTCHOICE *) arenaAlloc(&scratchArena,
+				    (size_t)length * sizeof(LISTCHOICE));
+  if(head == NULL || files == NULL)
+    return;
+  for(i = 0; i < length; i++) {
+    if(head[i].isDirectory == DIRECTORY)
+      head[dirs++] = head[i];
+    else
+      files[nfiles++] = head[i];
+  }
+  memcpy(head + dirs, files, (size_t)nfiles * sizeof(LISTCHOICE));
+  for(i = 0; i < length; i++)
+    head[i].index = i;
+}
+
+int listFiles(DIRLISTING * listing, int fd) {
+/*
+Reads the directory open on fd into listing, on this thread. Directories
+are displayed first.
+*/
+  char   *buffer;
+
+  addDots(listing);
+  arenaReset(&scratchArena);
+  buffer = (char *)arenaAlloc(&scratchArena, SCAN_BUFFER_SIZE);
+  if(buffer == NULL || fd < 0) {
+    scanStats.entries = scanStats.batches = scanStats.statCalls = 0;
+    scanStats.seconds = 0;
+    return -1;
+  }
+  scanEntries(listing, fd, buffer, &scanStats, NULL);
+  listingArrange(listing, fd, NULL);
+  return 0;
+}
+
+/* ---------------- */
+/* Sorting          */
+/* ---------------- */
+/*
+Listings are sorted on the UI thread once they are read, and again when
+the order is changed, without reading the directory again. Every item
+gets a compact key once per sort: a 64-bit prefix that orders like the
+item (the first 8 bytes of its key string, or its size or mtime), which
+is radix sorted. Only runs of equal prefixes are compared as strings.
+Names compare byte by byte, not with strcoll(), so a sort costs the
+same in every locale. Sizes and mtimes are read by stat threads the
+first time an order needs them and stay in the items.
+*/
+
+void listingArrange(DIRLISTING * listing, int dirFd, unsigned *follow) {
+/*
+Gives a listing its final order: "." and "..", the directories, then
+the files, each group sorted by sortMode. If follow is given, it is an
+index that is kept pointing at the same item.
+*/
+  LISTCHOICE *head = listingHead(listing);
+  unsigned i, dirs, length = listingLength(listing);
+  char   *path = NULL;
+  struct timespec start;
+
+  if(head == NULL)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(follow != NULL && *follow < length)
+    path = head[*follow].path;
+  listingPartition(listing);
+  dirs = listingDirs(listing);
+  listingSort(listing, 2, dirs, dirFd);
+  listingSort(listing, dirs, length, dirFd);
+  listing->sortMode = sortMode;
+  arenaTrim(&listing->names, 0);	//The sort read every name
+  sortSeconds = elapsedSeconds(&start);
+  if(path != NULL) {
+    for(i = 0; i < length; i++)
+      if(head[i].path == path) {
+	*follow = i;
+	break;
+      }
+  }
+}
+
+unsigned listingSettle(DIRLISTING * listing, unsigned index, int dirFd,
+		       unsigned *follow) {
+/*
+Moves the item at index, new or changed in a sorted listing, to its
+place among the others of its group, found by binary search in the
+listing's order. Sizes and mtimes are read again for the orders by
+them. If follow is given, it is kept on the same item. Returns where
+the item went.
+*/
+  LISTCHOICE *head = listingHead(listing), item;
+  unsigned low, high, middle, dirs = listingDirs(listing);
+  size_t  mark = scratchArena.used;
+  const char *key = NULL;
+
+  if(listing->sortMode == SORT_SIZE || listing->sortMode == SORT_MTIME)
+    listingStat(listing, head + index, 1, dirFd);
+  item = head[index];
+  if(listing->sortMode == SORT_NATURAL)
+    key = naturalKey(&scratchArena, item.path);
+  else if(listing->sortMode == SORT_EXT)
+    key = extensionKey(&scratchArena, item.path);
+  low = item.isDirectory == DIRECTORY ? 2 : dirs;
+  high = item.isDirectory == DIRECTORY ? dirs : listingLength(listing);
+  //Among the others: index is skipped over
+  for(high--; low < high;) {
+    middle = low + (high - low) / 2;
+    if(compareItems(listing, head + middle + (middle >= index), &item,
+		    key) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  scratchArena.used = mark;
+  listingMove(listing, index, low);
+  if(follow != NULL) {
+    if(*follow == index)
+      *follow = low;
+    else if(index < *follow && *follow <= low)
+      (*follow)--;
+    else if(low <= *follow && *follow < index)
+      (*follow)++;
+  }
+  return low;
+}
+
+int compareItems(DIRLISTING * listing, LISTCHOICE * item,
+		 LISTCHOICE * probe, const char *probeKey) {
+//Order of item and probe in the listing's order, as listingSort() gives
+//it. probeKey is the natural or extension key of the probe.
+  unsigned long long x, y;
+  size_t  mark = scratchArena.used;
+  const char *key;
+  int     result = 0;
+
+  switch (listing->sortMode) {
+    case SORT_SIZE:
+    case SORT_MTIME:
+      x = metaPrefix(itemMeta(listing, item), listing->sortMode);
+      y = metaPrefix(itemMeta(listing, probe), listing->sortMode);
+      result = x < y ? -1 : x > y;
+      break;
+    case SORT_NATURAL:
+    case SORT_EXT:
+      key = listing->sortMode == SORT_NATURAL ?
+	  naturalKey(&scratchArena, item->path) :
+	  extensionKey(&scratchArena, item->path);
+      if(key != NULL && probeKey != NULL)
+	result = strcmp(key, probeKey);
+      scratchArena.used = mark;
+      break;
+  }
+  if(result == 0)
+    result = strcmp(item->path, probe->path);
+  return result;
+}
+
+unsigned long long metaPrefix(const LISTMETA * info, int order) {
+//Sort prefix of the size or mtime order: the largest or newest first.
+  if(order == SORT_SIZE)
+    return ~(unsigned long long)info->size;
+  return ~((unsigned long long)info->mtime ^ (1ULL << 63));
+}
+
+void listingSort(DIRLISTING * listing, unsigned from, unsigned to,
+		 int dirFd) {
+//Sorts items from..to-1 by sortMode.
+  LISTCHOICE *head = listingHead(listing), *items, *copy;
+  SORTKEY *keys, *temp;
+  SORTCONTEXT context;
+  const char *text;
+  unsigned i, run, count;
+
+  if(head == NULL || to <= from + 1)
+    return;
+  items = head + from;
+  count = to - from;
+  if(sortMode == SORT_SIZE || sortMode == SORT_MTIME)
+    listingStat(listing, items, count, dirFd);
+  arenaReset(&scratchArena);
+  keys = (SORTKEY *) arenaAlloc(&scratchArena, count * sizeof(SORTKEY));
+  temp = (SORTKEY *) arenaAlloc(&scratchArena, count * sizeof(SORTKEY));
+  if(keys == NULL || temp == NULL)
+    return;
+  context.items = items;
+  context.texts = sortMode == SORT_NATURAL || sortMode == SORT_EXT ?
+      scratchArena.base : NULL;
+  for(i = 0; i < count; i++) {
+    keys[i].record = i;
+    switch (sortMode) {
+      case SORT_NATURAL:
+	text = naturalKey(&scratchArena, items[i].path);
+	break;
+      case SORT_EXT:
+	text = extensionKey(&scratchArena, items[i].path);
+	break;
+      default:
+	text = items[i].path;
+	break;
+    }
+    if(text == NULL)
+      return;
+    keys[i].text = context.texts != NULL ? text - context.texts : 0;
+    if(sortMode == SORT_SIZE || sortMode == SORT_MTIME)
+      keys[i].prefix = metaPrefix(itemMeta(listing, items + i), sortMode);
+    else
+      keys[i].prefix = keyPrefix(text);
+  }
+  radixSort(keys, temp, count);
+  //Equal prefixes: compare the whole keys
+  for(i = 0; i < count; i = run) {
+    for(run = i + 1; run < count && keys[run].prefix == keys[i].prefix;
+	run++) ;
+    if(run - i > 1)
+      qsort_r(keys + i, run - i, sizeof(SORTKEY), compareKeys, &context);
+  }
+  //Put the records in their new places
+  copy = (LISTCHOICE *) temp;
+  if(sizeof(LISTCHOICE) > sizeof(SORTKEY))
+    copy = (LISTCHOICE *) arenaAlloc(&scratchArena,
+				     count * sizeof(LISTCHOICE));
+  if(copy == NULL)
+    return;
+  memcpy(copy, items, count * sizeof(LISTCHOICE));
+  for(i = 0; i < count; i++) {
+    items[i] = copy[keys[i].record];
+    items[i].index = from + i;
+  }
+}
+
+void   *statThread(void *arg) {
+  STATJOB *job = (STATJOB *) arg;
+  LISTMETA *info;
+  struct stat st;
+  unsigned i;
+
+  for(i = 0; i < job->count; i++) {
+    if(job->items[i].meta == 0)
+      continue;			//Out of memory for the slot
+    info = job->metas + job->items[i].meta - 1;
+    if(info->size >= 0)
+      continue;
+    if(fstatat(job->dirFd, job->items[i].path, &st,
+	       AT_SYMLINK_NOFOLLOW) != 0) {
+      info->size = 0;		//Gone: sorts as empty
+      continue;
+    }
+    info->size = st.st_size;
+    info->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+  return NULL;
+}
+
+void listingStat(DIRLISTING * listing, LISTCHOICE * items, unsigned count,
+		 int dirFd) {
+//Fills size and mtime of the items that lack them, with up to one
+//thread per core for big directories. Slots are handed out here, so
+//the threads only write to their own.
+  STATJOB jobs[MAX_STAT_THREADS];
+  unsigned i, threads, chunk;
+  long    cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for(i = 0; i < count; i++)
+    itemMetaSlot(listing, items + i);
+
+  threads = count / STAT_CHUNK;
+  if(cores > 0 && threads > (unsigned)cores)
+    threads = cores;
+  if(threads > MAX_STAT_THREADS)
+    threads = MAX_STAT_THREADS;
+  if(threads < 1)
+    threads = 1;
+  chunk = (count + threads - 1) / threads;
+  for(i = 0; i < threads; i++) {
+    jobs[i].items = items + i * chunk;
+    jobs[i].count = i * chunk >= count ? 0 :
+	(count - i * chunk < chunk ? count - i * chunk : chunk);
+    jobs[i].dirFd = dirFd;
+    jobs[i].metas = (LISTMETA *) listing->metas.base;
+  }
+  //This thread takes the first chunk
+  for(i = 1; i < threads; i++)
+    if(pthread_create(&jobs[i].thread, NULL, statThread, &jobs[i]) != 0) {
+      statThread(&jobs[i]);
+      jobs[i].count = 0;
+    }
+  statThread(&jobs[0]);
+  for(i = 1; i < threads; i++)
+    if(jobs[i].count > 0)
+      pthread_join(jobs[i].thread, NULL);
+}
+
+char   *naturalKey(ARENA * arena, const char *name) {
+/*
+A string that sorts bytewise in natural order: every run of digits
+becomes '0', its length without leading zeros and the digits, so longer
+numbers sort after shorter ones: "a2" < "a10". Lengths from 255 on take
+more bytes: 255 for every 254 digits, then the rest (never 0), which
+still sorts like the lengths.
+*/
+  char   *key = (char *)arenaAlloc(arena, strlen(name) * 3 + 1), *k;
+  const char *start;
+  size_t  digits, length;
+
+  if(key == NULL)
+    return NULL;
+  k = key;
+  while(*name != '\0') {
+    if(*name < '0' || *name > '9') {
+      *k++ = *name++;
+      continue;
+    }
+    while(name[0] == '0' && name[1] >= '0' && name[1] <= '9')
+      name++;
+    for(start = name; *name >= '0' && *name <= '9'; name++) ;
+    digits = name - start;
+    *k++ = '0';
+    for(length = digits; length >= 255; length -= 254)
+      *k++ = (char)255;
+    *k++ = (char)length;
+    memcpy(k, start, digits);
+    k += digits;
+  }
+  *k = '\0';
+  return key;
+}
+
+char   *extensionKey(ARENA * arena, const char *name) {
+//The extension, '\1', the name. Names without one sort first.
+  const char *dot = strrchr(name, '.');
+  size_t  extLength, length = strlen(name);
+  char   *key = (char *)arenaAlloc(arena, length * 2 + 2);
+
+  if(key == NULL)
+    return NULL;
+  if(dot == NULL || dot == name)
+    dot = name + length;	//Hidden files are not extensions
+  else
+    dot++;
+  extLength = name + length - dot;
+  memcpy(key, dot, extLength);
+  key[extLength] = '\1';
+  memcpy(key + extLength + 1, name, length + 1);
+  return key;
+}
+
+unsigned long long keyPrefix(const char *text) {
+//First 8 bytes, big-endian, so the numbers sort like the strings.
+  unsigned long long prefix = 0;
+  int     i;
+  for(i = 0; i < 8 && text[i] != '\0'; i++)
+    prefix |= (unsigned long long)(unsigned char)text[i] << (56 - 8 * i);
+  return prefix;
+}
+
+void radixSort(SORTKEY * keys, SORTKEY * temp, unsigned count) {
+/*
+Stable LSD radix sort on the 64-bit prefixes, one byte per pass. All
+eight histograms are built in a single pass over the keys, and passes
+where every key has the same byte are skipped.
+*/
+  unsigned histogram[8][256];
+  unsigned i, pass, sum, next;
+  SORTKEY *from = keys, *to = temp, *swap;
+
+  memset(histogram, 0, sizeof(histogram));
+  for(i = 0; i < count; i++)
+    for(pass = 0; pass < 8; pass++)
+      histogram[pass][(keys[i].prefix >> (pass * 8)) & 0xff]++;
+  for(pass = 0; pass < 8; pass++) {
+    if(histogram[pass][(keys[0].prefix >> (pass * 8)) & 0xff] == count)
+      continue;
+    for(i = 0, sum = 0; i < 256; i++) {
+      next = sum + histogram[pass][i];
+      histogram[pass][i] = sum;
+      sum = next;
+    }
+    for(i = 0; i < count; i++)
+      to[histogram[pass][(from[i].prefix >> (pass * 8)) & 0xff]++] =
+	  from[i];
+    swap = from;
+    from = to;
+    to = swap;
+  }
+  if(from != keys)
+    memcpy(keys, from, count * sizeof(SORTKEY));
+}
+
+int compareKeys(const void *a, const void *b, void *context) {
+//Whole keys of equal prefixes, then the names themselves.
+  const SORTKEY *x = (const SORTKEY *)a, *y = (const SORTKEY *)b;
+  const SORTCONTEXT *sort = (const SORTCONTEXT *)context;
+  const char *xName = sort->items[x->record].path;
+  const char *yName = sort->items[y->record].path;
+  int     result = 0;
+
+  if(sort->texts != NULL)
+    result = strcmp(sort->texts + x->text, sort->texts + y->text);
+  if(result == 0)
+    result = strcmp(xName, yName);
+  return result;
+}
+
+int parseSortMode(const char *name) {
+//Index of the sort mode called name, -1 if unknown.
+  int     i;
+  for(i = 0; i < SORT_MODES; i++)
+    if(strcmp(name, sortNames[i]) == 0)
+      return i;
+  return -1;
+}
+
+void showSortStatus(void) {
+//Line 2: the order of the listing.
+  cleanLine(2, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 2);
+  screenPrintf("Sort: %s (s: next order) | last sort %.3f ms",
+	       sortNames[sortMode], sortSeconds * 1000);
+}
+
+/* ---------------- */
+/* Filter           */
+/* ---------------- */
+/*
+'/' opens a prompt that narrows the list as you type. The names of
+listing1 are packed once, in lower case, into one buffer with a
+separator after each, so a substring search is one SIMD pass over the
+buffer. The matches of every level (every prefix of the text) are kept:
+a keystroke only searches the matches of the level below, with one pass
+over the buffer while they are most names, name by name once they are
+few; Backspace returns to the level below without searching. Tab
+switches to fuzzy matching: the characters in order, anywhere in the
+name. While the filter is on, the listbox shows filter.view, a copy of
+"." and ".." and the matching items (see query_length()).
+*/
+
+static long findScalar(const char *haystack, size_t length,
+		       const char *needle, size_t needleLength) {
+  const char *p;
+  size_t  i = 0;
+
+  if(needleLength == 0)
+    return 0;
+  while(i + needleLength <= length) {
+    p = (const char *)memchr(haystack + i, needle[0],
+			     length - needleLength + 1 - i);
+    if(p == NULL)
+      return -1;
+    if(memcmp(p + 1, needle + 1, needleLength - 1) == 0)
+      return p - haystack;
+    i = p - haystack + 1;
+  }
+  return -1;
+}
+
+#ifdef FILTER_SIMD
+static long findSSE2(const char *haystack, size_t length,
+		     const char *needle, size_t needleLength) {
+//16 positions at a time are compared with the first and the last byte
+//of the needle; only where both agree is the rest compared.
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+  __m128i a, b;
+  unsigned mask, bit;
+  size_t  i;
+  long    found;
+
+  for(i = 0; i + needleLength - 1 + 16 <= length; i += 16) {
+    a = _mm_loadu_si128((const __m128i *)(haystack + i));
+    b = _mm_loadu_si128((const __m128i *)(haystack + i + needleLength - 1));
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+					   _mm_cmpeq_epi8(b, last)));
+    while(mask != 0) {
+      bit = __builtin_ctz(mask);
+      if(needleLength <= 2
+	 || memcmp(haystack + i + bit + 1, needle + 1,
+		   needleLength - 2) == 0)
+	return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  found = findScalar(haystack + i, length - i, needle, needleLength);
+  return found < 0 ? -1 : (long)i + found;
+}
+
+__attribute__ ((target("avx2")))
+static long findAVX2(const char *haystack, size_t length,
+		     const char *needle, size_t needleLength) {
+//Same as findSSE2(), 32 positions at a time.
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+  __m256i a, b;
+  unsigned mask, bit;
+  size_t  i;
+  long    found;
+
+  for(i = 0; i + needleLength - 1 + 32 <= length; i += 32) {
+    a = _mm256_loadu_si256((const __m256i *)(haystack + i));
+    b = _mm256_loadu_si256((const __m256i *)
+			   (haystack + i + needleLength - 1));
+    mask = _mm256_movemask_epi8(_mm256_and_si256
+				(_mm256_cmpeq_epi8(a, first),
+				 _mm256_cmpeq_epi8(b, last)));
+    while(mask != 0) {
+      bit = __builtin_ctz(mask);
+      if(needleLength <= 2
+	 || memcmp(haystack + i + bit + 1, needle + 1,
+		   needleLength - 2) == 0)
+	return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  found = findSSE2(haystack + i, length - i, needle, needleLength);
+  return found < 0 ? -1 : (long)i + found;
+}
+#endif
+
+long findSubstring(const char *haystack, size_t length, const char *needle,
+		   size_t needleLength) {
+//Position of needle in haystack, -1 if absent. Uses the widest vector
+//unit of the CPU; plain C elsewhere.
+#ifdef FILTER_SIMD
+  if(needleLength == 0)
+    return 0;
+  if(__builtin_cpu_supports("avx2"))
+    return findAVX2(haystack, length, needle, needleLength);
+  return findSSE2(haystack, length, needle, needleLength);
+#else
+  return findScalar(haystack, length, needle, needleLength);
+#endif
+}
+
+static unsigned scanScalar(size_t position, size_t end, const char *text,
+			   size_t textLength, unsigned item,
+			   unsigned *matches, unsigned found) {
+//Plain C part of scanNames(), from position on.
+  long    hit;
+  while(position < end
+	&& (hit = findScalar(filter.names + position, end - position, text,
+			     textLength)) >= 0) {
+    position += hit;
+    while(filter.offsets[item + 1] <= position)
+      item++;
+    matches[found++] = item;
+    position = filter.offsets[item + 1];
+  }
+  return found;
+}
+
+#ifdef FILTER_SIMD
+static unsigned scanSSE2(size_t end, const char *text, size_t textLength,
+			 unsigned *matches) {
+//scanNames() 16 bytes at a time. Once a name matched, the rest of it
+//is skipped.
+  __m128i first = _mm_set1_epi8(text[0]);
+  __m128i last = _mm_set1_epi8(text[textLength - 1]);
+  __m128i a, b;
+  const char *names = filter.names;
+  unsigned mask, item = 2, found = 0;
+  size_t  i, position, skip = 0;
+
+  for(i = 0; i + textLength - 1 + 16 <= end; i += 16) {
+    if(i + 16 <= skip)
+      continue;
+    a = _mm_loadu_si128((const __m128i *)(names + i));
+    b = _mm_loadu_si128((const __m128i *)(names + i + textLength - 1));
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+					   _mm_cmpeq_epi8(b, last)));
+    for(; mask != 0; mask &= mask - 1) {
+      position = i + __builtin_ctz(mask);
+      if(position < skip || (textLength > 2
+			     && memcmp(names + position + 1, text + 1,
+				       textLength - 2) != 0))
+	continue;
+      while(filter.offsets[item + 1] <= position)
+	item++;
+      matches[found++] = item;
+      skip = filter.offsets[item + 1];
+    }
+  }
+  if(skip > i) {
+    i = skip;
+    item++;
+  }
+  while(item < filter.packed && filter.offsets[item + 1] <= i)
+    item++;
+  return scanScalar(i, end, text, textLength, item, matches, found);
+}
+
+__attribute__ ((target("avx2")))
+static unsigned scanAVX2(size_t end, const char *text, size_t textLength,
+			 unsigned *matches) {
+//Same as scanSSE2(), 32 bytes at a time.
+  __m256i first = _mm256_set1_epi8(text[0]);
+  __m256i last = _mm256_set1_epi8(text[textLength - 1]);
+  __m256i a, b;
+  const char *names = filter.names;
+  unsigned mask, item = 2, found = 0;
+  size_t  i, position, skip = 0;
+
+  for(i = 0; i + textLength - 1 + 32 <= end; i += 32) {
+    if(i + 32 <= skip)
+      continue;
+    a = _mm256_loadu_si256((const __m256i *)(names + i));
+    b = _mm256_loadu_si256((const __m256i *)(names + i + textLength - 1));
+    mask = _mm256_movemask_epi8(_mm256_and_si256
+				(_mm256_cmpeq_epi8(a, first),
+				 _mm256_cmpeq_epi8(b, last)));
+    for(; mask != 0; mask &= mask - 1) {
+      position = i + __builtin_ctz(mask);
+      if(position < skip || (textLength > 2
+			     && memcmp(names + position + 1, text + 1,
+				       textLength - 2) != 0))
+	continue;
+      while(filter.offsets[item + 1] <= position)
+	item++;
+      matches[found++] = item;
+      skip = filter.offsets[item + 1];
+    }
+  }
+  if(skip > i) {
+    i = skip;
+    item++;
+  }
+  while(item < filter.packed && filter.offsets[item + 1] <= i)
+    item++;
+  return scanScalar(i, end, text, textLength, item, matches, found);
+}
+#endif
+
+unsigned scanNames(const char *text, size_t textLength, unsigned *matches) {
+/*
+One pass over all the packed names: stores in matches every item whose
+name contains text, in order, and returns how many. Candidates are the
+positions where both the first and the last byte of text are found.
+*/
+  size_t  end = filter.offsets[filter.packed];
+#ifdef FILTER_SIMD
+  if(__builtin_cpu_supports("avx2"))
+    return scanAVX2(end, text, textLength, matches);
+  return scanSSE2(end, text, textLength, matches);
+#else
+  return scanScalar(0, end, text, textLength, 2, matches, 0);
+#endif
+}
+
+int matchFuzzy(const char *name, size_t length, const char *text,
+	       size_t textLength) {
+//1 if the characters of text are in name, in the same order.
+  const char *p = name, *end = name + length;
+  size_t  i;
+  for(i = 0; i < textLength; i++) {
+    p = (const char *)memchr(p, text[i], end - p);
+    if(p == NULL)
+      return 0;
+    p++;
+  }
+  return 1;
+}
+
+int filterStart(void) {
+//Turns the filter on for listing1. Returns 0 if out of memory.
+  if(filter.arena.base == NULL
+     && (arenaInit(&filter.arena, FILTER_ARENA_SIZE) != 0
+	 || arenaInit(&filter.views, ENTRY_ARENA_SIZE) != 0))
+    return 0;
+  filter.active = 1;
+  filter.length = 0;
+  filter.text[0] = '\0';
+  filterRebuild();
+  return 1;
+}
+
+void filterPack(void) {
+//Copies the names of listing1, lower case, into one buffer.
+//"." and ".." are always shown and get empty spans.
+  LISTCHOICE *head = listingHead(listing1);
+  unsigned i, length = listingLength(listing1);
+  size_t  used = 0, room;
+  const char *c;
+
+  filter.arena.used = 0;
+  filter.listing = listing1;
+  filter.packed = length;
+  filter.offsets = (unsigned *)arenaAlloc(&filter.arena,
+					  (length + 1) * sizeof(unsigned));
+  if(filter.offsets == NULL) {
+    filter.packed = 0;
+    return;
+  }
+  //The names go at the end of the arena; its pages are only reserved
+  filter.names = filter.arena.base + filter.arena.used;
+  room = filter.arena.size - filter.arena.used;
+  for(i = 0; i < length; i++) {
+    filter.offsets[i] = used;
+    if(i < 2)
+      continue;
+    for(c = head[i].path; *c != '\0' && used < room; c++)
+      filter.names[used++] = (*c >= 'A' && *c <= 'Z') ? *c + 32 : *c;
+    if(used == room) {
+      filter.packed = i;	//Out of room: the rest is not searched
+      break;
+    }
+    filter.names[used++] = NAME_SEPARATOR;
+  }
+  filter.offsets[filter.packed] = used;
+  arenaAlloc(&filter.arena, used);
+}
+
+void filterLevel(unsigned level) {
+/*
+Matches of text[0..level) among those of text[0..level-1): a name that
+matches the longer text also matched the shorter one.
+*/
+  unsigned *previous = filter.matches[level - 1], *matches;
+  unsigned count = filter.counts[level - 1], i, item, found = 0;
+  size_t  end;
+
+  filter.arena.used = filter.marks[level - 1];
+  matches = (unsigned *)arenaAlloc(&filter.arena,
+				   ((size_t)count + 1) * sizeof(unsigned));
+  if(matches == NULL || filter.packed < 2) {
+    filter.matches[level] = previous;
+    filter.counts[level] = count;
+    filter.marks[level] = filter.marks[level - 1];
+    return;
+  }
+  if(!filter.fuzzy && (size_t)count * 8 > filter.packed) {
+    //Most names are still in: one pass over the whole buffer
+    found = scanNames(filter.text, level, matches);
+  } else {
+    for(i = 0; i < count; i++) {
+      item = previous == NULL ? i + 2 : previous[i];
+      end = filter.offsets[item + 1] - 1;	//Without the separator
+      if(filter.fuzzy ?
+	 matchFuzzy(filter.names + filter.offsets[item],
+		    end - filter.offsets[item], filter.text, level) :
+	 findSubstring(filter.names + filter.offsets[item],
+		       end - filter.offsets[item], filter.text, level) >= 0)
+	matches[found++] = item;
+    }
+  }
+  //Give back what the level did not use
+  filter.arena.used = (char *)(matches + found) - filter.arena.base;
+  filter.matches[level] = matches;
+  filter.counts[level] = found;
+  filter.marks[level] = filter.arena.used;
+}
+
+void filterRebuild(void) {
+//Packs listing1 again and redoes every level, after it changed.
+  unsigned level;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  filterPack();
+  filter.matches[0] = NULL;
+  filter.counts[0] = filter.packed > 2 ? filter.packed - 2 : 0;
+  filter.marks[0] = filter.arena.used;
+  for(level = 1; level <= filter.length; level++)
+    filterLevel(level);
+  filter.seconds = elapsedSeconds(&start);
+  filterView();
+}
+
+void filterView(void) {
+//Builds the list the listbox shows: "." and "..", then the matches.
+  LISTCHOICE *head = listingHead(listing1), *view;
+  unsigned *matches = filter.matches[filter.length];
+  unsigned i, count = filter.counts[filter.length];
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(filter.packed < 2)
+    count = 0;
+  if(matches == NULL && head != NULL) {
+    //Nothing typed: the listing itself
+    filter.view = head;
+    filter.viewCount = count + 2;
+    filter.viewSeconds = elapsedSeconds(&start);
+    return;
+  }
+  filter.views.used = 0;	//Pages stay in for the next keystroke
+  view = (LISTCHOICE *) arenaAlloc(&filter.views,
+				   ((size_t)count + 2) * sizeof(LISTCHOICE));
+  if(view == NULL || head == NULL) {
+    filter.viewCount = 0;
+    return;
+  }
+  for(i = 0; i < count + 2; i++) {
+    view[i] = head[i < 2 ? i : (matches == NULL ? i : matches[i - 2])];
+    view[i].index = i;
+  }
+  filter.view = view;
+  filter.viewCount = count + 2;
+  filter.viewSeconds = elapsedSeconds(&start);
+}
+
+void filterClear(void) {
+//Turns the filter off; its memory goes back to the system.
+  filter.active = 0;
+  filter.length = 0;
+  filter.text[0] = '\0';
+  filter.listing = NULL;
+  filter.packed = 0;
+  filter.viewCount = 0;
+  arenaReset(&filter.arena);
+  arenaReset(&filter.views);
+}
+
+unsigned filterSource(unsigned viewIndex) {
+//Index in listing1 of an item of the view.
+  unsigned *matches = filter.matches[filter.length];
+  if(!filter.active || viewIndex < 2)
+    return viewIndex;
+  if(viewIndex >= filter.viewCount)
+    viewIndex = filter.viewCount - 1;
+  return matches == NULL ? viewIndex : matches[viewIndex - 2];
+}
+
+unsigned filterFind(unsigned listingIndex) {
+//Index in the view of an item of listing1, or of the next one shown.
+  unsigned *matches = filter.matches[filter.length];
+  unsigned low = 0, high, middle;
+
+  if(!filter.active || listingIndex < 2)
+    return listingIndex;
+  if(matches == NULL)
+    return listingIndex < filter.viewCount ? listingIndex :
+	filter.viewCount - 1;
+  high = filter.counts[filter.length];
+  while(low < high) {
+    middle = low + (high - low) / 2;
+    if(matches[middle] < listingIndex)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low + 2 < filter.viewCount ? low + 2 : filter.viewCount - 1;
+}
+
+int filterKey(int key, SCROLLDATA * scrollData) {
+/*
+Keys of the filter prompt: '/' opens it, printable characters narrow
+the list, Backspace widens it, Tab switches substring/fuzzy, Esc closes
+it. The selection stays on its item, or the next one still shown.
+Returns -1 if the key is not for the filter, 1 if the list changed.
+*/
+  unsigned selected, level;
+  struct timespec start;
+
+  if(!filter.active) {
+    if(key != '/' || listing1 == NULL || listing1 == search.listing
+       || !filterStart())
+      return -1;		//Search results are paths: not filtered
+    showFilterStatus();
+    return 1;
+  }
+  selected = filterSource(scrollData->itemIndex);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(key == K_ESCAPE) {
+    filterClear();
+    scrollData->itemIndex = selected;
+    showFilterStatus();
+    return 1;
+  } else if(key == K_BACKSPACE || key == K_CTRL_H) {
+    if(filter.length == 0)
+      return 0;
+    filter.text[--filter.length] = '\0';
+    filter.arena.used = filter.marks[filter.length];
+  } else if(key == K_TAB) {
+    filter.fuzzy = !filter.fuzzy;
+    for(level = 1; level <= filter.length; level++)
+      filterLevel(level);
+  } else if(key >= ' ' && key <= '~') {
+    if(filter.length == MAX_FILTER || key == NAME_SEPARATOR)
+      return 0;		//No name has a separator in it
+    filter.text[filter.length++] =
+	(key >= 'A' && key <= 'Z') ? key + 32 : key;
+    filter.text[filter.length] = '\0';
+    filterLevel(filter.length);
+  } else
+    return -1;
+  filter.seconds = elapsedSeconds(&start);
+  filterView();
+  scrollData->itemIndex = filterFind(selected);
+  showFilterStatus();
+  return 1;
+}
+
+void showFilterStatus(void) {
+//Line 5: the filter prompt.
+  cleanLine(5, B_BLUE, F_BLUE);
+  if(!filter.active)
+    return;
+  outputcolor(FH_WHITE, B_BLUE);
+  gotoxy(1, 5);
+  screenPrintf("Filter (%s): %s_ | %u/%u | %.3f ms + view %.3f ms",
+	       filter.fuzzy ? "fuzzy" : "substring", filter.text,
+	       filter.viewCount - 2,
+	       filter.packed > 2 ? filter.packed - 2 : 0,
+	       filter.seconds * 1000, filter.viewSeconds * 1000);
+}
+
+/* ---------------- */
+/* Background scan  */
+/* ---------------- */
+/*
+A directory that is not cached is read by a scanner thread while the
+listbox is already running. The scanner only appends records and then
+publishes the new length, and records never move, so the UI can display
+and select whatever has been published without locking. Everything that
+rearranges the listing (the final partition, inotify updates) is done
+by the UI thread once the scanner is finished.
+*/
+
+void   *scanThread(void *arg) {
+  SCANJOB *job = (SCANJOB *) arg;
+  unsigned long long one = 1;
+
+  scanEntries(job->listing, job->fd, job->buffer, &job->stats, job);
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  write(scanEventFd, &one, sizeof(one));
+  return NULL;
+}
+
+int startScan(DIRLISTING * listing, int fd) {
+//Starts reading fd into listing in the background. Takes fd over.
+//Falls back to scanning on this thread if no thread can be started.
+  SCANJOB *job;
+
+  addDots(listing);
+  if(scanEventFd < 0)
+    scanEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  job = (SCANJOB *) calloc(1, sizeof(SCANJOB));
+  if(job == NULL || scanEventFd < 0) {
+    free(job);
+    arenaReset(&scratchArena);
+    scanEntries(listing, fd, (char *)arenaAlloc(&scratchArena,
+						SCAN_BUFFER_SIZE),
+		&scanStats, NULL);
+    listingArrange(listing, fd, NULL);
+    close(fd);
+    return 0;
+  }
+  job->listing = listing;
+  job->fd = fd;
+  job->parentFd = -1;
+  job->progress = 1;
+  if(pthread_create(&job->thread, NULL, scanThread, job) != 0) {
+    scanEntries(listing, fd, job->buffer, &scanStats, NULL);
+    listingArrange(listing, fd, NULL);
+    close(fd);
+    free(job);
+    return 0;
+  }
+  activeScan = job;
+  return 1;
+}
+
+int waitScan(int timeout) {
+//Waits up to timeout ms for the active scan to end. Returns 1 if ended.
+  struct pollfd pfd;
+  unsigned long long value;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(activeScan != NULL
+	&& !__atomic_load_n(&activeScan->done, __ATOMIC_ACQUIRE)) {
+    int     left = timeout - (int)(elapsedSeconds(&start) * 1000);
+    if(left <= 0)
+      return 0;
+    pfd.fd = scanEventFd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, left) > 0)
+      read(scanEventFd, &value, sizeof(value));
+  }
+  return 1;
+}
+
+void finishScan(void) {
+/*
+Joins the scanner and gives the listing its final shape: directories
+first, sorted. A cancelled listing is incomplete, so it is marked stale for the
+cache. Only call from the UI thread.
+*/
+  SCANJOB *job = activeScan;
+  DIRLISTING *listing;
+
+  if(job == NULL)
+    return;
+  pthread_join(job->thread, NULL);
+  listing = job->listing;
+  listingArrange(listing, job->fd, NULL);
+  scanStats = job->stats;
+  scanStats.cancelled = __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE);
+  perf.scans++;
+  perf.scanEntries += job->stats.entries;
+  perf.scanSeconds += job->stats.seconds;
+  if(__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)) {
+    listing->mtime.tv_sec = listing->mtime.tv_nsec = 0;
+    listing->ctime.tv_sec = listing->ctime.tv_nsec = 0;
+  }
+  cacheAccount(listing);
+  activeScan = NULL;
+  job->listing = NULL;		//It stays in the cache
+  scanJobFree(job);
+  cacheEvict();
+}
+
+void cancelScan(void) {
+/*
+Stops the active scan without waiting for it: the scanner may be stuck
+on a hung mount. Its listing is incomplete, so it leaves the cache with
+the job, and scanReap() frees both once the scanner is done.
+*/
+  SCANJOB *job = activeScan;
+  DIRLISTING *listing;
+  struct stat st;
+
+  if(job == NULL)
+    return;
+  __atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+  if(__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+    finishScan();
+    return;
+  }
+  listing = job->listing;
+  listing->mtime.tv_sec = listing->mtime.tv_nsec = 0;	//Not for the index
+  st.st_dev = listing->dev;
+  st.st_ino = listing->ino;
+  if(cacheLookup(&st) == listing)
+    cacheUnlink(listing);
+  if(dirCache.pinned == listing)
+    dirCache.pinned = NULL;
+  activeScan = NULL;
+  scanOrphan(job);
+}
+
+void scanOrphan(SCANJOB * job) {
+//Lets go of a cancelled job without waiting for it: it may be stuck on
+//a hung mount. It keeps its listing and fds until scanReap() frees them.
+  job->next = scanOrphans;
+  scanOrphans = job;
+}
+
+void scanReap(void) {
+//Joins and frees the jobs let go of that have ended since.
+  SCANJOB **link = &scanOrphans, *job;
+
+  while((job = *link) != NULL) {
+    if(!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+      link = &job->next;
+      continue;
+    }
+    *link = job->next;
+    pthread_join(job->thread, NULL);
+    scanJobFree(job);
+  }
+}
+
+void scanJobFree(SCANJOB * job) {
+//Closes and frees whatever a joined job still owns.
+  if(job->fd >= 0)
+    close(job->fd);
+  if(job->parentFd >= 0)
+    close(job->parentFd);
+  freeListing(job->listing);
+  free(job->name);
+  free(job);
+}
+
+int scanProgress(SCROLLDATA * scrollData) {
+/*
+Called on the UI thread when a scanner signals. Collects a finished
+read-ahead. Shows the count so far; once the scan is over, partitions
+the listing and keeps the selector on the item it was on. Returns 1 if
+the list has to be redrawn.
+*/
+  unsigned long long value;
+  LISTCHOICE *head, *selected = NULL;
+  unsigned i, length;
+
+  read(scanEventFd, &value, sizeof(value));
+  scanReap();
+  if(prefetch.job != NULL
+     && __atomic_load_n(&prefetch.job->done, __ATOMIC_ACQUIRE))
+    prefetchCollect();
+  if(activeScan == NULL)
+    return 0;
+  if(!__atomic_load_n(&activeScan->done, __ATOMIC_ACQUIRE)) {
+    showScanStatus(0);
+    return listingLength(listing1) != scrollData->listLength;
+  }
+  head = listingHead(listing1);
+  if(scrollData->itemIndex < listingLength(listing1))
+    selected = head + scrollData->itemIndex;
+  //Remember the selected item by its name, records move
+  if(selected != NULL) {
+    char   *path = selected->path;
+    finishScan();
+    length = listingLength(listing1);
+    for(i = 0; i < length; i++)
+      if(head[i].path == path) {
+	scrollData->itemIndex = i;
+	break;
+      }
+  } else
+    finishScan();
+  showScanStatus(0);
+  showSortStatus();
+  indexRevalidate();
+  return 1;
+}
+
+void showScanStatus(int cacheHit) {
+//Lines 23-24: where the listing came from, how fast it was read and
+//what the cache holds.
+  cleanLine(23, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 23);
+  listingCached = cacheHit;
+  if(activeScan != NULL) {
+    screenPrintf(__atomic_load_n(&activeScan->cancel, __ATOMIC_ACQUIRE) ?
+		 "Scan: %u entries, stopping..." :
+		 "Scan: %u entries so far... (Esc stops)",
+		 listingLength(listing1) - 2);
+  } else if(cacheHit == FROM_INDEX) {
+    screenPrintf("Scan: from the index, %u entries | %lu served | "
+		 "%lu/%u checked, %lu read again",
+		 listingLength(listing1) - 2, dirIndex.hits,
+		 __atomic_load_n(&dirIndex.checked, __ATOMIC_RELAXED),
+		 dirIndex.slotCount,
+		 __atomic_load_n(&dirIndex.refreshed, __ATOMIC_RELAXED));
+  } else if(cacheHit) {
+    screenPrintf("Scan: cached listing, %u entries",
+		 listingLength(listing1) - 2);
+  } else {
+    //Scan throughput of the single-pass scanner
+    screenPrintf(scanStats.cancelled ?
+		 "Scan: stopped at %lu entries | %lu batches | %lu stat | "
+		 "%.3f ms | %.0f entries/s" :
+		 "Scan: %lu entries | %lu batches | %lu stat | "
+		 "%.3f ms | %.0f entries/s", scanStats.entries,
+		 scanStats.batches, scanStats.statCalls,
+		 scanStats.seconds * 1000,
+		 scanStats.seconds >
+		 0 ? scanStats.entries / scanStats.seconds : 0);
+  }
+  cleanLine(24, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 24);
+  screenPrintf("Cache: %lu hits | %lu misses (%lu stale) | "
+	       "%lu evicted | %u dirs | %zu/%zu KB", dirCache.hits,
+	       dirCache.misses, dirCache.stale, dirCache.evictions,
+	       dirCache.count, dirCache.bytes >> 10, dirCache.budget >> 10);
+  showPrefetchStatus();
+}
+
+/* ---------------- */
+/* Prefetch         */
+/* ---------------- */
+/*
+When the selector rests on a directory for PREFETCH_DELAY ms, a scanner
+thread reads that directory ahead into a listing of its own, so Enter
+usually finds it in the cache. One read-ahead runs at a time, none while
+the directory on display is still being read, and it gives up once it
+uses 1/PREFETCH_SHARE of the cache budget. Even the openat() is done
+by that thread, and moving the selector on cancels it without waiting:
+the UI never blocks on a hung mount. A finished read-ahead stays in the
+cache.
+*/
+
+void prefetchRequest(LISTCHOICE * item) {
+//Called with the item under the selector before every key.
+  char   *want = NULL;
+
+  if(item != NULL && item->isDirectory == DIRECTORY && item->index != 0)
+    want = item->path;
+  if(want == prefetch.want)
+    return;
+  prefetchDrop();
+  prefetch.want = want;
+  prefetch.pending = want != NULL;
+}
+
+int prefetchPending(void) {
+  return prefetch.pending && prefetch.job == NULL && activeScan == NULL
+      && dirCache.budget > 0;
+}
+
+void prefetchStart(void) {
+//Starts opening prefetch.want, relative to the directory on display.
+//prefetchCollect() reads it once it is open.
+  SCANJOB *job;
+
+  prefetch.pending = 0;
+  if(scanEventFd < 0)
+    scanEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  job = (SCANJOB *) calloc(1, sizeof(SCANJOB));
+  if(job == NULL || scanEventFd < 0) {
+    free(job);
+    return;
+  }
+  job->fd = -1;
+  job->parentFd = fcntl(dirStackTop(), F_DUPFD_CLOEXEC, 0);
+  job->name = strdup(prefetch.want);
+  if(job->parentFd < 0 || job->name == NULL
+     || pthread_create(&job->thread, NULL, prefetchThread, job) != 0) {
+    scanJobFree(job);
+    return;
+  }
+  prefetch.job = job;
+}
+
+void   *prefetchThread(void *arg) {
+//Opens the directory to read ahead and signals the UI.
+  SCANJOB *job = (SCANJOB *) arg;
+  unsigned long long one = 1;
+
+  job->fd = openat(job->parentFd, job->name,
+		   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(job->fd >= 0 && fstat(job->fd, &job->st) != 0) {
+    close(job->fd);
+    job->fd = -1;
+  }
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  write(scanEventFd, &one, sizeof(one));
+  return NULL;
+}
+
+int prefetchRead(SCANJOB * job) {
+//Starts reading the opened job->fd, unless the cache or the index has
+//that directory as it is. Returns 1 if started.
+  DIRLISTING *listing, *cached;
+
+  if(job->fd < 0
+     || ((cached = cacheLookup(&job->st)) != NULL
+	 && listingFresh(cached, &job->st)) || indexFresh(&job->st))
+    return 0;			//Nothing to do, or already cached
+  listing = newListing();
+  if(listing == NULL)
+    return 0;
+  listing->dev = job->st.st_dev;
+  listing->ino = job->st.st_ino;
+  listing->mtime = job->st.st_mtim;
+  listing->ctime = job->st.st_ctim;
+  addDots(listing);
+  job->listing = listing;
+  job->done = 0;
+  job->budget = dirCache.budget / PREFETCH_SHARE;
+  if(pthread_create(&job->thread, NULL, scanThread, job) != 0)
+    return 0;
+  prefetch.started++;
+  return 1;
+}
+
+void prefetchCollect(void) {
+/*
+Joins the read-ahead, which has signalled that it is done. Once the
+directory is open it is read. A complete listing replaces whatever the
+cache held for that directory; an incomplete one is dropped.
+*/
+  SCANJOB *job = prefetch.job;
+  DIRLISTING *listing, *cached;
+  struct stat st;
+
+  if(job == NULL)
+    return;
+  pthread_join(job->thread, NULL);
+  if(job->listing == NULL) {
+    //Only opened so far
+    if(!__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)
+       && prefetchRead(job))
+      return;
+    prefetch.job = NULL;
+    scanJobFree(job);
+    return;
+  }
+  prefetch.job = NULL;
+  listing = job->listing;
+  st.st_dev = listing->dev;
+  st.st_ino = listing->ino;
+  cached = cacheLookup(&st);
+  if(__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)
+     || (cached != NULL && cached == dirCache.pinned)) {
+    prefetch.dropped++;
+  } else {
+    if(cached != NULL) {
+      cacheUnlink(cached);
+      freeListing(cached);
+    }
+    listingArrange(listing, job->fd, NULL);
+    listing->prefetched = 1;
+    cacheInsert(listing);
+    cacheAccount(listing);
+    job->listing = NULL;	//The cache has it now
+    prefetch.ready++;
+    cacheEvict();
+  }
+  scanJobFree(job);
+  showPrefetchStatus();
+}
+
+void prefetchDrop(void) {
+//The selector moved on: stop the read-ahead without waiting for it,
+//keep it if it finished.
+  SCANJOB *job = prefetch.job;
+
+  if(job == NULL)
+    return;
+  if(__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+    if(job->listing == NULL)	//Opened, not read: leave it at that
+      __atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+    prefetchCollect();
+    return;
+  }
+  __atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+  prefetch.job = NULL;
+  if(job->listing != NULL)
+    prefetch.dropped++;
+  scanOrphan(job);
+  showPrefetchStatus();
+}
+
+int prefetchClaim(struct stat *st) {
+/*
+Called by openListing() with the directory being opened. If it is being
+read ahead, a finished read-ahead goes into the cache, and one still
+running becomes the background scan of the directory on display.
+Any other read-ahead is stopped. Returns 1 if it became activeScan.
+*/
+  SCANJOB *job = prefetch.job;
+  DIRLISTING *listing, *cached;
+
+  if(listing1 != NULL)
+    prefetch.opens++;
+  prefetch.want = NULL;
+  prefetch.pending = 0;
+  if(job == NULL)
+    return 0;
+  listing = job->listing;
+  if(listing == NULL || listing->dev != st->st_dev
+     || listing->ino != st->st_ino) {
+    prefetchDrop();
+    return 0;
+  }
+  //From here on it may read the whole directory
+  __atomic_store_n(&job->budget, 0, __ATOMIC_RELEASE);
+  cached = cacheLookup(st);
+  if(__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+    prefetchCollect();
+    return 0;
+  }
+  if(__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)
+     || (cached != NULL && cached == dirCache.pinned)) {
+    prefetchDrop();
+    return 0;
+  }
+  if(cached != NULL) {
+    cacheUnlink(cached);
+    freeListing(cached);
+  }
+  //finishScan() adds its bytes
+  cacheInsert(listing);
+  __atomic_store_n(&job->progress, 1, __ATOMIC_RELEASE);
+  prefetch.job = NULL;
+  prefetch.hits++;
+  activeScan = job;
+  return 1;
+}
+
+void showPrefetchStatus(void) {
+//Line 20: read-aheads and how many opens they served.
+  cleanLine(20, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 20);
+  screenPrintf("Prefetch: %lu read | %lu dropped | %lu/%lu opens hit (%.0f%%)",
+	       prefetch.ready, prefetch.dropped, prefetch.hits,
+	       prefetch.opens,
+	       prefetch.opens > 0 ? 100.0 * prefetch.hits / prefetch.opens : 0);
+}
+
+/* ---------------- */
+/* Tree walk (du)   */
+/* ---------------- */
+/*
+'d' walks the whole tree below the directory on display and shows,
+next to every item, the disk space used below it (files: their own).
+A pool of threads shares the work: each one has its own deque of open
+directories, takes the newest from its own and, when that is empty,
+steals the oldest (so the biggest pending subtrees) from another one.
+Directories are opened with openat() relative to their parent's fd and
+entries are read with fstatat(), so no path is ever built. Files with
+more than one link are counted once. Totals are added up per directory
+read and the UI is told at most every DU_NOTIFY_MS, so they grow live.
+*/
+
+static unsigned nameHash(const char *name) {
+  unsigned hash = 2166136261u;	//FNV-1a
+  while(*name != '\0')
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+  return hash;
+}
+
+DUTOTAL *duLookup(const char *name) {
+//Total of the item called name, NULL if it was not listed.
+  unsigned slot, item;
+  if(du.slots == NULL)
+    return NULL;
+  for(slot = nameHash(name) & du.slotMask; (item = du.slots[slot]) != 0;
+      slot = (slot + 1) & du.slotMask)
+    if(strcmp(du.itemNames[item - 1], name) == 0)
+      return &du.totals[item - 1];
+  return NULL;
+}
+
+int duStart(void) {
+//Starts walking the tree below the directory on display.
+//Returns 0 if it cannot be walked now.
+  LISTCHOICE *head = listingHead(listing1);
+  unsigned i, slot, length = listingLength(listing1), size = 1;
+  long    cores = sysconf(_SC_NPROCESSORS_ONLN);
+  static int initialized = 0;
+  DUTASK  root;
+
+  if(du.listing != NULL || du.threads > 0 || head == NULL
+     || activeScan != NULL)
+    return 0;			//The last walk may still be stopping
+  if(du.names.base == NULL && arenaInit(&du.names, NAME_ARENA_SIZE) != 0)
+    return 0;
+  if(!initialized) {
+    for(i = 0; i < MAX_DU_THREADS; i++)
+      pthread_mutex_init(&du.queue[i].lock, NULL);
+    pthread_mutex_init(&du.linkLock, NULL);
+    pthread_mutex_init(&du.idleLock, NULL);
+    pthread_cond_init(&du.work, NULL);
+    initialized = 1;
+  }
+  if(scanEventFd < 0)
+    scanEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  root.fd = dirOpenTop();
+  if(root.fd < 0 || scanEventFd < 0) {
+    if(root.fd >= 0)
+      close(root.fd);
+    return 0;
+  }
+  root.total = NULL;
+
+  //Names of the items, hashed, each with its total
+  arenaReset(&du.names);
+  while(size < length * 2)
+    size *= 2;
+  du.count = length;
+  du.itemNames = (char **)arenaAlloc(&du.names, length * sizeof(char *));
+  du.totals = (DUTOTAL *) arenaAlloc(&du.names, length * sizeof(DUTOTAL));
+  du.slots = (unsigned *)arenaAlloc(&du.names, size * sizeof(unsigned));
+  if(du.itemNames == NULL || du.totals == NULL || du.slots == NULL) {
+    close(root.fd);
+    du.slots = NULL;
+    return 0;
+  }
+  memset(du.totals, 0, length * sizeof(DUTOTAL));
+  memset(du.slots, 0, size * sizeof(unsigned));
+  du.slotMask = size - 1;
+  for(i = 2; i < length; i++) {
+    du.itemNames[i] = arenaStrdup(&du.names, head[i].path);
+    if(du.itemNames[i] == NULL)
+      break;
+    for(slot = nameHash(du.itemNames[i]) & du.slotMask; du.slots[slot] != 0;
+	slot = (slot + 1) & du.slotMask) ;
+    du.slots[slot] = i + 1;
+  }
+
+  memset(&du.all, 0, sizeof(DUTOTAL));
+  du.errors = 0;
+  du.cancel = 0;
+  du.finished = 0;
+  du.lastSignal = 0;
+  du.linkCount = 0;
+  du.idle = 0;
+  du.seconds = 0;
+  du.threads = cores > 0 ? cores * 2 : 2;	//They mostly wait on I/O
+  if(du.threads > MAX_DU_THREADS)
+    du.threads = MAX_DU_THREADS;
+  for(i = 0; i < du.threads; i++)
+    du.queue[i].head = du.queue[i].count = 0;
+  du.pending = 1;
+  du.openDirs = 1;
+  duPush(0, &root);
+  clock_gettime(CLOCK_MONOTONIC, &du.start);
+  du.listing = listing1;
+  for(i = 0; i < du.threads; i++)
+    if(pthread_create(&du.thread[i], NULL, duThread, (void *)(long)i) != 0)
+      break;
+  if(i < du.threads) {
+    //Thieves count on every thread being there: give up
+    du.threads = i;
+    duStop();
+    return 0;
+  }
+  return 1;
+}
+
+static int duWaiting(void) {
+//1 while there is nothing to take but others may still queue some.
+//Called with du.idleLock held.
+  unsigned i;
+
+  for(i = 0; i < du.threads; i++)
+    if(__atomic_load_n(&du.queue[i].count, __ATOMIC_RELAXED) > 0)
+      return 0;
+  return __atomic_load_n(&du.pending, __ATOMIC_ACQUIRE) > 0
+      && !__atomic_load_n(&du.cancel, __ATOMIC_ACQUIRE);
+}
+
+void duWake(int all) {
+//Wakes one thread waiting on work, or all of them when the walk is over.
+  pthread_mutex_lock(&du.idleLock);
+  if(du.idle > 0) {
+    if(all)
+      pthread_cond_broadcast(&du.work);
+    else
+      pthread_cond_signal(&du.work);
+  }
+  pthread_mutex_unlock(&du.idleLock);
+}
+
+void *duThread(void *arg) {
+  unsigned self = (unsigned)(long)arg;
+  char   *buffer = (char *)malloc(SCAN_BUFFER_SIZE);
+  DUTASK  task;
+
+  while(buffer != NULL && !__atomic_load_n(&du.cancel, __ATOMIC_ACQUIRE)) {
+    if(duPop(self, &task) || duSteal(self, &task)) {
+      __atomic_sub_fetch(&du.openDirs, 1, __ATOMIC_RELAXED);
+      duWalkDir(&task, self, buffer);
+      if(__atomic_sub_fetch(&du.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+	duWake(1);		//That was the last one
+	break;
+      }
+      continue;
+    }
+    if(__atomic_load_n(&du.pending, __ATOMIC_ACQUIRE) == 0)
+      break;
+    //Others are still reading: sleep until they queue something
+    pthread_mutex_lock(&du.idleLock);
+    du.idle++;
+    while(duWaiting())
+      pthread_cond_wait(&du.work, &du.idleLock);
+    du.idle--;
+    pthread_mutex_unlock(&du.idleLock);
+  }
+  free(buffer);
+  __atomic_add_fetch(&du.finished, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&du.lastSignal, 0, __ATOMIC_RELAXED);
+  duSignal();
+  return NULL;
+}
+
+static void duAdd(DUTOTAL * total, DUTOTAL * amount) {
+  __atomic_add_fetch(&total->apparent, amount->apparent, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&total->allocated, amount->allocated,
+		     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&total->files, amount->files, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&total->dirs, amount->dirs, __ATOMIC_RELAXED);
+}
+
+void duWalkDir(DUTASK * task, unsigned self, char *buffer) {
+/*
+Reads one directory and adds what is in it to task->total and du.all;
+at the top (no total), every entry goes to the total of its own item.
+Subdirectories are queued for any thread to take, or walked right here
+when MAX_OPEN_DIRS are queued already.
+*/
+  DUTOTAL local, entry, *itemTotal = NULL;
+  struct linux_dirent64 *dir;
+  struct stat st;
+  DUTASK  sub;
+  char   *inner;
+  int     nread, pos;
+
+  memset(&local, 0, sizeof(local));
+  while(!__atomic_load_n(&du.cancel, __ATOMIC_ACQUIRE)
+	&& (nread = syscall(SYS_getdents64, task->fd, buffer,
+			    SCAN_BUFFER_SIZE)) > 0) {
+    for(pos = 0; pos < nread; pos += dir->d_reclen) {
+      dir = (struct linux_dirent64 *)(buffer + pos);
+      if(strcmp(dir->d_name, CURRENTDIR) == 0
+	 || strcmp(dir->d_name, CHANGEDIR) == 0)
+	continue;
+      if(fstatat(task->fd, dir->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+	__atomic_add_fetch(&du.errors, 1, __ATOMIC_RELAXED);
+	continue;
+      }
+      if(!S_ISDIR(st.st_mode) && st.st_nlink > 1
+	 && !duFirstLink(st.st_dev, st.st_ino))
+	continue;		//Counted already, under another name
+      entry.apparent = st.st_size;
+      entry.allocated = (unsigned long long)st.st_blocks * 512;
+      entry.files = S_ISDIR(st.st_mode) ? 0 : 1;
+      entry.dirs = S_ISDIR(st.st_mode) ? 1 : 0;
+      local.apparent += entry.apparent;
+      local.allocated += entry.allocated;
+      local.files += entry.files;
+      local.dirs += entry.dirs;
+      if(task->total == NULL) {
+	itemTotal = duLookup(dir->d_name);
+	if(itemTotal != NULL)
+	  duAdd(itemTotal, &entry);
+      }
+      if(!S_ISDIR(st.st_mode))
+	continue;
+      sub.fd = openat(task->fd, dir->d_name,
+		      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if(sub.fd < 0) {
+	__atomic_add_fetch(&du.errors, 1, __ATOMIC_RELAXED);
+	continue;
+      }
+      sub.total = task->total != NULL ? task->total : itemTotal;
+      if(sub.total == NULL) {
+	close(sub.fd);		//Not listed (created since): skip it
+	continue;
+      }
+      inner = NULL;
+      if(__atomic_load_n(&du.openDirs, __ATOMIC_RELAXED) >= MAX_OPEN_DIRS)
+	inner = (char *)malloc(SCAN_BUFFER_SIZE);
+      if(inner != NULL) {
+	duWalkDir(&sub, self, inner);
+	free(inner);
+      } else {
+	__atomic_add_fetch(&du.openDirs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&du.pending, 1, __ATOMIC_ACQ_REL);
+	duPush(self, &sub);
+      }
+    }
+    //Publish what this batch found
+    if(task->total != NULL)
+      duAdd(task->total, &local);
+    duAdd(&du.all, &local);
+    memset(&local, 0, sizeof(local));
+    duSignal();
+  }
+  close(task->fd);
+}
+
+void duPush(unsigned self, DUTASK * task) {
+//Queues a directory on this thread's deque; the deque grows as needed.
+  DUDEQUE *queue = &du.queue[self];
+  DUTASK *tasks;
+  unsigned i, size;
+
+  pthread_mutex_lock(&queue->lock);
+  if(queue->count == queue->size) {
+    size = queue->size > 0 ? queue->size * 2 : 64;
+    tasks = (DUTASK *) malloc(size * sizeof(DUTASK));
+    if(tasks == NULL) {
+      pthread_mutex_unlock(&queue->lock);
+      close(task->fd);
+      __atomic_add_fetch(&du.errors, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&du.openDirs, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&du.pending, 1, __ATOMIC_ACQ_REL);
+      return;
+    }
+    for(i = 0; i < queue->count; i++)
+      tasks[i] = queue->tasks[(queue->head + i) % queue->size];
+    free(queue->tasks);
+    queue->tasks = tasks;
+    queue->head = 0;
+    queue->size = size;
+  }
+  queue->tasks[(queue->head + queue->count) % queue->size] = *task;
+  __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&queue->lock);
+  duWake(0);
+}
+
+int duPop(unsigned self, DUTASK * task) {
+//Newest directory of this thread's deque: depth first, warm caches.
+  DUDEQUE *queue = &du.queue[self];
+  int     found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if(queue->count > 0) {
+    __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+    *task = queue->tasks[(queue->head + queue->count) % queue->size];
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+int duSteal(unsigned self, DUTASK * task) {
+//Oldest directory of another thread's deque.
+  DUDEQUE *queue;
+  unsigned i;
+  int     found = 0;
+
+  for(i = 1; i < du.threads && !found; i++) {
+    queue = &du.queue[(self + i) % du.threads];
+    if(__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+      continue;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count > 0) {
+      *task = queue->tasks[queue->head];
+      queue->head = (queue->head + 1) % queue->size;
+      __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+      found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+  }
+  return found;
+}
+
+int duFirstLink(dev_t dev, ino_t ino) {
+//1 the first time a hard-linked inode is seen.
+  unsigned long long *links;
+  unsigned slot, i, size, mask;
+  int     first = 1;
+
+  pthread_mutex_lock(&du.linkLock);
+  if((du.linkCount + 1) * 2 > du.linkSize) {
+    size = du.linkSize > 0 ? du.linkSize * 2 : 1024;
+    links = (unsigned long long *)calloc(size * 2, sizeof(*links));
+    if(links == NULL) {
+      pthread_mutex_unlock(&du.linkLock);
+      return 1;
+    }
+    for(i = 0; i < du.linkSize; i++) {
+      if(du.links[i * 2] == 0)
+	continue;
+      for(slot = (du.links[i * 2] * 0x9e3779b97f4a7c15ULL) >> 40 & (size - 1);
+	  links[slot * 2] != 0; slot = (slot + 1) & (size - 1)) ;
+      links[slot * 2] = du.links[i * 2];
+      links[slot * 2 + 1] = du.links[i * 2 + 1];
+    }
+    free(du.links);
+    du.links = links;
+    du.linkSize = size;
+  }
+  mask = du.linkSize - 1;
+  for(slot = ((unsigned long long)ino * 0x9e3779b97f4a7c15ULL) >> 40 & mask;
+      du.links[slot * 2] != 0; slot = (slot + 1) & mask)
+    if(du.links[slot * 2] == ino && du.links[slot * 2 + 1] == dev) {
+      first = 0;
+      break;
+    }
+  if(first) {
+    du.links[slot * 2] = ino;
+    du.links[slot * 2 + 1] = dev;
+    du.linkCount++;
+  }
+  pthread_mutex_unlock(&du.linkLock);
+  return first;
+}
+
+void duSignal(void) {
+//Wakes the UI, at most every DU_NOTIFY_MS.
+  struct timespec now;
+  long long ms, last = __atomic_load_n(&du.lastSignal, __ATOMIC_RELAXED);
+  unsigned long long one = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+  if(ms - last < DU_NOTIFY_MS
+     || !__atomic_compare_exchange_n(&du.lastSignal, &last, ms, 0,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  write(scanEventFd, &one, sizeof(one));
+}
+
+int duProgress(void) {
+//Called when a scanner signals. Ends the walk once every thread is done.
+//Returns 1 if the totals on display have to be redrawn.
+  duReap();
+  if(du.listing == NULL)
+    return 0;
+  showDuStatus();
+  return du.listing == listing1;
+}
+
+void duStop(void) {
+//Stops the walk and takes the totals off the list. The threads are not
+//waited for, one may be stuck on a hung mount: duReap() collects them.
+  if(du.listing == NULL)
+    return;
+  __atomic_store_n(&du.cancel, 1, __ATOMIC_RELEASE);
+  duWake(1);
+  du.listing = NULL;
+  duReap();
+  showDuStatus();
+}
+
+void duReap(void) {
+//Joins the threads once every one of them has returned.
+  DUTASK  task;
+  unsigned i;
+
+  if(du.threads == 0
+     || __atomic_load_n(&du.finished, __ATOMIC_ACQUIRE) != (int)du.threads)
+    return;
+  for(i = 0; i < du.threads; i++)
+    pthread_join(du.thread[i], NULL);
+  for(i = 0; i < du.threads; i++)
+    while(duPop(i, &task))
+      close(task.fd);
+  du.seconds = elapsedSeconds(&du.start);
+  du.threads = 0;
+  if(du.listing == NULL)
+    du.slots = NULL;		//Stopped: the totals are gone
+}
+
+void formatSize(char out[DU_COLUMN], unsigned long long bytes) {
+//Five characters at most: 1023B, 9.9K, 1023K, 12.3M...
+  const char *units = "BKMGTPE";
+  double  value = bytes;
+  int     unit = 0;
+
+  while(value >= 1024 && unit < 6) {
+    value /= 1024;
+    unit++;
+  }
+  if(unit == 0)
+    snprintf(out, DU_COLUMN, "%lluB", bytes);
+  else if(value < 9.95)
+    snprintf(out, DU_COLUMN, "%.1f%c", value, units[unit]);
+  else
+    snprintf(out, DU_COLUMN, "%.0f%c", value, units[unit]);
+}
+
+void showDuStatus(void) {
+//Right of the window: totals of the tree on display.
+  char    allocated[DU_COLUMN], apparent[DU_COLUMN];
+
+  int     x = windowRight() + 4;
+
+  screenFill(x, 7, screen.columns, 9, F_WHITE, B_BLUE);
+  if(du.listing == NULL || du.listing != listing1)
+    return;
+  formatSize(allocated, __atomic_load_n(&du.all.allocated,
+					__ATOMIC_RELAXED));
+  formatSize(apparent, __atomic_load_n(&du.all.apparent, __ATOMIC_RELAXED));
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(x, 7);
+  screenPrintf("Tree: %llu files | %llu dirs",
+	       __atomic_load_n(&du.all.files, __ATOMIC_RELAXED),
+	       __atomic_load_n(&du.all.dirs, __ATOMIC_RELAXED));
+  gotoxy(x, 8);
+  screenPrintf("Size: %s on disk | %s apparent", allocated, apparent);
+  gotoxy(x, 9);
+  if(du.threads > 0)
+    screenPrintf("Walking: %u threads | %.1f s | %llu errors", du.threads,
+		 elapsedSeconds(&du.start),
+		 __atomic_load_n(&du.errors, __ATOMIC_RELAXED));
+  else
+    screenPrintf("Walked in %.3f s | %llu errors", du.seconds, du.errors);
+}
+
+/* ---------------- */
+/* Search           */
+/* ---------------- */
+/*
+'f' opens a prompt on line 5 for a name to look for in the whole tree
+below the directory on display: a substring (any case), a glob or an
+extended regex; Tab switches between them, and on to "content", which
+looks for the exact bytes inside the files instead. Enter starts a pool
+of threads on it, and the listbox shows the results in place of the
+directory while they come in. The results are a listing of their own:
+"." and "..", then every match as a path relative to where the search
+started. Threads append to it under a lock and publish the new length,
+so the UI reads it like a listing being scanned. The work is one stack
+of tasks shared by the threads: directories to read and, for content,
+files to scan, all kept as relative paths opened from the starting
+directory's fd, so a deep tree holds no fds. Small files are read in
+one go; bigger ones are mapped GREP_CHUNK at a time, and their chunks
+past the first are tasks too, so one big file keeps every thread busy
+and none of it is mapped whole. The number of matches in each file goes
+in the size column. Esc stops the search; Enter on a match goes to the
+directory it is in, with the match selected, and on "." or ".." back to
+where it started.
+*/
+
+void searchSignal(void) {
+//Wakes the UI, at most every SCAN_NOTIFY_MS.
+  struct timespec now;
+  long long ms, last = __atomic_load_n(&search.lastSignal, __ATOMIC_RELAXED);
+  unsigned long long one = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+  if(ms - last < SCAN_NOTIFY_MS
+     || !__atomic_compare_exchange_n(&search.lastSignal, &last, ms, 0,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  write(scanEventFd, &one, sizeof(one));
+}
+
+void searchPush(SEARCHTASK * task) {
+//Queues a task. Takes its path, or its share of the file, over.
+  SEARCHTASK *stack;
+  unsigned size;
+
+  pthread_mutex_lock(&search.lock);
+  if(search.count == search.size) {
+    size = search.size > 0 ? search.size * 2 : 256;
+    stack = (SEARCHTASK *) realloc(search.stack, size * sizeof(SEARCHTASK));
+    if(stack == NULL) {
+      pthread_mutex_unlock(&search.lock);
+      __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+      searchDrop(task);
+      return;
+    }
+    search.stack = stack;
+    search.size = size;
+  }
+  search.stack[search.count++] = *task;
+  search.pending++;
+  pthread_cond_signal(&search.wake);
+  pthread_mutex_unlock(&search.lock);
+}
+
+int searchPop(SEARCHTASK * task) {
+//Newest task queued: depth first, and the chunks of a file before the
+//next file. Waits while others may still queue some; 0 once there are
+//none left or the search is stopped.
+  int     found = 0;
+
+  pthread_mutex_lock(&search.lock);
+  while(search.count == 0 && search.pending > 0
+	&& !__atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE))
+    pthread_cond_wait(&search.wake, &search.lock);
+  if(search.count > 0 && !__atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE)) {
+    *task = search.stack[--search.count];
+    found = 1;
+  }
+  pthread_mutex_unlock(&search.lock);
+  return found;
+}
+
+void searchDrop(SEARCHTASK * task) {
+//Lets go of a task that will not be done.
+  if(task->file != NULL)
+    grepDone(task->file);
+  else
+    free(task->path);
+}
+
+int searchMatch(const char *name, size_t length) {
+//1 if name is what the prompt asked for.
+  char    lower[NAME_MAX + 1];
+  size_t  i;
+
+  switch (search.mode) {
+    case SEARCH_GLOB:
+      return fnmatch(search.pattern, name, FNM_CASEFOLD) == 0;
+    case SEARCH_REGEX:
+      return regexec(&search.regex, name, 0, NULL, 0) == 0;
+    default:
+      if(length > NAME_MAX)
+	length = NAME_MAX;
+      for(i = 0; i < length; i++)
+	lower[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 32 :
+	    name[i];
+      return findSubstring(lower, length, search.lower,
+			   search.patternLength) >= 0;
+  }
+}
+
+void searchHit(const char *path, unsigned itemType,
+	       unsigned long long matches) {
+//Adds path to the results, with its matches for content, and publishes
+//it.
+  DIRLISTING *listing = search.listing;
+  LISTCHOICE *item;
+  unsigned long long *count;
+
+  //The count of a result has the same index as its record
+  pthread_mutex_lock(&search.listLock);
+  count = (unsigned long long *)arenaAlloc(&search.counts,
+					   sizeof(unsigned long long));
+  item = count != NULL ? newelement(listing, path, itemType) : NULL;
+  if(item != NULL) {
+    *count = matches;
+    addend(listingHead(listing), item);
+    __atomic_store_n(&listing->length, listingCount(listing),
+		     __ATOMIC_RELEASE);
+  } else if(count != NULL)
+    search.counts.used -= sizeof(unsigned long long);
+  pthread_mutex_unlock(&search.listLock);
+}
+
+void searchDir(const char *path, char *buffer) {
+/*
+Reads one directory: matching entries go to the results and the
+subdirectories on the stack, with the files too for content. path is
+relative to the start, "" for the start itself.
+*/
+  struct linux_dirent64 *dir;
+  size_t  length = strlen(path), nameLength;
+  SEARCHTASK task;
+  char    sub[PATH_MAX];
+  int     fd, nread, pos;
+
+  fd = openat(search.rootFd, length > 0 ? path : CURRENTDIR,
+	      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if(fd < 0) {
+    __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  memcpy(sub, path, length);
+  if(length > 0)
+    sub[length++] = '/';
+  task.file = NULL;
+  task.offset = 0;
+  while(!__atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE)
+	&& (nread = syscall(SYS_getdents64, fd, buffer,
+			    SCAN_BUFFER_SIZE)) > 0) {
+    for(pos = 0; pos < nread; pos += dir->d_reclen) {
+      dir = (struct linux_dirent64 *)(buffer + pos);
+      if(strcmp(dir->d_name, CURRENTDIR) == 0
+	 || strcmp(dir->d_name, CHANGEDIR) == 0)
+	continue;
+      task.itemType = resolveType(fd, dir->d_name, dir->d_type);
+      if(task.itemType != DIRECTORY && task.itemType != FILEITEM)
+	continue;		//Not listed by the browser either
+      nameLength = strlen(dir->d_name);
+      if(length + nameLength + 1 > sizeof(sub)) {
+	__atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+	continue;		//Too deep to be opened by its path
+      }
+      memcpy(sub + length, dir->d_name, nameLength + 1);
+      if(search.mode != SEARCH_CONTENT
+	 && searchMatch(dir->d_name, nameLength))
+	searchHit(sub, task.itemType, 0);
+      if(task.itemType != DIRECTORY && search.mode != SEARCH_CONTENT)
+	continue;
+      task.path = strdup(sub);
+      if(task.path == NULL)
+	__atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+      else
+	searchPush(&task);
+    }
+  }
+  close(fd);
+  __atomic_add_fetch(&search.dirs, 1, __ATOMIC_RELAXED);
+  searchSignal();
+}
+
+void grepFile(char *path, char *buffer) {
+/*
+Counts the matches in one file; takes path over. Files up to
+GREP_READ_SIZE are read into buffer at once. Bigger ones get a GREPFILE
+that adds up what their chunks find: the first one is scanned here and
+the rest are queued for any thread.
+*/
+  struct stat st;
+  GREPFILE *file;
+  SEARCHTASK task;
+  unsigned long long count;
+  ssize_t nread;
+  int     fd;
+
+  fd = openat(search.rootFd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+    if(fd >= 0)
+      close(fd);
+    free(path);
+    return;
+  }
+  __atomic_add_fetch(&search.files, 1, __ATOMIC_RELAXED);
+  if(st.st_size <= GREP_READ_SIZE) {
+    nread = read(fd, buffer, GREP_READ_SIZE);
+    close(fd);
+    if(nread > 0) {
+      __atomic_add_fetch(&search.bytes, nread, __ATOMIC_RELAXED);
+      count = grepCount(buffer, nread, nread);
+      if(count > 0)
+	searchHit(path, FILEITEM, count);
+    } else if(nread < 0)
+      __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+    free(path);
+    searchSignal();
+    return;
+  }
+  file = (GREPFILE *) malloc(sizeof(GREPFILE));
+  if(file == NULL) {
+    __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+    close(fd);
+    free(path);
+    return;
+  }
+  file->path = path;
+  file->size = st.st_size;
+  file->count = 0;
+  file->chunks = (st.st_size + GREP_CHUNK - 1) / GREP_CHUNK;
+  task.path = NULL;
+  task.file = file;
+  task.itemType = FILEITEM;
+  for(task.offset = GREP_CHUNK; task.offset < st.st_size;
+      task.offset += GREP_CHUNK)
+    searchPush(&task);
+  grepChunk(file, 0, fd);
+}
+
+void grepChunk(GREPFILE * file, off_t offset, int fd) {
+/*
+Maps the chunk of file at offset, plus the bytes a match starting in it
+may run over into the next, and counts the matches that start in it.
+fd is the file if the caller has it open, or -1. If the file got
+shorter meanwhile, reading past its end raises SIGBUS: grepBus() brings
+the thread back here and the chunk counts as an error.
+*/
+  sigjmp_buf jump;
+  size_t  length;
+  char   *data;
+  volatile unsigned long long count = 0;	//Kept across siglongjmp()
+
+  if(fd < 0)
+    fd = openat(search.rootFd, file->path, O_RDONLY | O_CLOEXEC);
+  length = file->size - offset;
+  if(length > GREP_CHUNK + search.patternLength - 1)
+    length = GREP_CHUNK + search.patternLength - 1;
+  data = fd < 0 || __atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE) ?
+      MAP_FAILED : (char *)mmap(NULL, length, PROT_READ,
+				MAP_PRIVATE | MAP_POPULATE, fd, offset);
+  if(fd >= 0)
+    close(fd);
+  if(data == MAP_FAILED) {
+    __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+    grepDone(file);
+    return;
+  }
+  if(sigsetjmp(jump, 1) == 0) {
+    grepJump = &jump;
+    count = grepCount(data, length, length < GREP_CHUNK ? length :
+		      GREP_CHUNK);
+    __atomic_add_fetch(&search.bytes, length < GREP_CHUNK ? length :
+		       GREP_CHUNK, __ATOMIC_RELAXED);
+  } else
+    __atomic_add_fetch(&search.errors, 1, __ATOMIC_RELAXED);
+  grepJump = NULL;
+  munmap(data, length);
+  __atomic_add_fetch(&file->count, count, __ATOMIC_RELAXED);
+  grepDone(file);
+  searchSignal();
+}
+
+void grepDone(GREPFILE * file) {
+//One chunk less to go. After the last one the file is a result if
+//anything was found in it.
+  unsigned long long count;
+
+  if(__atomic_sub_fetch(&file->chunks, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  count = __atomic_load_n(&file->count, __ATOMIC_ACQUIRE);
+  if(count > 0 && !__atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE))
+    searchHit(file->path, FILEITEM, count);
+  free(file->path);
+  free(file);
+}
+
+unsigned long long grepCount(const char *data, size_t length,
+			     size_t limit) {
+//Matches of the search text in data that start before limit. Every
+//position counts, overlapping or not ("aa" is in "aaa" twice), so each
+//match belongs to the one chunk it starts in and a file split in
+//chunks gets the same count as one read whole.
+  unsigned long long count = 0;
+  size_t  position = 0;
+  long    hit;
+
+  while(position < limit
+	&& (hit = findSubstring(data + position, length - position,
+				search.pattern, search.patternLength)) >= 0
+	&& position + hit < limit) {
+    count++;
+    position += hit + 1;
+  }
+  return count;
+}
+
+void grepBus(int number) {
+//SIGBUS: a file being scanned got shorter under its mapping. The thread
+//scanning it gives the chunk up; anywhere else it is the usual crash.
+  if(grepJump != NULL)
+    siglongjmp(*grepJump, 1);
+  sigaction(number, &(struct sigaction) {.sa_handler = SIG_DFL}, NULL);
+}
+
+void   *searchThread(void *arg) {
+  char   *buffer = (char *)arg;
+  SEARCHTASK task;
+
+  while(searchPop(&task)) {
+    if(task.file != NULL)
+      grepChunk(task.file, task.offset, -1);
+    else if(task.itemType == DIRECTORY) {
+      searchDir(task.path, buffer);
+      free(task.path);
+    } else
+      grepFile(task.path, buffer + SCAN_BUFFER_SIZE);
+    pthread_mutex_lock(&search.lock);
+    if(--search.pending == 0)
+      pthread_cond_broadcast(&search.wake);	//That was the last one
+    pthread_mutex_unlock(&search.lock);
+  }
+  __atomic_add_fetch(&search.finished, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&search.lastSignal, 0, __ATOMIC_RELAXED);
+  searchSignal();
+  return NULL;
+}
+
+int searchStart(void) {
+/*
+Starts searching the tree below the directory on display for the text
+of the prompt, replacing the results of the last search. Returns -1 if
+it cannot start; search.error says why.
+*/
+  long    cores = sysconf(_SC_NPROCESSORS_ONLN);
+  static int initialized = 0;
+  size_t  perThread = SCAN_BUFFER_SIZE;
+  SEARCHTASK root = { NULL, NULL, 0, DIRECTORY };
+  unsigned i;
+
+  searchStop();
+  search.error = NULL;
+  if(search.stopping) {
+    search.error = "the last search is still stopping";
+    return -1;
+  }
+  if(search.length == 0) {
+    search.error = "type something first";
+    return -1;
+  }
+  //The prompt may be edited again while the threads use these
+  search.mode = search.promptMode;
+  memcpy(search.pattern, search.text, search.length + 1);
+  search.patternLength = search.length;
+  if(search.mode == SEARCH_REGEX) {
+    if(regcomp(&search.regex, search.pattern,
+	       REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
+      search.error = "not a valid regex";
+      return -1;
+    }
+    search.compiled = 1;
+  }
+  for(i = 0; i <= search.length; i++)
+    search.lower[i] = (search.pattern[i] >= 'A'
+		       && search.pattern[i] <= 'Z') ? search.pattern[i] + 32 :
+	search.pattern[i];
+  if(!initialized) {
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_mutex_init(&search.listLock, NULL);
+    pthread_cond_init(&search.wake, NULL);
+    sigaction(SIGBUS, &(struct sigaction) {.sa_handler = grepBus}, NULL);
+    initialized = 1;
+  }
+  if(scanEventFd < 0)
+    scanEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  search.threads = cores > 0 ? cores * 2 : 2;	//They mostly wait on I/O
+  if(search.threads > MAX_SEARCH_THREADS)
+    search.threads = MAX_SEARCH_THREADS;
+  if(search.mode == SEARCH_CONTENT)
+    perThread += GREP_READ_SIZE;
+  search.rootFd = dirOpenTop();
+  search.listing = newListing();
+  search.buffers = (char *)malloc(search.threads * perThread);
+  root.path = strdup("");
+  if(scanEventFd < 0 || search.rootFd < 0 || search.listing == NULL
+     || arenaInit(&search.counts, COUNT_ARENA_SIZE) != 0
+     || search.buffers == NULL || root.path == NULL) {
+    free(root.path);
+    search.threads = 0;
+    search.stopping = 1;
+    searchReap();
+    search.error = "cannot read this directory";
+    return -1;
+  }
+  addDots(search.listing);
+  arenaAlloc(&search.counts, 2 * sizeof(unsigned long long));	//The dots
+  search.dirs = search.files = search.bytes = search.errors = 0;
+  search.cancel = 0;
+  search.finished = 0;
+  search.lastSignal = 0;
+  search.pending = 0;
+  search.count = 0;
+  search.seconds = 0;
+  searchPush(&root);
+  clock_gettime(CLOCK_MONOTONIC, &search.start);
+  for(i = 0; i < search.threads; i++)
+    if(pthread_create(&search.thread[i], NULL, searchThread,
+		      search.buffers + (size_t)i * perThread) != 0)
+      break;
+  search.threads = i;
+  if(i == 0) {
+    searchStop();
+    search.error = "no thread to search with";
+    return -1;
+  }
+  return 0;
+}
+
+void searchStop(void) {
+//Stops the search and takes its results off the screen. The threads
+//are not waited for, one may be stuck on a hung mount: searchReap()
+//frees the results once they are all done.
+  if(search.listing == NULL || search.stopping)
+    return;
+  __atomic_store_n(&search.cancel, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&search.lock);
+  pthread_cond_broadcast(&search.wake);
+  pthread_mutex_unlock(&search.lock);
+  if(listing1 == search.listing)
+    listing1 = NULL;		//Being left: nothing is to use it
+  search.stopping = 1;
+  searchReap();
+}
+void searchReap(void) {
+//Joins the threads of a stopped search once every one of them has
+//returned, and drops what they used.
+  unsigned i;
+
+  if(!search.stopping || (search.threads > 0
+			  && __atomic_load_n(&search.finished,
+					     __ATOMIC_ACQUIRE)
+			  != (int)search.threads))
+    return;
+  for(i = 0; i < search.threads; i++)
+    pthread_join(search.thread[i], NULL);
+  search.threads = 0;
+  search.stopping = 0;
+  while(search.count > 0)
+    searchDrop(&search.stack[--search.count]);
+  free(search.buffers);
+  search.buffers = NULL;
+  if(search.rootFd >= 0)
+    close(search.rootFd);
+  search.rootFd = -1;
+  if(search.compiled)
+    regfree(&search.regex);
+  search.compiled = 0;
+  freeListing(search.listing);
+  search.listing = NULL;
+  arenaFree(&search.counts);
+}
+
+int searchRunning(void) {
+  return search.listing != NULL && !search.stopping && search.threads > 0;
+}
+
+int searchProgress(void) {
+//Called when a scanner signals. Collects the threads once they are all
+//done. Returns 1 if the results are on display and may have grown.
+  unsigned i;
+
+  searchReap();
+  if(search.listing == NULL || search.stopping)
+    return 0;
+  if(search.threads > 0
+     && __atomic_load_n(&search.finished, __ATOMIC_ACQUIRE)
+     == (int)search.threads) {
+    for(i = 0; i < search.threads; i++)
+      pthread_join(search.thread[i], NULL);
+    search.threads = 0;
+    search.seconds = elapsedSeconds(&search.start);
+  }
+  showSearchStatus();
+  return listing1 == search.listing;
+}
+
+int searchKey(int key) {
+/*
+Keys of the search prompt: 'f' opens it, printable characters are the
+text, Backspace, Tab switches substring/glob/regex/content, Esc closes
+it and Enter searches. Returns -1 if the key is not for the prompt, 0
+if it took it, 1 if the list has to be replaced: a search was started,
+or the results on display were dropped.
+*/
+  if(!search.prompt) {
+    if(key != 'f' || listing1 == NULL || filter.active)
+      return -1;
+    search.prompt = 1;
+    search.error = NULL;
+    search.length = 0;
+    search.text[0] = '\0';
+    showSearchStatus();
+    return 0;
+  }
+  if(key == K_ESCAPE)
+    search.prompt = 0;
+  else if(key == K_ENTER) {
+    if(searchStart() == 0) {
+      search.prompt = 0;
+      showSearchStatus();
+      return 1;
+    }
+    if(listing1 == NULL) {
+      showSearchStatus();
+      return 1;			//The last results are gone with it
+    }
+  } else if(key == K_BACKSPACE || key == K_CTRL_H) {
+    if(search.length > 0)
+      search.text[--search.length] = '\0';
+  } else if(key == K_TAB)
+    search.promptMode = (search.promptMode + 1) % SEARCH_MODES;
+  else if(key >= ' ' && key <= '~') {
+    if(search.length == MAX_SEARCH
+       || (key == '/' && search.promptMode != SEARCH_CONTENT))
+      return 0;			//A name has no slash
+    search.text[search.length++] = key;
+    search.text[search.length] = '\0';
+  } else
+    return -1;
+  showSearchStatus();
+  return 0;
+}
+
+int searchSelect(SCROLLDATA * scrollData) {
+/*
+Enter in the results. On a match, the directories down to it are
+entered and search.select is the name to select there; on "." or ".."
+the directory the search started from is shown again. The results are
+dropped. Returns -1 if the way down was cut short.
+*/
+  LISTCHOICE *item = listingHead(search.listing) + scrollData->itemIndex;
+  char   *name, *slash;
+  int     result = 0;
+
+  free(search.jump);
+  search.jump = NULL;
+  search.select = NULL;
+  if(scrollData->itemIndex >= 2)
+    search.jump = strdup(item->path);
+  searchStop();
+  cleanLine(5, B_BLUE, F_BLUE);
+  scrollData->path = search.jump;
+  if(search.jump == NULL)
+    return 0;
+  name = search.jump;
+  while((slash = strchr(name, '/')) != NULL && result == 0) {
+    *slash = '\0';
+    result = dirEnter(name);
+    *slash = '/';
+    name = slash + 1;
+  }
+  if(result == 0)
+    search.select = name;
+  return result;
+}
+
+unsigned long long searchCount(LISTCHOICE * item) {
+//Matches of a result of a content search.
+  return ((unsigned long long *)search.counts.base)[item->index];
+}
+
+void formatCount(char out[DU_COLUMN], unsigned long long count) {
+//Five characters at most: 99999, 123k, 12.3M...
+  const char *units = " kMGTPE";
+  double  value = count;
+  int     unit = 0;
+
+  if(count < 100000) {
+    snprintf(out, DU_COLUMN, "%llu", count);
+    return;
+  }
+  while(value >= 1000 && unit < 6) {
+    value /= 1000;
+    unit++;
+  }
+  if(value < 9.95)
+    snprintf(out, DU_COLUMN, "%.1f%c", value, units[unit]);
+  else
+    snprintf(out, DU_COLUMN, "%.0f%c", value, units[unit]);
+}
+
+void showSearchStatus(void) {
+//Line 5: the prompt, or how the search is going.
+  static const char *modes[SEARCH_MODES] = { "substring", "glob",
+    "regex", "content"
+  };
+  char    bytes[DU_COLUMN], rate[DU_COLUMN];
+  double  seconds;
+
+  if(!search.prompt && (search.listing == NULL || search.stopping)) {
+    if(!filter.active)
+      cleanLine(5, B_BLUE, F_BLUE);	//The line is the filter's otherwise
+    return;
+  }
+  cleanLine(5, B_BLUE, F_BLUE);
+  outputcolor(FH_WHITE, B_BLUE);
+  gotoxy(1, 5);
+  if(search.prompt) {
+    screenPrintf("Find (%s): %s_ | Tab: mode | Enter: search%s%s",
+		 modes[search.promptMode], search.text,
+		 search.error != NULL ? " | " : "",
+		 search.error != NULL ? search.error : "");
+    return;
+  }
+  seconds = search.threads > 0 ? elapsedSeconds(&search.start) :
+      search.seconds;
+  if(search.mode == SEARCH_CONTENT) {
+    formatSize(bytes, __atomic_load_n(&search.bytes, __ATOMIC_RELAXED));
+    formatSize(rate, seconds > 0 ? search.bytes / seconds : 0);
+    screenPrintf("In %u files: '%s' | %lu files, %s, %s/s | %lu errors",
+		 listingLength(search.listing) - 2, search.pattern,
+		 __atomic_load_n(&search.files, __ATOMIC_RELAXED), bytes,
+		 rate, __atomic_load_n(&search.errors, __ATOMIC_RELAXED));
+  } else
+    screenPrintf("Found %u %s '%s' | %lu dirs, %.0f/s | %lu errors",
+		 listingLength(search.listing) - 2, modes[search.mode],
+		 search.pattern,
+		 __atomic_load_n(&search.dirs, __ATOMIC_RELAXED),
+		 seconds > 0 ? search.dirs / seconds : 0,
+		 __atomic_load_n(&search.errors, __ATOMIC_RELAXED));
+  if(searchRunning())
+    screenPrintf(__atomic_load_n(&search.cancel, __ATOMIC_ACQUIRE) ?
+		 " | stopping..." : " | Esc stops");
+}
+
+/* ---------------- */
+/* Metadata columns */
+/* ---------------- */
+/*
+'m' shows size, mtime, permissions and owner next to the items. Only
+the rows on display and META_LOOKAHEAD rows around them are stat'ed,
+by a worker thread, so a slow mount never holds up a redraw; each
+record keeps what was fetched for as long as the listing lives. When
+the page moves before the worker is done, it drops the rest of its
+batch and takes the new one.
+*/
+
+void metaRequest(SCROLLDATA * scrollData) {
+//Called before every key. Asks for the rows around the page that have
+//no metadata yet, unless the same rows are asked for already.
+  LISTCHOICE *head;
+  char   *path[META_BATCH];
+  unsigned index[META_BATCH], range[3][2];
+  unsigned i, r, count = 0, top, end, length, used = 0;
+  int     fd, dirFd;
+
+  if(!metaShown || listing1 == NULL)
+    return;
+  head = filter.active ? filter.view : listingHead(listing1);
+  length = scrollData->listLength;
+  if(head == NULL || length == 0)
+    return;
+  //The page first, then the rows below and above it
+  top = scrollData->currentListIndex;
+  end = top + scrollData->displayLimit < length ?
+      top + scrollData->displayLimit : length;
+  range[0][0] = top;
+  range[0][1] = end;
+  range[1][0] = end;
+  range[1][1] = end + META_LOOKAHEAD < length ? end + META_LOOKAHEAD : length;
+  range[2][0] = top > META_LOOKAHEAD ? top - META_LOOKAHEAD : 0;
+  range[2][1] = top;
+  for(r = 0; r < 3; r++)
+    for(i = range[r][0]; i < range[r][1] && count < META_BATCH; i++)
+      if(itemMeta(listing1, head + i)->mode == 0) {
+	index[count] = i;
+	path[count++] = head[i].path;
+      }
+  if(head == meta.postedHead && count == meta.postedCount
+     && memcmp(path, meta.posted, count * sizeof(char *)) == 0)
+    return;
+  meta.postedHead = head;
+  meta.postedCount = count;
+  memcpy(meta.posted, path, count * sizeof(char *));
+  if(count == 0)
+    return;
+
+  dirFd = fcntl(dirStackTop(), F_DUPFD_CLOEXEC, 0);	//The stack may pop it
+  if(dirFd < 0)
+    return;
+  if(scanEventFd < 0)
+    scanEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(!meta.started) {
+    pthread_mutex_init(&meta.lock, NULL);
+    pthread_cond_init(&meta.wake, NULL);
+    if(scanEventFd < 0
+       || pthread_create(&meta.thread, NULL, metaThread, NULL) != 0) {
+      close(dirFd);
+      return;
+    }
+    meta.started = 1;
+  }
+  pthread_mutex_lock(&meta.lock);
+  fd = meta.requested ? meta.request.fd : -1;	//Replaced before it began
+  meta.request.head = head;
+  meta.request.fd = dirFd;
+  meta.request.count = count;
+  for(i = 0; i < count; i++) {
+    meta.request.index[i] = index[i];
+    meta.request.path[i] = path[i];
+    meta.request.offset[i] = used;
+    snprintf(meta.request.names + used, 256, "%s", path[i]);
+    used += strlen(meta.request.names + used) + 1;
+  }
+  __atomic_store_n(&meta.requested, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&meta.busy, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&meta.wake);
+  pthread_mutex_unlock(&meta.lock);
+  if(fd >= 0)
+    close(fd);
+}
+
+static void metaPublish(METARESULT * results, unsigned count) {
+//Hands results to the UI; those it has no room for are asked again.
+  unsigned room;
+  unsigned long long one = 1;
+
+  pthread_mutex_lock(&meta.lock);
+  room = META_BATCH - meta.resultCount;
+  if(count > room)
+    count = room;
+  memcpy(meta.results + meta.resultCount, results,
+	 count * sizeof(METARESULT));
+  __atomic_store_n(&meta.resultCount, meta.resultCount + count,
+		   __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&meta.lock);
+  write(scanEventFd, &one, sizeof(one));
+}
+
+static void metaResolve(unsigned uid) {
+//Remembers the name of uid. Runs on the worker: NSS may be slow.
+  struct passwd pw, *found = NULL;
+  char    buffer[1024];
+  unsigned i;
+
+  pthread_mutex_lock(&meta.lock);
+  for(i = 0; i < meta.ownerCount; i++)
+    if(meta.ownerUid[i] == uid)
+      break;
+  pthread_mutex_unlock(&meta.lock);
+  if(i < meta.ownerCount || meta.ownerCount == META_OWNERS)
+    return;
+  getpwuid_r(uid, &pw, buffer, sizeof(buffer), &found);
+  if(found == NULL)
+    return;
+  pthread_mutex_lock(&meta.lock);
+  if(meta.ownerCount < META_OWNERS) {
+    meta.ownerUid[meta.ownerCount] = uid;
+    snprintf(meta.ownerName[meta.ownerCount], 9, "%s", pw.pw_name);
+    meta.ownerCount++;
+  }
+  pthread_mutex_unlock(&meta.lock);
+}
+
+void   *metaThread(void *arg) {
+  METARESULT results[16];
+  unsigned i, count;
+
+  (void)arg;
+  pthread_mutex_lock(&meta.lock);
+  while(!meta.quit) {
+    if(!meta.requested) {
+      __atomic_store_n(&meta.busy, 0, __ATOMIC_RELEASE);
+      pthread_cond_wait(&meta.wake, &meta.lock);
+      continue;
+    }
+    memcpy(&meta.work, &meta.request, sizeof(METABATCH));
+    __atomic_store_n(&meta.requested, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&meta.lock);
+    __atomic_add_fetch(&meta.batches, 1, __ATOMIC_RELAXED);
+    for(i = count = 0; i < meta.work.count; i++) {
+      if(__atomic_load_n(&meta.requested, __ATOMIC_ACQUIRE))
+	break;			//The page moved: the rest is not wanted
+      results[count].head = meta.work.head;
+      results[count].index = meta.work.index[i];
+      results[count].path = meta.work.path[i];
+      metaStat(meta.work.fd, meta.work.names + meta.work.offset[i],
+	       &results[count]);
+      if(results[count].mode != META_FAILED)
+	metaResolve(results[count].uid);
+      if(++count == 16) {
+	metaPublish(results, count);
+	count = 0;
+      }
+    }
+    if(count > 0)
+      metaPublish(results, count);
+    close(meta.work.fd);
+    pthread_mutex_lock(&meta.lock);
+  }
+  pthread_mutex_unlock(&meta.lock);
+  return NULL;
+}
+
+void metaStat(int dirFd, const char *name, METARESULT * out) {
+//statx() asks only for what the columns show; fstatat() on old kernels.
+  static int noStatx = 0;
+  struct statx stx;
+  struct stat st;
+
+  __atomic_add_fetch(&meta.calls, 1, __ATOMIC_RELAXED);
+  if(!noStatx) {
+    if(syscall(SYS_statx, dirFd, name,
+	       AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+	       STATX_TYPE | STATX_MODE | STATX_UID | STATX_SIZE |
+	       STATX_MTIME, &stx) == 0) {
+      out->size = stx.stx_size;
+      out->mtime = stx.stx_mtime.tv_sec * 1000000000LL +
+	  stx.stx_mtime.tv_nsec;
+      out->mode = stx.stx_mode;
+      out->uid = stx.stx_uid;
+      return;
+    }
+    if(errno != ENOSYS) {
+      out->mode = META_FAILED;
+      return;
+    }
+    noStatx = 1;
+  }
+  if(fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    out->mode = META_FAILED;
+    return;
+  }
+  out->size = st.st_size;
+  out->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  out->mode = st.st_mode;
+  out->uid = st.st_uid;
+}
+
+static void metaStore(LISTCHOICE * record, METARESULT * result) {
+  LISTMETA *slot = itemMetaSlot(listing1, record);
+
+  if(slot == NULL)
+    return;
+  slot->size = result->size;
+  slot->mtime = result->mtime;
+  slot->mode = result->mode;
+  slot->uid = result->uid;
+}
+
+int metaCollect(SCROLLDATA * scrollData) {
+//Stores what the worker found in the records.
+//Returns 1 if a row on display got its columns.
+  METARESULT results[META_BATCH], *result;
+  LISTCHOICE *head, *record;
+  unsigned i, count, top = scrollData->currentListIndex;
+  int     shown = 0;
+
+  if(!meta.started
+     || __atomic_load_n(&meta.resultCount, __ATOMIC_ACQUIRE) == 0)
+    return 0;
+  pthread_mutex_lock(&meta.lock);
+  count = meta.resultCount;
+  memcpy(results, meta.results, count * sizeof(METARESULT));
+  __atomic_store_n(&meta.resultCount, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&meta.lock);
+  if(listing1 == NULL)
+    return 0;
+  head = filter.active ? filter.view : listingHead(listing1);
+  for(i = 0; i < count; i++) {
+    result = &results[i];
+    if(result->head != head || result->index >= scrollData->listLength
+       || head[result->index].path != result->path) {
+      meta.postedCount = 0;	//The list changed meanwhile: ask again
+      continue;
+    }
+    //The view holds copies: the slot goes in the listing's record
+    record = filter.active ?
+	listingHead(listing1) + filterSource(result->index) :
+	head + result->index;
+    if(record->path == result->path) {
+      metaStore(record, result);
+      head[result->index].meta = record->meta;
+    }
+    if(result->index >= top
+       && result->index < top + scrollData->displayLimit)
+      shown = 1;
+  }
+  return shown;
+}
+
+void metaOwner(unsigned uid, char out[9]) {
+//User name of uid, or the number until the worker has looked it up.
+  unsigned i;
+
+  pthread_mutex_lock(&meta.lock);
+  for(i = 0; i < meta.ownerCount; i++)
+    if(meta.ownerUid[i] == uid)
+      break;
+  if(i < meta.ownerCount)
+    memcpy(out, meta.ownerName[i], 9);
+  else
+    snprintf(out, 9, "%u", uid);
+  pthread_mutex_unlock(&meta.lock);
+}
+
+void metaStop(void) {
+  if(!meta.started)
+    return;
+  pthread_mutex_lock(&meta.lock);
+  meta.quit = 1;
+  if(meta.requested)
+    close(meta.request.fd);
+  meta.requested = 0;
+  pthread_cond_signal(&meta.wake);
+  pthread_mutex_unlock(&meta.lock);
+  pthread_join(meta.thread, NULL);
+  meta.started = 0;
+}
+
+int metaWidth(void) {
+//Columns wanted, each with the space before it.
+  if(!metaShown)
+    return 0;
+  return (metaColumns & META_SIZE ? 6 : 0) +
+      (metaColumns & META_MTIME ? 13 : 0) +
+      (metaColumns & META_PERMS ? 11 : 0) +
+      (metaColumns & META_OWNER ? 9 : 0);
+}
+
+void metaFormat(LISTCHOICE * aux, char *out, size_t size) {
+//The columns of one row, blank until the worker has been there.
+  char    field[32] = "", owner[9] = "";
+  const char *types = "?pc?d?b?-?l?s???";
+  const LISTMETA *info = itemMeta(listing1, aux);
+  int     known = info->mode != 0 && info->mode != META_FAILED;
+  size_t  used = 0;
+  time_t  when;
+  struct tm tm;
+  unsigned i;
+
+  out[0] = '\0';
+  if(metaColumns & META_SIZE) {
+    if(known)
+      formatSize(field, info->size < 0 ? 0 : info->size);
+    used += snprintf(out + used, size - used, " %5s", known ? field : "");
+  }
+  if(metaColumns & META_MTIME) {
+    field[0] = '\0';
+    when = info->mtime / 1000000000LL;
+    if(known && localtime_r(&when, &tm) != NULL)
+      strftime(field, sizeof(field), time(NULL) - when < 182 * 86400 ?
+	       "%b %e %H:%M" : "%b %e  %Y", &tm);
+    used += snprintf(out + used, size - used, " %12s", field);
+  }
+  if(metaColumns & META_PERMS) {
+    strcpy(field, "          ");
+    if(info->mode == META_FAILED)
+      field[0] = '?';
+    else if(known) {
+      field[0] = types[(info->mode & S_IFMT) >> 12];
+      for(i = 0; i < 9; i++)
+	field[i + 1] = info->mode & (0400 >> i) ? "rwxrwxrwx"[i] : '-';
+      if(info->mode & S_ISUID)
+	field[3] = info->mode & S_IXUSR ? 's' : 'S';
+      if(info->mode & S_ISGID)
+	field[6] = info->mode & S_IXGRP ? 's' : 'S';
+      if(info->mode & S_ISVTX)
+	field[9] = info->mode & S_IXOTH ? 't' : 'T';
+    }
+    used += snprintf(out + used, size - used, " %s", field);
+  }
+  if(metaColumns & META_OWNER) {
+    if(known)
+      metaOwner(info->uid, owner);
+    snprintf(out + used, size - used, " %-8.8s", owner);
+  }
+}
+
+unsigned parseMetaColumns(const char *text) {
+//"size,mtime,perms,owner" (any of them) or "all". 0 if unknown.
+  static const char *names[] = { "size", "mtime", "perms", "owner" };
+  unsigned columns = 0, i;
+  size_t  length;
+
+  if(strcmp(text, "all") == 0)
+    return META_ALL;
+  while(*text != '\0') {
+    length = strcspn(text, ",");
+    for(i = 0; i < 4; i++)
+      if(strlen(names[i]) == length && strncmp(text, names[i], length) == 0)
+	break;
+    if(i == 4)
+      return 0;
+    columns |= 1u << i;
+    text += length;
+    if(*text == ',')
+      text++;
+  }
+  return columns;
+}
+
+int windowRight(void) {
+//Last column of the list window: names, du column, metadata columns.
+  return 9 + itemWidth + DU_COLUMN + metaWidth();
+}
+
+void drawListWindow(void) {
+//The window of the list, wider while the metadata columns are on.
+  draw_window(9, 7, windowRight() + 1, 19, B_BLACK);	//shadow
+  draw_window(8, 6, windowRight(), 18, B_WHITE);	//window
+}
+
+/* ---------------- */
+/* Directory cache  */
+/* ---------------- */
+/*
+Listings are kept after the user leaves a directory, keyed by the
+directory's (st_dev, st_ino) in a hash table and ordered in an LRU list.
+A listing is reused when the directory's mtime and ctime are unchanged,
+which is what creating, deleting or renaming an entry updates. Least
+recently used listings are dropped when dirCache.budget is exceeded.
+*/
+
+size_t listingBytes(DIRLISTING * listing) {
+  return sizeof(DIRLISTING) + listing->entries.used + listing->names.used +
+      listing->metas.used;
+}
+
+void cacheAccount(DIRLISTING * listing) {
+//Counts what listing holds now in dirCache.bytes, instead of what it
+//held when it was last counted. UI thread only.
+  dirCache.bytes -= listing->accounted;
+  listing->accounted = listingBytes(listing);
+  dirCache.bytes += listing->accounted;
+}
+
+void listingSpill(DIRLISTING * listing, size_t from) {
+//Called by the scanner after every batch with names.used before it.
+//Past nameBudget the names go to a file in spillDir, and each batch
+//leaves memory once it is written; what is on display is read back.
+  ARENA  *names = &listing->names;
+
+  if(nameBudget == 0 || names->used <= nameBudget || listing->unspilled)
+    return;
+  if(names->spill == 0 && arenaSpill(names, spillDir) != 0) {
+    listing->unspilled = 1;	//No room for the file: keep them in RAM
+    return;
+  }
+  arenaTrim(names, from);
+}
+
+const LISTMETA *itemMeta(DIRLISTING * listing, LISTCHOICE * item) {
+//Metadata of an item; all unknown if it was never stat'ed.
+  static const LISTMETA unknown = { -1, 0, 0, 0 };
+
+  if(item->meta == 0)
+    return &unknown;
+  return (LISTMETA *) listing->metas.base + item->meta - 1;
+}
+
+LISTMETA *itemMetaSlot(DIRLISTING * listing, LISTCHOICE * item) {
+//The item's metadata, to be written: a slot is taken the first time.
+//UI thread only. NULL if out of memory.
+  LISTMETA *slot;
+
+  if(item->meta != 0)
+    return (LISTMETA *) listing->metas.base + item->meta - 1;
+  slot = (LISTMETA *) arenaAlloc(&listing->metas, sizeof(LISTMETA));
+  if(slot == NULL)
+    return NULL;
+  slot->size = -1;
+  slot->mtime = 0;
+  slot->mode = 0;
+  slot->uid = 0;
+  item->meta = slot - (LISTMETA *) listing->metas.base + 1;
+  if(listing->accounted != 0)
+    cacheAccount(listing);	//Stat'ed after it was counted
+  return slot;
+}
+
+static unsigned cacheBucket(dev_t dev, ino_t ino) {
+  unsigned long long key = ((unsigned long long)dev << 32) ^ ino;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (unsigned)key & (CACHE_BUCKETS - 1);
+}
+
+DIRLISTING *cacheLookup(struct stat *st) {
+//Constant-time lookup by (dev, ino).
+  DIRLISTING *listing;
+  for(listing = dirCache.buckets[cacheBucket(st->st_dev, st->st_ino)];
+      listing != NULL; listing = listing->hashNext)
+    if(listing->dev == st->st_dev && listing->ino == st->st_ino)
+      return listing;
+  return NULL;
+}
+
+void cacheTouch(DIRLISTING * listing) {
+//Move to the most recently used end.
+  if(dirCache.mru == listing)
+    return;
+  //Unlink from LRU order
+  if(listing->lruBack != NULL)
+    listing->lruBack->lruNext = listing->lruNext;
+  if(listing->lruNext != NULL)
+    listing->lruNext->lruBack = listing->lruBack;
+  if(dirCache.lru == listing)
+    dirCache.lru = listing->lruBack;
+  //Insert at the front
+  listing->lruBack = NULL;
+  listing->lruNext = dirCache.mru;
+  if(dirCache.mru != NULL)
+    dirCache.mru->lruBack = listing;
+  dirCache.mru = listing;
+  if(dirCache.lru == NULL)
+    dirCache.lru = listing;
+}
+
+void cacheInsert(DIRLISTING * listing) {
+//Callers add the listing's bytes once it is filled.
+  unsigned bucket = cacheBucket(listing->dev, listing->ino);
+  listing->hashNext = dirCache.buckets[bucket];
+  dirCache.buckets[bucket] = listing;
+  listing->lruNext = listing->lruBack = NULL;
+  cacheTouch(listing);
+  dirCache.count++;
+}
+
+void cacheUnlink(DIRLISTING * listing) {
+//Remove from the hash table and the LRU list.
+  DIRLISTING **link;
+  link = &dirCache.buckets[cacheBucket(listing->dev, listing->ino)];
+  while(*link != NULL && *link != listing)
+    link = &(*link)->hashNext;
+  if(*link != NULL)
+    *link = listing->hashNext;
+  if(listing->lruBack != NULL)
+    listing->lruBack->lruNext = listing->lruNext;
+  else
+    dirCache.mru = listing->lruNext;
+  if(listing->lruNext != NULL)
+    listing->lruNext->lruBack = listing->lruBack;
+  else
+    dirCache.lru = listing->lruBack;
+  dirCache.count--;
+  dirCache.bytes -= listing->accounted;
+  listing->accounted = 0;
+}
+
+void cacheEvict(void) {
+//Drop least recently used listings until the cache fits its budget.
+//The listing on display is never dropped.
+  DIRLISTING *listing = dirCache.lru, *back;
+  while(listing != NULL && (dirCache.bytes > dirCache.budget
+			    || dirCache.count > CACHE_MAX_LISTINGS)) {
+    back = listing->lruBack;
+    if(listing != dirCache.pinned) {
+      cacheUnlink(listing);
+      freeListing(listing);
+      dirCache.evictions++;
+    }
+    listing = back;
+  }
+}
+
+DIRLISTING *newListing(void) {
+//An empty listing with its arenas reserved. NULL if out of memory.
+  DIRLISTING *listing = (DIRLISTING *) calloc(1, sizeof(DIRLISTING));
+  if(listing == NULL)
+    return NULL;
+  if(arenaInit(&listing->entries, ENTRY_ARENA_SIZE) != 0
+     || arenaInit(&listing->names, NAME_ARENA_SIZE) != 0
+     || arenaInit(&listing->metas, META_ARENA_SIZE) != 0) {
+    freeListing(listing);
+    return NULL;
+  }
+  return listing;
+}
+
+void freeListing(DIRLISTING * listing) {
+  if(listing == NULL)
+    return;
+  arenaFree(&listing->entries);
+  arenaFree(&listing->names);
+  arenaFree(&listing->metas);
+  free(listing);
+}
+
+int listingFresh(DIRLISTING * listing, struct stat *st) {
+//1 if the directory is unchanged since listing was scanned.
+  return listing->mtime.tv_sec == st->st_mtim.tv_sec
+      && listing->mtime.tv_nsec == st->st_mtim.tv_nsec
+      && listing->ctime.tv_sec == st->st_ctim.tv_sec
+      && listing->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+DIRLISTING *openListing(int fd, int *cacheHit) {
+/*
+Returns the listing of the directory open on fd (which it takes over,
+-1 if it could not be opened), from the cache when the directory has
+not changed since it was scanned, else from the index if it has it as
+it is, otherwise (re)scanning it in the background (see activeScan).
+*cacheHit is 1 for the cache, FROM_INDEX for the index. The result is
+pinned until the next call. Returns NULL if out of memory.
+*/
+  DIRLISTING *listing;
+  struct stat st;
+
+  *cacheHit = 0;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    //Unreadable: offer "." and ".." only, as an empty directory
+    if(fd >= 0)
+      close(fd);
+    if(emptyListing.entries.base == NULL
+       && (arenaInit(&emptyListing.entries, ARENA_KEEP) != 0
+	   || arenaInit(&emptyListing.names, ARENA_KEEP) != 0
+	   || arenaInit(&emptyListing.metas, ARENA_KEEP) != 0))
+      return NULL;
+    deleteList(&emptyListing);
+    listFiles(&emptyListing, -1);
+    dirCache.pinned = NULL;
+    return &emptyListing;
+  }
+
+  if(prefetchClaim(&st)) {
+    //Still being read ahead: carry on showing it as it arrives
+    close(fd);
+    dirCache.misses++;
+    listing = activeScan->listing;
+    dirCache.pinned = listing;
+    cacheTouch(listing);
+    return listing;
+  }
+  listing = cacheLookup(&st);
+  if(listing != NULL) {
+    if(listing->prefetched && listingFresh(listing, &st))
+      prefetch.hits++;
+    listing->prefetched = 0;
+    if(listingFresh(listing, &st)) {
+      //Unchanged: no scan at all
+      if(listing->sortMode != sortMode)
+	listingArrange(listing, fd, NULL);
+      close(fd);
+      dirCache.hits++;
+      dirCache.pinned = listing;
+      cacheTouch(listing);
+      *cacheHit = 1;
+      return listing;
+    }
+    //Changed since it was scanned: rescan in place
+    dirCache.stale++;
+    dirCache.bytes -= listing->accounted;
+    listing->accounted = 0;
+    deleteList(listing);
+  } else {
+    listing = newListing();
+    if(listing == NULL) {
+      close(fd);
+      return NULL;
+    }
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    cacheInsert(listing);
+  }
+  listing->mtime = st.st_mtim;
+  listing->ctime = st.st_ctim;
+  dirCache.pinned = listing;
+  cacheTouch(listing);
+  if(indexLoad(listing, &st)) {
+    //On disk as it is: no scan either
+    if(listing->sortMode != sortMode)
+      listingArrange(listing, fd, NULL);
+    close(fd);
+    cacheAccount(listing);
+    cacheEvict();
+    *cacheHit = FROM_INDEX;
+    return listing;
+  }
+  dirCache.misses++;
+  //Read it in the background; finishScan() accounts for its memory
+  if(!startScan(listing, fd)) {
+    cacheAccount(listing);
+    cacheEvict();
+  }
+  return listing;
+}
+
+/* ---------------- */
+/* Persistent index */
+/* ---------------- */
+/*
+With --index FILE, listings outlive the process. The file is a log of
+records, one per directory, each holding the directory's (dev, ino),
+mtime, ctime and path, then its items, their metadata and the name blob
+exactly as the listing had them. It is mapped read-only once, and new
+records are appended with pwrite(); a record is only counted once the
+header's end has moved past it. Opening the file walks the record
+headers to fill a (dev, ino) hash table, nothing more.
+
+A directory whose mtime and ctime still match its record is served by
+copying the record into a listing: there is no scan and no parsing.
+Meanwhile a thread goes over the indexed directories, reads again those
+that changed and drops those that are gone. The same thread does all
+the writing: a directory that is left is copied into a record by the UI
+and queued for it. A record that is replaced is marked dead and its body
+punched out of the file at once, so the disk space comes back as
+directories change; the file itself is rewritten without the dead
+headers once they make up half of it.
+*/
+
+static size_t indexPad(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+static unsigned long long indexChecksum(unsigned long long hash,
+					const void *data, size_t size) {
+//64-bit words, the tail as if it were padded with zeros.
+  const unsigned char *p = (const unsigned char *)data;
+  unsigned long long word;
+  size_t  i;
+
+  for(i = 0; i + 8 <= size; i += 8) {
+    memcpy(&word, p + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  if(i < size) {
+    word = 0;
+    memcpy(&word, p + i, size - i);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+static int indexBounded(INDEXRECORD * record) {
+//1 if the path, the items, the metas and the names fit in the record.
+  unsigned long long body = record->length - sizeof(INDEXRECORD);
+
+  return record->nameBytes <= body
+      && indexPad(record->pathLength + 1)
+      + (unsigned long long)record->count * sizeof(INDEXITEM)
+      + (unsigned long long)record->metaCount * sizeof(LISTMETA)
+      + record->nameBytes <= body;
+}
+
+static unsigned long long indexSum(INDEXRECORD * record) {
+//What the checksum of a record in the map should be.
+  INDEXRECORD header = *record;
+
+  header.checksum = 0;
+  return indexChecksum(indexChecksum(0, &header, sizeof(header)),
+		       record + 1, record->length - sizeof(INDEXRECORD));
+}
+
+static INDEXSLOT *indexSlot(unsigned long long dev, unsigned long long ino,
+			    int insert) {
+//Slot of (dev, ino), NULL if it has none. With insert, an empty slot is
+//handed out for it; NULL if out of memory. Lock held.
+  INDEXSLOT *slots, *slot;
+  unsigned i, size, mask, at;
+
+  if(insert && (dirIndex.slotCount + 1) * 2 > dirIndex.slotSize) {
+    size = dirIndex.slotSize > 0 ? dirIndex.slotSize * 2 : INDEX_SLOTS;
+    slots = (INDEXSLOT *) calloc(size, sizeof(INDEXSLOT));
+    if(slots == NULL)
+      return NULL;
+    dirIndex.slotCount = 0;
+    for(i = 0; i < dirIndex.slotSize; i++) {
+      if(dirIndex.slots[i].offset <= 1)
+	continue;		//Removed ones are not carried over
+      for(at = (dirIndex.slots[i].ino * 0x9e3779b97f4a7c15ULL) >> 40
+	  & (size - 1); slots[at].offset != 0; at = (at + 1) & (size - 1)) ;
+      slots[at] = dirIndex.slots[i];
+      dirIndex.slotCount++;
+    }
+    free(dirIndex.slots);
+    dirIndex.slots = slots;
+    dirIndex.slotSize = size;
+  }
+  if(dirIndex.slotSize == 0)
+    return NULL;
+  mask = dirIndex.slotSize - 1;
+  for(at = (ino * 0x9e3779b97f4a7c15ULL) >> 40 & mask;
+      dirIndex.slots[at].offset != 0; at = (at + 1) & mask) {
+    slot = &dirIndex.slots[at];
+    if(slot->dev == dev && slot->ino == ino && slot->offset > 1)
+      return slot;
+  }
+  if(!insert)
+    return NULL;
+  slot = &dirIndex.slots[at];
+  slot->dev = dev;
+  slot->ino = ino;
+  dirIndex.slotCount++;
+  return slot;
+}
+
+static void indexSync(void) {
+//Writes the header: records past dirIndex.end are not taken as written.
+  INDEXHEADER header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.headerSize = sizeof(INDEXHEADER);
+  header.end = dirIndex.end;
+  header.live = dirIndex.live;
+  pwrite(dirIndex.fd, &header, sizeof(header), 0);
+}
+
+static void indexRetire(INDEXSLOT * slot) {
+//The record of slot is replaced or its directory gone: marked dead, and
+//everything but its header given back to the filesystem. Lock held.
+  INDEXRECORD *record = (INDEXRECORD *) (dirIndex.map + slot->offset);
+  unsigned dead = INDEX_DEAD;
+
+  pwrite(dirIndex.fd, &dead, sizeof(dead), slot->offset);
+  if(record->length > sizeof(INDEXRECORD))
+    fallocate(dirIndex.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	      slot->offset + sizeof(INDEXRECORD),
+	      record->length - sizeof(INDEXRECORD));
+  dirIndex.live -= record->length;
+  slot->offset = 1;
+}
+
+static int indexMap(int fd) {
+//Maps the index open on fd and fills the slots from its record headers.
+//An empty file, or an index of another version, is started over; any
+//other file is left alone.
+  INDEXHEADER *header;
+  INDEXRECORD *record;
+  INDEXSLOT *slot;
+  unsigned long long at;
+  struct stat st;
+
+  if(fstat(fd, &st) != 0)
+    return -1;
+  dirIndex.fd = fd;
+  dirIndex.map = (char *)mmap(NULL, INDEX_MAP_SIZE, PROT_READ, MAP_SHARED,
+			      fd, 0);
+  if(dirIndex.map == MAP_FAILED) {
+    dirIndex.map = NULL;
+    return -1;
+  }
+  header = (INDEXHEADER *) dirIndex.map;
+  if(st.st_size > 0 && ((size_t)st.st_size < sizeof(INDEXHEADER)
+			|| memcmp(header->magic, INDEX_MAGIC,
+				  sizeof(header->magic)) != 0))
+    return -1;			//Not ours
+  if(st.st_size == 0 || header->version != INDEX_VERSION
+     || header->headerSize != sizeof(INDEXHEADER)) {
+    if(!dirIndex.writable || ftruncate(fd, 0) != 0)
+      return -1;
+    dirIndex.end = sizeof(INDEXHEADER);
+    dirIndex.live = 0;
+    indexSync();
+    return 0;
+  }
+  //Walk the headers; a later record of a directory replaces an earlier
+  dirIndex.end = header->end;
+  if(dirIndex.end > (unsigned long long)st.st_size)
+    dirIndex.end = st.st_size;	//Cut short: keep what is whole
+  dirIndex.live = 0;
+  for(at = sizeof(INDEXHEADER); at + sizeof(INDEXRECORD) <= dirIndex.end;
+      at += record->length) {
+    record = (INDEXRECORD *) (dirIndex.map + at);
+    if((record->magic != INDEX_LIVE && record->magic != INDEX_DEAD)
+       || record->length < sizeof(INDEXRECORD) || record->length % 8 != 0
+       || record->length > dirIndex.end - at)
+      break;			//Torn: what follows is lost
+    if(record->magic == INDEX_DEAD)
+      continue;
+    slot = indexSlot(record->dev, record->ino, 1);
+    if(slot == NULL)
+      return -1;
+    if(slot->offset > 1 && dirIndex.writable)
+      indexRetire(slot);
+    else if(slot->offset > 1)
+      dirIndex.live -= ((INDEXRECORD *) (dirIndex.map + slot->offset))->
+	  length;
+    slot->offset = at;
+    dirIndex.live += record->length;
+  }
+  dirIndex.end = at;
+  if(dirIndex.writable)
+    indexSync();
+  return 0;
+}
+
+int indexOpen(const char *path) {
+/*
+Opens (or creates) the index file at path. If another process has it
+locked, it is only read. Returns -1 if it cannot be used.
+*/
+  int     fd;
+
+  dirIndex.path = strdup(path);
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  dirIndex.writable = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+  if(fd < 0)
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0 || dirIndex.path == NULL)
+    return -1;
+  if(pthread_mutex_init(&dirIndex.lock, NULL) != 0
+     || pthread_mutex_init(&dirIndex.queueLock, NULL) != 0
+     || pthread_cond_init(&dirIndex.queued, NULL) != 0
+     || indexMap(fd) != 0) {
+    close(fd);
+    dirIndex.fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static INDEXRECORD *indexFind(struct stat *st) {
+//Live record of the directory, if it is unchanged since. Lock held.
+  INDEXSLOT *slot = indexSlot(st->st_dev, st->st_ino, 0);
+  INDEXRECORD *record;
+
+  if(slot == NULL)
+    return NULL;
+  record = (INDEXRECORD *) (dirIndex.map + slot->offset);
+  if(record->mtime != st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec
+     || record->ctime != st->st_ctim.tv_sec * 1000000000LL
+     + st->st_ctim.tv_nsec)
+    return NULL;
+  return record;
+}
+
+int indexFresh(struct stat *st) {
+//1 if the index can serve the directory as it is now.
+  int     fresh;
+
+  if(dirIndex.fd < 0)
+    return 0;
+  pthread_mutex_lock(&dirIndex.lock);
+  fresh = indexFind(st) != NULL;
+  pthread_mutex_unlock(&dirIndex.lock);
+  return fresh;
+}
+
+int indexLoad(DIRLISTING * listing, struct stat *st) {
+/*
+Fills an empty listing from the index if it holds the directory as it is
+now. Returns 1 if it did. The items keep the order they were stored in
+(listing->sortMode says which), and the names go in by batches so that
+big ones spill like a scan's. The metadata comes along for the sort
+orders; the columns stat the rows they show again.
+*/
+  INDEXRECORD *record;
+  INDEXITEM *items = NULL;
+  LISTMETA *metas = NULL, *slots = NULL;
+  LISTCHOICE *head = NULL;
+  const char *names = NULL;
+  size_t  done, chunk, from;
+  unsigned i;
+  int     ok;
+
+  if(dirIndex.fd < 0)
+    return 0;
+  pthread_mutex_lock(&dirIndex.lock);
+  record = indexFind(st);
+  ok = record != NULL && record->count >= 2 && record->nameBytes > 0
+      && indexBounded(record) && indexSum(record) == record->checksum;
+  if(ok) {
+    items = (INDEXITEM *) ((char *)(record + 1)
+			   + indexPad(record->pathLength + 1));
+    metas = (LISTMETA *) (items + record->count);
+    names = (const char *)(metas + record->metaCount);
+    ok = names[record->nameBytes - 1] == '\0';
+  }
+  for(i = 0; ok && i < record->count; i++)
+    ok = items[i].name < record->nameBytes
+	&& items[i].meta <= record->metaCount;
+  if(record != NULL && !ok && dirIndex.writable) {
+    //Damaged: dropped, so that the directory is stored again
+    indexRetire(indexSlot(st->st_dev, st->st_ino, 0));
+    indexSync();
+  }
+  if(ok) {
+    head = (LISTCHOICE *) arenaAlloc(&listing->entries, (size_t)
+				     record->count * sizeof(LISTCHOICE));
+    if(record->metaCount > 0)
+      slots = (LISTMETA *) arenaAlloc(&listing->metas, (size_t)
+				      record->metaCount * sizeof(LISTMETA));
+    ok = head != NULL && (record->metaCount == 0 || slots != NULL);
+  }
+  for(done = 0; ok && done < record->nameBytes; done += chunk) {
+    chunk = record->nameBytes - done;
+    if(chunk > INDEX_COPY_CHUNK)
+      chunk = INDEX_COPY_CHUNK;
+    from = listing->names.used;
+    ok = arenaAppend(&listing->names, names + done, chunk) != NULL;
+    listingSpill(listing, from);
+  }
+  if(!ok) {
+    pthread_mutex_unlock(&dirIndex.lock);
+    deleteList(listing);
+    return 0;
+  }
+  for(i = 0; i < record->metaCount; i++) {
+    slots[i] = metas[i];
+    slots[i].mode = 0;		//Shown again only once stat'ed again
+  }
+  for(i = 0; i < record->count; i++) {
+    head[i].index = i;
+    head[i].isDirectory = items[i].isDirectory;
+    head[i].meta = items[i].meta;
+    head[i].path = listing->names.base + items[i].name;
+  }
+  listing->sortMode = record->sortMode;
+  dirIndex.hits++;
+  pthread_mutex_unlock(&dirIndex.lock);
+  __atomic_store_n(&listing->length, record->count, __ATOMIC_RELEASE);
+  return 1;
+}
+
+INDEXSTORE *indexBuild(DIRLISTING * listing, const char *path, int order) {
+/*
+Copies listing, the directory at path with its items in order, into a
+record as it goes in the file, behind a queue node. The listing may
+change or go once it returns. NULL if it cannot be stored.
+*/
+  INDEXSTORE *store;
+  INDEXRECORD *record;
+  INDEXITEM *items;
+  LISTCHOICE *head = listingHead(listing);
+  unsigned i, count = listingLength(listing);
+  size_t  pathBytes = indexPad(strlen(path) + 1), metaBytes, total;
+  char   *at;
+
+  if(head == NULL || listing->names.used >= 0xFFFFFFFFu)
+    return NULL;
+  metaBytes = listing->metas.used / sizeof(LISTMETA) * sizeof(LISTMETA);
+  total = sizeof(INDEXRECORD) + pathBytes + count * sizeof(INDEXITEM)
+      + metaBytes + indexPad(listing->names.used);
+  //Zeroed: the padding goes in the file too
+  store = (INDEXSTORE *) calloc(1, sizeof(INDEXSTORE) + total);
+  if(store == NULL)
+    return NULL;
+  record = (INDEXRECORD *) (store + 1);
+  at = (char *)(record + 1);
+  strcpy(at, path);
+  items = (INDEXITEM *) (at + pathBytes);
+  for(i = 0; i < count; i++) {
+    if(head[i].path < listing->names.base
+       || head[i].path >= listing->names.base + listing->names.used) {
+      free(store);
+      return NULL;		//Not from this listing's name blob
+    }
+    items[i].name = head[i].path - listing->names.base;
+    items[i].isDirectory = head[i].isDirectory;
+    items[i].meta = head[i].meta;
+  }
+  at = (char *)(items + count);
+  if(metaBytes > 0)
+    memcpy(at, listing->metas.base, metaBytes);
+  memcpy(at + metaBytes, listing->names.base, listing->names.used);
+  record->magic = INDEX_LIVE;
+  record->count = count;
+  record->length = total;
+  record->dev = listing->dev;
+  record->ino = listing->ino;
+  record->mtime = listing->mtime.tv_sec * 1000000000LL
+      + listing->mtime.tv_nsec;
+  record->ctime = listing->ctime.tv_sec * 1000000000LL
+      + listing->ctime.tv_nsec;
+  record->nameBytes = listing->names.used;
+  record->metaCount = metaBytes / sizeof(LISTMETA);
+  record->pathLength = strlen(path);
+  record->sortMode = order;
+  record->checksum = indexSum(record);
+  return store;
+}
+
+static int indexAppend(INDEXRECORD * record) {
+/*
+Appends record, unless the index has its directory as it was then
+already, and retires the record it replaces. May rewrite the file.
+Lock held. Returns -1 if nothing was written.
+*/
+  INDEXSLOT *slot;
+  INDEXRECORD *stored;
+  size_t  done;
+  ssize_t n;
+
+  if(!dirIndex.writable || dirIndex.end + record->length > INDEX_MAP_SIZE)
+    return -1;
+  slot = indexSlot(record->dev, record->ino, 0);
+  if(slot != NULL) {
+    stored = (INDEXRECORD *) (dirIndex.map + slot->offset);
+    if(stored->mtime == record->mtime && stored->ctime == record->ctime)
+      return 0;
+  }
+  for(done = 0; done < record->length; done += n) {
+    n = pwrite(dirIndex.fd, (char *)record + done, record->length - done,
+	       dirIndex.end + done);
+    if(n <= 0)
+      return -1;
+  }
+  slot = indexSlot(record->dev, record->ino, 1);
+  if(slot == NULL)
+    return -1;
+  if(slot->offset > 1)
+    indexRetire(slot);
+  slot->offset = dirIndex.end;
+  dirIndex.end += record->length;
+  dirIndex.live += record->length;
+  dirIndex.stores++;
+  indexSync();
+  if(dirIndex.end - dirIndex.live > INDEX_COMPACT_MIN
+     && dirIndex.end - dirIndex.live > dirIndex.live)
+    indexCompact();
+  return 0;
+}
+
+int indexWrite(DIRLISTING * listing, const char *path, int order) {
+//Appends a record of listing at once. Takes the lock. Index thread only.
+//Returns -1 if nothing was written.
+  INDEXSTORE *store = indexBuild(listing, path, order);
+  int     result;
+
+  if(store == NULL)
+    return -1;
+  pthread_mutex_lock(&dirIndex.lock);
+  result = indexAppend((INDEXRECORD *) (store + 1));
+  pthread_mutex_unlock(&dirIndex.lock);
+  free(store);
+  return result;
+}
+
+void indexStore(DIRLISTING * listing, const char *path) {
+/*
+Called when the directory on display is left: a copy of its listing is
+queued for the index thread, unless the index has it as it is already.
+The writing, and the rewrite of the file it may lead to, are left to
+that thread.
+*/
+  INDEXSTORE *store;
+  struct stat st;
+  int     fresh = 0;
+
+  if(dirIndex.fd < 0 || !dirIndex.writable || listing == NULL
+     || listing == &emptyListing || listing->mtime.tv_sec == 0
+     || (activeScan != NULL && activeScan->listing == listing))
+    return;			//Incomplete or still being read
+  st.st_dev = listing->dev;
+  st.st_ino = listing->ino;
+  st.st_mtim = listing->mtime;
+  st.st_ctim = listing->ctime;
+  //Only a look: the thread may hold the lock through a long write. If
+  //it does, it checks again before appending.
+  if(pthread_mutex_trylock(&dirIndex.lock) == 0) {
+    fresh = indexFind(&st) != NULL;
+    pthread_mutex_unlock(&dirIndex.lock);
+  }
+  indexRevalidate();
+  if(fresh || dirIndex.job == NULL
+     || dirIndex.queueBytes > INDEX_QUEUE_MAX)
+    return;
+  store = indexBuild(listing, path, listing->sortMode);
+  if(store == NULL)
+    return;
+  pthread_mutex_lock(&dirIndex.queueLock);
+  if(dirIndex.queueLast != NULL)
+    dirIndex.queueLast->next = store;
+  else
+    dirIndex.queue = store;
+  dirIndex.queueLast = store;
+  dirIndex.queueBytes += ((INDEXRECORD *) (store + 1))->length;
+  pthread_cond_signal(&dirIndex.queued);
+  pthread_mutex_unlock(&dirIndex.queueLock);
+}
+
+void indexCompact(void) {
+/*
+Rewrites the index with its live records only, next to it, and renames
+it over the old one. The slots then point into the new file. Lock held.
+*/
+  INDEXRECORD *record;
+  char   *newPath, *map;
+  unsigned long long end = sizeof(INDEXHEADER), offset, length;
+  unsigned i;
+  ssize_t n;
+  int     fd, failed = 0;
+
+  newPath = (char *)malloc(strlen(dirIndex.path) + 5);
+  if(newPath == NULL)
+    return;
+  sprintf(newPath, "%s.new", dirIndex.path);
+  fd = open(newPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    if(fd >= 0)
+      close(fd);
+    free(newPath);
+    return;
+  }
+  for(i = 0; i < dirIndex.slotSize && !failed; i++) {
+    if(dirIndex.slots[i].offset <= 1)
+      continue;
+    record = (INDEXRECORD *) (dirIndex.map + dirIndex.slots[i].offset);
+    for(length = 0; length < record->length && !failed; length += n) {
+      n = pwrite(fd, (char *)record + length, record->length - length,
+		 end + length);
+      failed = n <= 0;
+    }
+    end += record->length;
+  }
+  map = failed ? MAP_FAILED :
+      (char *)mmap(NULL, INDEX_MAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED || rename(newPath, dirIndex.path) != 0) {
+    if(map != MAP_FAILED)
+      munmap(map, INDEX_MAP_SIZE);
+    close(fd);
+    unlink(newPath);
+    free(newPath);
+    return;
+  }
+  //Same walk again: each live record now sits where it was copied to
+  for(i = 0, offset = sizeof(INDEXHEADER); i < dirIndex.slotSize; i++) {
+    if(dirIndex.slots[i].offset <= 1)
+      continue;
+    length = ((INDEXRECORD *) (dirIndex.map + dirIndex.slots[i].offset))->
+	length;
+    dirIndex.slots[i].offset = offset;
+    offset += length;
+  }
+  munmap(dirIndex.map, INDEX_MAP_SIZE);
+  close(dirIndex.fd);
+  dirIndex.map = map;
+  dirIndex.fd = fd;
+  dirIndex.end = end;
+  dirIndex.live = end - sizeof(INDEXHEADER);
+  dirIndex.compactions++;
+  indexSync();
+  free(newPath);
+}
+
+static void indexDrain(void) {
+//Appends the records queued by indexStore(). Index thread only.
+  INDEXSTORE *store;
+
+  for(;;) {
+    pthread_mutex_lock(&dirIndex.queueLock);
+    store = dirIndex.queue;
+    if(store != NULL) {
+      dirIndex.queue = store->next;
+      if(dirIndex.queue == NULL)
+	dirIndex.queueLast = NULL;
+      dirIndex.queueBytes -= ((INDEXRECORD *) (store + 1))->length;
+    }
+    pthread_mutex_unlock(&dirIndex.queueLock);
+    if(store == NULL)
+      return;
+    pthread_mutex_lock(&dirIndex.lock);
+    indexAppend((INDEXRECORD *) (store + 1));
+    pthread_mutex_unlock(&dirIndex.lock);
+    free(store);
+  }
+}
+
+void   *indexThread(void *arg) {
+/*
+Goes over the indexed directories once, by the path they were stored
+with. Those that changed are read again (in directory order, sorted
+when they are opened) and those that are gone or are now another
+directory lose their record. Meanwhile and afterwards it appends the
+listings the UI queues. When its job is cancelled it writes those that
+are still queued and stops.
+*/
+  SCANJOB *job = (SCANJOB *) arg;
+  INDEXRECORD *record;
+  INDEXSLOT *slot;
+  DIRLISTING *listing;
+  struct stat st;
+  unsigned long long dev, ino, offset;
+  long long mtime, ctime;
+  char   *path = NULL, *grown;
+  size_t  pathSize = 0;
+  unsigned i;
+  int     fd, stop;
+
+  for(i = 0; !__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE); i++) {
+    indexDrain();
+    pthread_mutex_lock(&dirIndex.lock);
+    if(i >= dirIndex.slotSize) {
+      pthread_mutex_unlock(&dirIndex.lock);
+      break;
+    }
+    offset = dirIndex.slots[i].offset;
+    if(offset <= 1) {
+      pthread_mutex_unlock(&dirIndex.lock);
+      continue;
+    }
+    record = (INDEXRECORD *) (dirIndex.map + offset);
+    if(!indexBounded(record)) {
+      indexRetire(&dirIndex.slots[i]);	//Damaged
+      indexSync();
+      pthread_mutex_unlock(&dirIndex.lock);
+      continue;
+    }
+    if(record->pathLength + 1 > pathSize) {
+      grown = (char *)realloc(path, record->pathLength + 1);
+      if(grown == NULL) {
+	pthread_mutex_unlock(&dirIndex.lock);
+	continue;
+      }
+      path = grown;
+      pathSize = record->pathLength + 1;
+    }
+    memcpy(path, record + 1, record->pathLength);
+    path[record->pathLength] = '\0';
+    dev = record->dev;
+    ino = record->ino;
+    mtime = record->mtime;
+    ctime = record->ctime;
+    pthread_mutex_unlock(&dirIndex.lock);
+    __atomic_add_fetch(&dirIndex.checked, 1, __ATOMIC_RELAXED);
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_dev != dev
+       || st.st_ino != ino) {
+      if(fd >= 0)
+	close(fd);
+      if(fd < 0 && errno != ENOENT && errno != ENOTDIR)
+	continue;		//Unreadable for now, not gone
+      pthread_mutex_lock(&dirIndex.lock);
+      slot = indexSlot(dev, ino, 0);
+      if(dirIndex.writable && slot != NULL && slot->offset == offset) {
+	indexRetire(slot);
+	dirIndex.dropped++;
+	indexSync();
+      }
+      pthread_mutex_unlock(&dirIndex.lock);
+      continue;
+    }
+    if(st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == mtime
+       && st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec == ctime) {
+      close(fd);		//Unchanged
+      continue;
+    }
+    listing = newListing();
+    if(listing == NULL) {
+      close(fd);
+      continue;
+    }
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->ctime = st.st_ctim;
+    addDots(listing);
+    job->listing = listing;
+    job->fd = fd;
+    scanEntries(listing, fd, job->buffer, &job->stats, job);
+    if(!__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE)
+       && indexWrite(listing, path, INDEX_UNSORTED) == 0)
+      __atomic_add_fetch(&dirIndex.refreshed, 1, __ATOMIC_RELAXED);
+    close(fd);
+    freeListing(listing);
+  }
+  free(path);
+  do {
+    indexDrain();
+    pthread_mutex_lock(&dirIndex.queueLock);
+    while(dirIndex.queue == NULL
+	  && !__atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE))
+      pthread_cond_wait(&dirIndex.queued, &dirIndex.queueLock);
+    stop = dirIndex.queue == NULL;	//Cancelled, and nothing is left
+    pthread_mutex_unlock(&dirIndex.queueLock);
+  } while(!stop);
+  return NULL;
+}
+
+void indexRevalidate(void) {
+//Starts the revalidation thread, once, when the first listing is
+//complete: it would only read the same directory a second time.
+  SCANJOB *job;
+
+  if(dirIndex.fd < 0 || !dirIndex.writable || dirIndex.started)
+    return;
+  dirIndex.started = 1;
+  job = (SCANJOB *) calloc(1, sizeof(SCANJOB));
+  if(job == NULL)
+    return;
+  if(pthread_create(&dirIndex.thread, NULL, indexThread, job) != 0) {
+    free(job);
+    return;
+  }
+  dirIndex.job = job;
+}
 
-  //Save calculations for SCROLL and store DATA
-  scrollData->displayLimit = displayLimit;
-  scrollLimit = list_length - scrollData->displayLimit;	//Careful with negative integers
+void indexClose(void) {
+//Stops the revalidation and closes the file.
+  if(dirIndex.job != NULL) {
+    pthread_mutex_lock(&dirIndex.queueLock);
+    __atomic_store_n(&dirIndex.job->cancel, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&dirIndex.queued);
+    pthread_mutex_unlock(&dirIndex.queueLock);
+    pthread_join(dirIndex.thread, NULL);	//After the queued records
+    free(dirIndex.job);
+    dirIndex.job = NULL;
+  }
+  if(dirIndex.fd < 0)
+    return;
+  munmap(dirIndex.map, INDEX_MAP_SIZE);
+  close(dirIndex.fd);
+  dirIndex.fd = -1;
+  free(dirIndex.slots);
+  free(dirIndex.path);
+}
 
-  if(scrollLimit < 0)
-    scrollData->displayLimit = list_length;	//Failsafe for overboard values
+/* ---------------- */
+/* Directory watch  */
+/* ---------------- */
+/*
+The directory on display is watched with inotify. Creations, deletions
+and renames are applied to its listing as single inserts and removes, so
+the listing (and its cache entry) stays current without a rescan.
+*/
 
-  scrollData->scrollLimit = scrollLimit;
-  scrollData->listLength = list_length;
-  scrollData->wherex = whereX;
-  scrollData->wherey = whereY;
-  scrollData->selector = whereY;
-  scrollData->backColor0 = bColor0;
-  scrollData->backColor1 = bColor1;
-  scrollData->foreColor0 = fColor0;
-  scrollData->foreColor1 = fColor1;
+void watchDirectory(DIRLISTING * listing) {
+//Moves the watch to the directory on top of dirStack. Call before
+//scanning it, so that nothing done during the scan is missed;
+//duplicates are ignored when applied.
+  char    proc[32];
 
-  //Check whether we have to activate scroll or not 
-  //and if we are within bounds. [1,list_length)
+  if(dirWatch.inotifyFd < 0)
+    dirWatch.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(dirWatch.inotifyFd < 0)
+    return;
+  if(dirWatch.wd >= 0)
+    inotify_rm_watch(dirWatch.inotifyFd, dirWatch.wd);
+  if(dirWatch.dirFd >= 0)
+    close(dirWatch.dirFd);
+  watchForgetAll();
+  //inotify wants a path: the fd's own, so nothing is resolved again
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirStackTop());
+  dirWatch.wd = inotify_add_watch(dirWatch.inotifyFd, proc, WATCH_EVENTS);
+  if(dirWatch.wd < 0)
+    dirWatch.wd = inotify_add_watch(dirWatch.inotifyFd, dirStack.path,
+				    WATCH_EVENTS);
+  dirWatch.dirFd = dirOpenTop();
+  dirWatch.listing = listing;
+}
 
-  if(list_length > scrollData->displayLimit && scrollLimit > 0
-     && displayLimit > 0) {
-    //Scroll is possible  
+int watchFind(DIRLISTING * listing, const char *name, unsigned itemType) {
+/*
+Index of the item called name in the watched listing, -1 if it is not
+listed: a binary search in the listing's order. For the orders by size
+and mtime the search needs the item's metadata slot, which watchKnown()
+finds by name.
+*/
+  LISTCHOICE *head = listingHead(listing), probe, *known;
+  unsigned low, high, middle, dirs = listingDirs(listing);
+  size_t  mark = scratchArena.used;
+  const char *key = NULL;
 
-    scrollData->scrollActive = SCROLL_ACTIVE;
-    aux = head;
+  probe.path = (char *)name;
+  probe.isDirectory = itemType == DIRECTORY;
+  probe.meta = 0;
+  if(listing->sortMode == SORT_SIZE || listing->sortMode == SORT_MTIME) {
+    if((known = watchKnown(listing, name)) == NULL)
+      return -1;
+    probe = *known;
+  } else if(listing->sortMode == SORT_NATURAL)
+    key = naturalKey(&scratchArena, name);
+  else if(listing->sortMode == SORT_EXT)
+    key = extensionKey(&scratchArena, name);
+  low = probe.isDirectory == DIRECTORY ? 2 : dirs;
+  high = probe.isDirectory == DIRECTORY ? dirs : listingLength(listing);
+  while(low < high) {
+    middle = low + (high - low) / 2;
+    if(compareItems(listing, head + middle, &probe, key) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  scratchArena.used = mark;
+  if(low < listingLength(listing) && strcmp(head[low].path, name) == 0)
+    return low;
+  return -1;
+}
+
+LISTCHOICE *watchKnown(DIRLISTING * listing, const char *name) {
+//A copy of the record of the item called name, NULL if none. The table
+//is made from the listing the first time it is needed.
+  LISTCHOICE *head = listingHead(listing);
+  unsigned i, slot, length = listingLength(listing), size = 64;
 
-    currentListIndex = 0;	//We listBox1 the scroll at the top index.
-    scrollData->currentListIndex = currentListIndex;
+  if(dirWatch.known == NULL) {
+    while(size < length * 2)
+      size *= 2;
+    dirWatch.known = (LISTCHOICE *) calloc(size, sizeof(LISTCHOICE));
+    if(dirWatch.known == NULL)
+      return NULL;
+    dirWatch.knownMask = size - 1;
+    dirWatch.knownCount = 0;
+    for(i = 2; i < length; i++)
+      watchRemember(head + i);
+  }
+  for(slot = nameHash(name) & dirWatch.knownMask;
+      dirWatch.known[slot].path != NULL;
+      slot = (slot + 1) & dirWatch.knownMask)
+    if(strcmp(dirWatch.known[slot].path, name) == 0)
+      return dirWatch.known + slot;
+  return NULL;
+}
 
-    //Scroll loop animation. Finish with ENTER.
-    do {
-      currentListIndex = scrollData->currentListIndex;
-      loadlist(aux, scrollData, currentListIndex);
-      gotoIndex(&aux, scrollData, currentListIndex);
-      ch = selectorMenu(aux, scrollData);
-    } while(ch != K_ENTER);
+int watchRemember(LISTCHOICE * item) {
+//Adds item to the table, if there is one. Past 3/4 full it is dropped,
+//to be made again at the next lookup. Returns -1 if it was.
+  unsigned slot;
 
-  } else {
-    //Scroll is not possible.
-    //Display all the elements and create selector.
-    scrollData->scrollActive = SCROLL_INACTIVE;
-    scrollData->currentListIndex = 0;
-    scrollData->displayLimit = list_length;	//Default to list_length
-    loadlist(head, scrollData, 0);
-    ch = selectorMenu(head, scrollData);
+  if(dirWatch.known == NULL)
+    return 0;
+  if(dirWatch.knownCount + 1 > dirWatch.knownMask / 4 * 3) {
+    watchForgetAll();
+    return -1;
   }
-  return ch;
+  for(slot = nameHash(item->path) & dirWatch.knownMask;
+      dirWatch.known[slot].path != NULL;
+      slot = (slot + 1) & dirWatch.knownMask) ;
+  dirWatch.known[slot] = *item;
+  dirWatch.knownCount++;
+  return 0;
+}
+
+void watchForget(const char *name) {
+//Takes name out of the table. The records after it in its run move
+//back, so that no lookup stops short of them.
+  LISTCHOICE *known = dirWatch.known;
+  unsigned mask = dirWatch.knownMask, slot, next, home;
+
+  if(known == NULL)
+    return;
+  for(slot = nameHash(name) & mask; known[slot].path != NULL;
+      slot = (slot + 1) & mask)
+    if(strcmp(known[slot].path, name) == 0)
+      break;
+  if(known[slot].path == NULL)
+    return;
+  for(next = (slot + 1) & mask; known[next].path != NULL;
+      next = (next + 1) & mask) {
+    home = nameHash(known[next].path) & mask;
+    //Stays if its home is cyclically in (slot, next]
+    if(slot <= next ? (slot < home && home <= next) :
+       (slot < home || home <= next))
+      continue;
+    known[slot] = known[next];
+    slot = next;
+  }
+  known[slot].path = NULL;
+  dirWatch.knownCount--;
+}
+
+void watchForgetAll(void) {
+//Drops the table: the listing changed as a whole, or left the orders
+//that need it.
+  free(dirWatch.known);
+  dirWatch.known = NULL;
+  dirWatch.knownCount = 0;
+}
+
+int applyDirEvents(SCROLLDATA * scrollData) {
+/*
+Reads the queued inotify events and applies those of the open directory
+to its listing, one item at a time: added and changed items are put in
+their place in its order, so it is never sorted again as a whole.
+scrollData->itemIndex follows the selected item. Returns the number of
+changes made to the listing.
+*/
+  char    buffer[EVENT_BUFFER_SIZE]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  DIRLISTING *listing = dirWatch.listing;
+  LISTMETA *info;
+  struct stat st;
+  ssize_t n, pos;
+  int     index, changes = 0, touched = 0, overflow = 0, stamped = 0;
+  int     fd;
+  unsigned itemType, selected = scrollData->itemIndex;
+
+  if(listing != NULL && listing != &emptyListing) {
+    dirCache.bytes -= listing->accounted;
+    listing->accounted = 0;
+  }
+  if(listing == NULL || (listing->sortMode != SORT_SIZE
+			 && listing->sortMode != SORT_MTIME))
+    watchForgetAll();		//Names are enough to find items
+  //Stamped before the events are read: a change that lands after the
+  //last read() leaves the directory newer than the listing, so it is
+  //not taken for fresh if the watch moves before the event is applied
+  if(dirWatch.dirFd >= 0 && fstat(dirWatch.dirFd, &st) == 0)
+    stamped = 1;
+  while((n = read(dirWatch.inotifyFd, buffer, sizeof(buffer))) > 0) {
+    for(pos = 0; pos < n;
+	pos += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *)(buffer + pos);
+      if(event->mask & IN_Q_OVERFLOW)
+	overflow = 1;
+      //Skip events of directories left behind
+      if(listing == NULL || event->wd != dirWatch.wd || event->len == 0)
+	continue;
+      dirWatch.events++;
+      itemType = (event->mask & IN_ISDIR) ? DIRECTORY : FILEITEM;
+      if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	index = watchFind(listing, event->name, itemType);
+	if(index < 2)
+	  continue;		//Not listed (or "." / "..")
+	watchForget(event->name);
+	listingRemove(listing, index);
+	if((unsigned)index < selected)
+	  selected--;
+	changes++;
+      }
+      if(event->mask & (IN_ATTRIB | IN_CLOSE_WRITE)) {
+	//Metadata went stale: fetched again when shown, and at once for
+	//the orders that depend on it
+	index = watchFind(listing, event->name, itemType);
+	if(index < 2)
+	  continue;
+	if(listingHead(listing)[index].meta == 0)
+	  continue;
+	info = itemMetaSlot(listing, listingHead(listing) + index);
+	info->mode = 0;
+	info->size = -1;
+	if(listing->sortMode == SORT_SIZE || listing->sortMode == SORT_MTIME)
+	  listingSettle(listing, index, dirWatch.dirFd, &selected);
+	touched++;
+      }
+      if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+	if(itemType != DIRECTORY)
+	  itemType = resolveType(dirWatch.dirFd, event->name, DT_UNKNOWN);
+	if(itemType != DIRECTORY && itemType != FILEITEM)
+	  continue;
+	if(watchFind(listing, event->name, itemType) >= 0)
+	  continue;		//Already picked up by the scan
+	//At the end of its group, then moved to its place
+	index = itemType == DIRECTORY ? listingDirs(listing) :
+	    listingLength(listing);
+	if(listingInsert(listing, index, event->name, itemType) != 0)
+	  continue;
+	if((unsigned)index <= selected)
+	  selected++;
+	index = listingSettle(listing, index, dirWatch.dirFd, &selected);
+	watchRemember(listingHead(listing) + index);
+	changes++;
+      }
+    }
+  }
+  if(overflow && listing != NULL && activeScan == NULL
+     && (fd = fcntl(dirWatch.dirFd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+    //Events were lost: read it again in the background, as when it is
+    //entered. Events wait until the scanner is done.
+    watchForgetAll();
+    deleteList(listing);
+    lseek(fd, 0, SEEK_SET);
+    startScan(listing, fd);
+    showScanStatus(0);
+    dirWatch.rescans++;
+    changes++;
+  }
+  if(listing != NULL && listing != &emptyListing) {
+    //The listing is current again: make the cache agree
+    if(stamped) {
+      listing->mtime = st.st_mtim;
+      listing->ctime = st.st_ctim;
+    }
+    if(activeScan == NULL)
+      cacheAccount(listing);	//Else finishScan() does
+  }
+  if(listing != NULL && selected >= listingLength(listing))
+    selected = listingLength(listing) - 1;
+  scrollData->itemIndex = selected;
+  return changes + touched;
+}
+
+int changeDir(SCROLLDATA * scrollData) {
+//Change dir: enter the selected directory or go up with "..".
+//Returns -1 if it could not be opened.
+  if(scrollData->isDirectory != DIRECTORY)
+    return 0;
+  if(scrollData->itemIndex == 1)
+    return dirLeave();
+  return dirEnter(scrollData->path);
 }
 
 /* ---------------- */
-/* List files       */
+/* Performance HUD  */
 /* ---------------- */
+/*
+'p' shows, on lines 3-4, what the browser is costing: the last scan and
+its throughput, the bytes of the listing on display and of the cache,
+cache and read-ahead hit rates, bytes per frame and the time from a key
+being read to its frame being out. The counters are bumped where the
+work is done anyway (a clock read per key and per painted frame, a few
+additions per scan) and kept whether the HUD is on or not, so
+--perf-out can write them all as JSON on exit.
+Latencies go into a histogram: four buckets per power of two
+microseconds, so percentiles are within 25% and memory is fixed.
+*/
 
-int addSpaces(char temp[MAX_ITEM_LENGTH]) {
-  int     i;
-  for(i = strlen(temp); i < MAX_ITEM_LENGTH; i++) {
-    strcat(temp, " ");
+static unsigned perfBucket(double us) {
+  unsigned long long value = us > 0 ? (unsigned long long)us : 0;
+  unsigned bits, bucket;
+
+  if(value < 4)
+    return value;
+  bits = 63 - __builtin_clzll(value);
+  bucket = (bits - 1) * 4 + ((value >> (bits - 2)) & 3);
+  return bucket < PERF_BUCKETS ? bucket : PERF_BUCKETS - 1;
+}
+
+static double perfBucketValue(unsigned bucket) {
+//Smallest latency that lands in the bucket.
+  if(bucket < 4)
+    return bucket;
+  return (double)((4ULL + bucket % 4) << (bucket / 4 - 1));
+}
+
+void perfKey(void) {
+//A key came in. The oldest key not painted yet is the one timed.
+  if(perf.keyPending)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &perf.keyAt);
+  perf.keyPending = 1;
+}
+
+void perfPaint(void) {
+//A frame is out: it answers the pending key, if any.
+  double  us;
+
+  if(!perf.keyPending)
+    return;
+  us = elapsedSeconds(&perf.keyAt) * 1e6;
+  perf.keyPending = 0;
+  perf.keys++;
+  perf.latency[perfBucket(us)]++;
+  perf.latencySum += us;
+  perf.latencyLast = us;
+  if(us > perf.latencyMax)
+    perf.latencyMax = us;
+}
+
+double perfPercentile(double fraction) {
+  unsigned long want, seen = 0;
+  unsigned i;
+
+  if(perf.keys == 0)
+    return 0;
+  want = (unsigned long)(fraction * perf.keys);	//Rounded up, at least 1
+  if(want == 0 || want < fraction * perf.keys)
+    want++;
+  for(i = 0; i < PERF_BUCKETS - 1; i++) {
+    seen += perf.latency[i];
+    if(seen >= want)
+      break;
+  }
+  return perfBucketValue(i);
+}
+
+void showHud(void) {
+//Lines 3-4. Drawn before every key while it is on.
+  unsigned long lookups = dirCache.hits + dirCache.misses;
+
+  cleanLine(3, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(6, 3);
+  screenPrintf("Scan %.3f ms %.0f/s | List %zu KB | Cache %.0f%% hit "
+	       "%zu KB | Read-ahead %.0f%%", scanStats.seconds * 1000,
+	       scanStats.seconds > 0 ? scanStats.entries / scanStats.seconds : 0,
+	       listing1 != NULL ? listingBytes(listing1) >> 10 : 0,
+	       lookups > 0 ? 100.0 * dirCache.hits / lookups : 0,
+	       dirCache.bytes >> 10,
+	       prefetch.opens > 0 ? 100.0 * prefetch.hits / prefetch.opens : 0);
+  cleanLine(4, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(6, 4);
+  screenPrintf("Frame %lu B avg %lu | Key to paint %.0f us, p50 %.0f p99 %.0f "
+	       "max %.0f", screen.frameBytes,
+	       screen.frames > 0 ? screen.totalBytes / screen.frames : 0,
+	       perf.latencyLast, perfPercentile(0.5), perfPercentile(0.99),
+	       perf.latencyMax);
+}
+
+void perfDump(void) {
+//Every counter as one JSON object, to --perf-out.
+  FILE   *file;
+
+  if(perf.outPath == NULL)
+    return;
+  file = fopen(perf.outPath, "w");
+  if(file == NULL) {
+    fprintf(stderr, "Cannot write %s\n", perf.outPath);
+    return;
+  }
+  fprintf(file, "{\"keys\":%lu,\"latency_us\":{\"mean\":%.1f,\"p50\":%.0f,"
+	  "\"p90\":%.0f,\"p99\":%.0f,\"max\":%.1f},",
+	  perf.keys, perf.keys > 0 ? perf.latencySum / perf.keys : 0,
+	  perfPercentile(0.5), perfPercentile(0.9), perfPercentile(0.99),
+	  perf.latencyMax);
+  fprintf(file, "\"frames\":%lu,\"total_bytes\":%lu,\"scans\":%lu,"
+	  "\"scan_entries\":%lu,\"scan_seconds\":%.6f,",
+	  screen.frames, screen.totalBytes, perf.scans, perf.scanEntries,
+	  perf.scanSeconds);
+  fprintf(file, "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"stale\":%lu,"
+	  "\"evictions\":%lu,\"dirs\":%u,\"bytes\":%zu,\"budget\":%zu},",
+	  dirCache.hits, dirCache.misses, dirCache.stale, dirCache.evictions,
+	  dirCache.count, dirCache.bytes, dirCache.budget);
+  fprintf(file, "\"prefetch\":{\"started\":%lu,\"ready\":%lu,"
+	  "\"dropped\":%lu,\"opens\":%lu,\"hits\":%lu},",
+	  prefetch.started, prefetch.ready, prefetch.dropped, prefetch.opens,
+	  prefetch.hits);
+  fprintf(file, "\"statx\":{\"calls\":%llu,\"batches\":%llu},"
+	  "\"dir_events\":%lu,\"rescans\":%lu,\"dir_hops\":%lu}\n",
+	  __atomic_load_n(&meta.calls, __ATOMIC_RELAXED),
+	  __atomic_load_n(&meta.batches, __ATOMIC_RELAXED),
+	  dirWatch.events, dirWatch.rescans, dirStack.hops);
+  fclose(file);
+}
+
+/* ---------------- */
+/* Replay           */
+/* ---------------- */
+/*
+--replay runs the browser without a terminal: keys are read from a
+script and the escape stream goes to a file (or nowhere). Every time
+the UI is about to wait for input, the frame it just flushed is put
+down to the key before it (time since the key went in, bytes written)
+and the next key goes in. When the script ends, latency percentiles
+and bytes per frame are printed as JSON on the real stdout.
+
+Script: tokens separated by blanks, # to the end of the line.
+  up down left right pgup pgdn home end enter esc tab bs space
+  text:abc     the characters abc, one key each
+  x            any single character, as typed
+  wait:MS      let background work run for MS milliseconds
+  TOKEN*N      N times
+*/
+
+int replayInit(const char *scriptPath, const char *outPath,
+	       const char *size) {
+//Loads the script and sends the screen to outPath. -1 on error.
+  struct stat st;
+  int     fd, outFd;
+
+  fd = open(scriptPath, O_RDONLY | O_CLOEXEC);
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Cannot read %s\n", scriptPath);
+    return -1;
+  }
+  replay.script = (char *)malloc(st.st_size + 1);
+  if(replay.script == NULL
+     || read(fd, replay.script, st.st_size) != st.st_size) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  replay.script[st.st_size] = '\0';
+  replay.columns = DEFAULT_COLUMNS;
+  replay.rows = DEFAULT_ROWS;
+  if(size != NULL
+     && (sscanf(size, "%dx%d", &replay.columns, &replay.rows) != 2
+	 || replay.columns < 20 || replay.rows < 24)) {
+    fprintf(stderr, "Bad size %s: COLUMNSxROWS, at least 20x24\n", size);
+    return -1;
+  }
+  //The screen goes to stdout: swap it for the output file
+  if(outPath == NULL)
+    outPath = "/dev/null";
+  outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  replay.reportFd = dup(STDOUT_FILENO);
+  if(outFd < 0 || replay.reportFd < 0
+     || dup2(outFd, STDOUT_FILENO) < 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", outPath, strerror(errno));
+    return -1;
   }
+  close(outFd);
+  replay.active = 1;
+  clock_gettime(CLOCK_MONOTONIC, &replay.start);
   return 0;
 }
 
-void cleanString(char *string, int max) {
+int replayToken(void) {
+//Reads the next token into replay.key. 0 at the end of the script,
+//-1 for a wait (replay.waitUntil is set).
+  static const char *names[] = { "up", "\033[A", "down", "\033[B",
+    "right", "\033[C", "left", "\033[D", "pgup", "\033[5~",
+    "pgdn", "\033[6~", "home", "\033[H", "end", "\033[F", "enter", "\n",
+    "esc", "\033", "tab", "\t", "bs", "\177", "space", " ", NULL
+  };
+  char    token[REPLAY_KEY_SIZE], *star;
+  size_t  length;
+  long    ms;
   int     i;
-  for(i = 0; i < max; i++) {
-    string[i] = ' ';
+
+  for(;;) {
+    replay.pos += strspn(replay.script + replay.pos, " \t\r\n");
+    if(replay.script[replay.pos] != '#')
+      break;
+    replay.pos += strcspn(replay.script + replay.pos, "\n");
+  }
+  length = strcspn(replay.script + replay.pos, " \t\r\n");
+  if(length == 0)
+    return 0;
+  if(length >= sizeof(token))
+    length = sizeof(token) - 1;
+  memcpy(token, replay.script + replay.pos, length);
+  token[length] = '\0';
+  replay.pos += strcspn(replay.script + replay.pos, " \t\r\n");
+  replay.repeat = 1;
+  star = strrchr(token, '*');
+  if(star != NULL && star > token && star[1] != '\0') {
+    replay.repeat = strtoul(star + 1, NULL, 10);
+    *star = '\0';
+  }
+  if(strncmp(token, "wait:", 5) == 0) {
+    ms = atol(token + 5);
+    clock_gettime(CLOCK_MONOTONIC, &replay.waitUntil);
+    replay.waitUntil.tv_sec += ms / 1000;
+    replay.waitUntil.tv_nsec += (ms % 1000) * 1000000;
+    if(replay.waitUntil.tv_nsec >= 1000000000) {
+      replay.waitUntil.tv_sec++;
+      replay.waitUntil.tv_nsec -= 1000000000;
+    }
+    replay.repeat = 0;
+    return -1;
+  }
+  replay.text = strncmp(token, "text:", 5) == 0;
+  replay.keyPos = 0;
+  if(replay.text)
+    snprintf(replay.key, sizeof(replay.key), "%s", token + 5);
+  else {
+    snprintf(replay.key, sizeof(replay.key), "%s", token);
+    for(i = 0; names[i] != NULL; i += 2)
+      if(strcmp(token, names[i]) == 0)
+	snprintf(replay.key, sizeof(replay.key), "%s", names[i + 1]);
   }
+  replay.keyLength = strlen(replay.key);
+  if(replay.keyLength == 0)
+    replay.repeat = 0;		//Nothing to type
+  return 1;
 }
-int listFiles(LISTCHOICE ** listBox1, char *directory) {
-  DIR    *d=NULL;
-  struct dirent *dir=NULL;
-  int     i;
-  char    temp[MAX_ITEM_LENGTH];
-  int     lenDir;		//length of directory
-
-  //Add elements to switch directory at the beginning for convenience.
-  strcpy(temp, CURRENTDIR);
-  //Add spaces
-  addSpaces(temp);
-  *listBox1 = addend(*listBox1, newelement(temp, CURRENTDIR, DIRECTORY));	// "."
-  strcpy(temp, CHANGEDIR);
-  //Add spaces
-  addSpaces(temp);
-  *listBox1 = addend(*listBox1, newelement(temp, CHANGEDIR, DIRECTORY));	// ".."
-
-  //Start at current directory
-  d = opendir(directory);
-  //Find directories and add them to list first
-  if(d) {
-    while((dir = readdir(d)) != NULL) {
-      if(dir->d_type == DT_DIR) {
-
-	lenDir = strlen(dir->d_name);
-
-	//Check length of directory
-	//Directories are displayed between brackets [directory]
-	if(lenDir > MAX_ITEM_LENGTH - 2) {
-	  //Directory name is long. CROP
-	  cleanString(temp, MAX_ITEM_LENGTH);
-	  strcpy(temp, "[");
-	  for(i = 1; i < MAX_ITEM_LENGTH - 1; i++) {
-	    temp[i] = dir->d_name[i - 1];
-	  }
-	  temp[MAX_ITEM_LENGTH - 1] = ']';
-	} else {
-	  //Directory's name is shorter than display
-	  //Add spaces to item string.
-	  cleanString(temp, MAX_ITEM_LENGTH);
-	  strcpy(temp, "[");
-	  for(i = 1; i < lenDir + 1; i++) {
-	    temp[i] = dir->d_name[i - 1];
-	  }
-	  temp[lenDir + 1] = ']';
-	  addSpaces(temp);
+
+int replayStep(int timeout) {
+/*
+Called by fillInput() once the frame is out and the UI would wait.
+Puts that frame down to the pending key and feeds the next one, one key
+(or one character of a text: token) at a time. Returns how long the UI
+may still wait: 0 once a key is in, the rest of a scripted pause.
+*/
+  struct timespec now;
+  long    left;
+  double *latency;
+  unsigned long *bytes;
+  int     token;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(replay.pending) {
+    if(replay.count == replay.size) {
+      replay.size = replay.size > 0 ? replay.size * 2 : 1024;
+      latency = (double *)realloc(replay.latency,
+				  replay.size * sizeof(double));
+      if(latency != NULL)
+	replay.latency = latency;
+      bytes = (unsigned long *)realloc(replay.frameBytes,
+				       replay.size * sizeof(unsigned long));
+      if(bytes != NULL)
+	replay.frameBytes = bytes;
+      if(latency == NULL || bytes == NULL)
+	replay.size = replay.count;	//Out of memory: stop recording
+    }
+    if(replay.count < replay.size) {
+      replay.latency[replay.count] =
+	  (now.tv_sec - replay.injected.tv_sec) * 1e6 +
+	  (now.tv_nsec - replay.injected.tv_nsec) / 1e3;
+      replay.frameBytes[replay.count++] =
+	  screen.totalBytes - replay.bytesBefore;
+    }
+    replay.pending = 0;
+  }
+  //A scripted pause lets scans, read-aheads and walks go on
+  left = (replay.waitUntil.tv_sec - now.tv_sec) * 1000 +
+      (replay.waitUntil.tv_nsec - now.tv_nsec) / 1000000;
+  if(left > 0)
+    return timeout >= 0 && timeout < left ? timeout : left;
+  while(replay.repeat == 0) {
+    token = replayToken();
+    if(token == 0) {
+      //End of the script: main() leaves and reports
+      input.quit = 1;
+      return 0;
+    }
+    if(token < 0)
+      return replayStep(timeout);
+  }
+  if(input.end + replay.keyLength > INPUT_BUFFER_SIZE)
+    return 0;
+  if(replay.text) {
+    //One character per key
+    input.data[input.end++] = replay.key[replay.keyPos++];
+    if(replay.keyPos == replay.keyLength) {
+      replay.keyPos = 0;
+      replay.repeat--;
+    }
+  } else {
+    memcpy(input.data + input.end, replay.key, replay.keyLength);
+    input.end += replay.keyLength;
+    replay.repeat--;
+  }
+  replay.pending = 1;
+  replay.bytesBefore = screen.totalBytes;
+  clock_gettime(CLOCK_MONOTONIC, &replay.injected);
+  perfKey();
+  return 0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double  x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int compareLongs(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+void replayReport(void) {
+//Latency percentiles and bytes per frame, as one JSON object.
+  unsigned long i, n = replay.count, bytes = 0;
+  double  sum = 0;
+  char    line[1024];
+  int     length;
+
+  for(i = 0; i < n; i++) {
+    sum += replay.latency[i];
+    bytes += replay.frameBytes[i];
+  }
+  if(n > 0) {
+    qsort(replay.latency, n, sizeof(double), compareDoubles);
+    qsort(replay.frameBytes, n, sizeof(unsigned long), compareLongs);
+  }
+#define PCT(a, p) ((a)[n > 0 ? (unsigned long)((n - 1) * (p)) : 0])
+  length = n == 0 ? snprintf(line, sizeof(line), "{\"keys\":0}\n") :
+      snprintf(line, sizeof(line),
+	       "{\"keys\":%lu,\"seconds\":%.3f,\"columns\":%d,\"rows\":%d,"
+	       "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+	       "\"p99\":%.1f,\"max\":%.1f},"
+	       "\"frame_bytes\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,"
+	       "\"p99\":%lu,\"max\":%lu},\"total_bytes\":%lu}\n",
+	       n, elapsedSeconds(&replay.start), replay.columns, replay.rows,
+	       sum / n, PCT(replay.latency, 0.5), PCT(replay.latency, 0.9),
+	       PCT(replay.latency, 0.99), replay.latency[n - 1],
+	       (double)bytes / n, PCT(replay.frameBytes, 0.5),
+	       PCT(replay.frameBytes, 0.9), PCT(replay.frameBytes, 0.99),
+	       replay.frameBytes[n - 1], screen.totalBytes);
+#undef PCT
+  write(replay.reportFd, line, length);
+}
+
+/* ---------------- */
+/* Streaming output */
+/* ---------------- */
+/*
+--list and --json print a directory (or, with --recursive, the whole
+tree below it) on stdout instead of starting the browser, for scripts.
+Entries are read with the scanner's getdents64 batches and classified
+with resolveType(), so the same files and directories are listed as in
+the browser, but no list is built: each batch goes straight into a
+STREAM_BUFFER_SIZE output buffer that is written out when full. Entries
+come in directory order, unsorted. Memory is one read buffer per level
+of the walk, whatever the number of entries. Paths are relative to the
+directory given; symbolic links are never followed.
+Formats: one path per line, NUL after each path (--null, for xargs -0)
+or one JSON object per line: {"path":...,"type":"dir"|"file","ino":N}.
+*/
+
+static int streamFlush(STREAM * stream) {
+//Writes the buffer out. -1 once stdout is gone (closed pipe, full disk).
+  size_t  done = 0;
+  ssize_t n;
+
+  while(done < stream->used && !stream->failed) {
+    n = write(STDOUT_FILENO, stream->out + done, stream->used - done);
+    if(n > 0)
+      done += n;
+    else if(n < 0 && errno != EINTR)
+      stream->failed = 1;
+  }
+  stream->used = 0;
+  return stream->failed ? -1 : 0;
+}
+
+static void streamCopy(STREAM * stream, const char *data, size_t length) {
+  size_t  room;
+
+  while(length > 0 && !stream->failed) {
+    if(stream->used == STREAM_BUFFER_SIZE)
+      streamFlush(stream);
+    room = STREAM_BUFFER_SIZE - stream->used;
+    if(room > length)
+      room = length;
+    memcpy(stream->out + stream->used, data, room);
+    stream->used += room;
+    data += room;
+    length -= room;
+  }
+}
+
+static size_t utf8Length(const unsigned char *text, size_t length) {
+//Bytes of the UTF-8 sequence text starts with, 0 if it is not a valid
+//one: truncated, overlong, a surrogate or past U+10FFFF.
+  size_t  need, i;
+  unsigned code;
+
+  if(text[0] >= 0xc2 && text[0] <= 0xdf)
+    need = 2;
+  else if(text[0] >= 0xe0 && text[0] <= 0xef)
+    need = 3;
+  else if(text[0] >= 0xf0 && text[0] <= 0xf4)
+    need = 4;
+  else
+    return 0;
+  if(need > length)
+    return 0;
+  code = text[0] & (0x7f >> need);
+  for(i = 1; i < need; i++) {
+    if((text[i] & 0xc0) != 0x80)
+      return 0;
+    code = code << 6 | (text[i] & 0x3f);
+  }
+  if((need == 3 && (code < 0x800 || (code >= 0xd800 && code <= 0xdfff)))
+     || (need == 4 && (code < 0x10000 || code > 0x10ffff)))
+    return 0;
+  return need;
+}
+
+static void streamEscape(STREAM * stream, const char *text, size_t length) {
+//JSON string body. Valid UTF-8 is copied as it is; a byte that is not
+//part of it (names are any bytes on Linux) is written as \u00XX, so
+//every line stays valid JSON.
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *bytes = (const unsigned char *)text;
+  unsigned char c;
+  size_t  i, run;
+
+  for(i = 0; i < length && !stream->failed; i++) {
+    if(STREAM_BUFFER_SIZE - stream->used < 6)
+      streamFlush(stream);
+    c = bytes[i];
+    if(c == '"' || c == '\\') {
+      stream->out[stream->used++] = '\\';
+      stream->out[stream->used++] = c;
+    } else if(c < 0x20 || (c >= 0x80
+			   && (run = utf8Length(bytes + i, length - i)) == 0)) {
+      memcpy(stream->out + stream->used, "\\u00", 4);
+      stream->out[stream->used + 4] = hex[c >> 4];
+      stream->out[stream->used + 5] = hex[c & 15];
+      stream->used += 6;
+    } else if(c >= 0x80) {
+      memcpy(stream->out + stream->used, text + i, run);
+      stream->used += run;
+      i += run - 1;
+    } else
+      stream->out[stream->used++] = c;
+  }
+}
+
+void streamEntry(STREAM * stream, size_t pathLength, const char *name,
+		 unsigned itemType, unsigned long long ino) {
+//One entry: stream->path[0..pathLength) is the directory it is in.
+  char    tail[64];
+  int     length;
+
+  stream->entries++;
+  if(stream->format != STREAM_JSON) {
+    streamCopy(stream, stream->path, pathLength);
+    streamCopy(stream, name, strlen(name));
+    streamCopy(stream, stream->format == STREAM_NUL ? "" : "\n", 1);
+    return;
+  }
+  streamCopy(stream, "{\"path\":\"", 9);
+  streamEscape(stream, stream->path, pathLength);
+  streamEscape(stream, name, strlen(name));
+  length = snprintf(tail, sizeof(tail), "\",\"type\":\"%s\",\"ino\":%llu}\n",
+		    itemType == DIRECTORY ? "dir" : "file", ino);
+  streamCopy(stream, tail, length);
+}
+
+void streamDir(STREAM * stream, int fd, size_t pathLength) {
+/*
+Lists the directory open on fd, whose path is stream->path[0..pathLength)
+with a trailing '/' (empty at the top), and with --recursive goes down
+into each subdirectory as soon as it is listed. The read buffer of each
+level is taken from stream->buffers and given back on the way out.
+*/
+  size_t  mark = stream->buffers.used, length;
+  struct linux_dirent64 *dir;
+  char   *buffer, *path;
+  int     nread = 0, pos, child;
+  unsigned itemType;
+
+  buffer = (char *)arenaAlloc(&stream->buffers, SCAN_BUFFER_SIZE);
+  if(buffer == NULL) {
+    fprintf(stderr, "%.*s: too deep\n", (int)pathLength, stream->path);
+    stream->errors++;
+    return;
+  }
+  while(!stream->failed
+	&& (nread = syscall(SYS_getdents64, fd, buffer,
+			    SCAN_BUFFER_SIZE)) > 0) {
+    for(pos = 0; pos < nread && !stream->failed; pos += dir->d_reclen) {
+      dir = (struct linux_dirent64 *)(buffer + pos);
+      if(strcmp(dir->d_name, CURRENTDIR) == 0
+	 || strcmp(dir->d_name, CHANGEDIR) == 0)
+	continue;
+      itemType = resolveType(fd, dir->d_name, dir->d_type);
+      if(itemType != DIRECTORY && itemType != FILEITEM)
+	continue;
+      streamEntry(stream, pathLength, dir->d_name, itemType, dir->d_ino);
+      if(itemType != DIRECTORY || !stream->recursive)
+	continue;
+      //Depth first, while this batch waits in its buffer
+      length = strlen(dir->d_name);
+      if(pathLength + length + 2 > stream->pathSize) {
+	path = (char *)realloc(stream->path,
+			       (pathLength + length + 2) * 2);
+	if(path == NULL) {
+	  stream->errors++;
+	  continue;
 	}
-	//Add all directories except CURRENTDIR and CHANGEDIR
-	if(strcmp(dir->d_name, CURRENTDIR) != 0
-	   && strcmp(dir->d_name, CHANGEDIR) != 0)
-	  *listBox1 =
-	      addend(*listBox1, newelement(temp, dir->d_name, DIRECTORY));
+	stream->path = path;
+	stream->pathSize = (pathLength + length + 2) * 2;
       }
+      memcpy(stream->path + pathLength, dir->d_name, length);
+      stream->path[pathLength + length] = '/';
+      child = openat(fd, dir->d_name,
+		     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if(child < 0) {
+	fprintf(stderr, "%.*s: %s\n", (int)(pathLength + length),
+		stream->path, strerror(errno));
+	stream->errors++;
+	continue;
+      }
+      streamDir(stream, child, pathLength + length + 1);
+      close(child);
     }
   }
-  closedir(d);
+  if(nread < 0) {
+    fprintf(stderr, "%.*s: %s\n", pathLength > 0 ? (int)pathLength - 1 : 1,
+	    pathLength > 0 ? stream->path : ".", strerror(errno));
+    stream->errors++;
+  }
+  stream->buffers.used = mark;
+}
 
-  //Find files and add them to list after directories
-  d = opendir(directory);
-  if(d) {
-    while((dir = readdir(d)) != NULL) {
-      if(dir->d_type == DT_REG) {
-	//only list valid fiels
-	if(strlen(dir->d_name) > MAX_ITEM_LENGTH) {
-	  for(i = 0; i < MAX_ITEM_LENGTH; i++) {
-	    temp[i] = dir->d_name[i];
-	  }
-	} else {
-	  strcpy(temp, dir->d_name);
-	  //Add spaces
-	  addSpaces(temp);
-	}
-	*listBox1 =
-	    addend(*listBox1, newelement(temp, dir->d_name, FILEITEM));
+int streamMain(const char *where, int format, int recursive) {
+//Prints where and returns the exit status: 1 if anything was unreadable.
+  STREAM  stream;
+  int     fd;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.format = format;
+  stream.recursive = recursive;
+  stream.out = (char *)malloc(STREAM_BUFFER_SIZE);
+  stream.pathSize = MAX;
+  stream.path = (char *)malloc(stream.pathSize);
+  if(stream.out == NULL || stream.path == NULL
+     || arenaInit(&stream.buffers, STREAM_ARENA_SIZE) != 0) {
+    fprintf(stderr, "Not enough memory to list %s.\n", where);
+    return 1;
+  }
+  fd = open(where, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0) {
+    fprintf(stderr, "%s: %s\n", where, strerror(errno));
+    return 1;
+  }
+  streamDir(&stream, fd, 0);
+  close(fd);
+  streamFlush(&stream);
+  arenaFree(&stream.buffers);
+  free(stream.path);
+  free(stream.out);
+  return stream.errors > 0 || stream.failed;
+}
+
+/* ---------------- */
+/* Benchmark        */
+/* ---------------- */
+/*
+--bench generates directories of the given sizes (BENCH_SIZES, 1k to
+1m entries, by default; 5m has been run on disk), names of 4 to 60
+characters and BENCH_DIR_PERCENT subdirectories, under a tmpfs when
+there is one (--bench-dir for sizes past its inodes), and times every
+stage of the listing engine on each: the raw getdents64 read, building
+the list (scan, newelement(), addend()), each sort order, name lookups,
+random index access and the teardown. Each stage is one JSON line on
+stdout with ns per entry (or per operation), arena allocations, listing
+bytes and the peak RSS, so runs can be compared by a script. The
+directories are removed after.
+*/
+
+static unsigned long long benchRandom(unsigned long long *seed) {
+  *seed ^= *seed << 13;		//xorshift64: the same tree on every run
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+int benchGenerate(int parentFd, const char *name, unsigned long count,
+		  int dirPercent, unsigned long long *seed) {
+//Fills parentFd/name with count entries. Returns -1 on error.
+  const char *letters = "abcdefghijklmnopqrstuvwxyz0123456789-.ABCDEFGHIJK";
+  char    entry[64];
+  unsigned long i;
+  int     dirFd, fd, length, k;
+
+  if(mkdirat(parentFd, name, 0755) != 0)
+    return -1;
+  dirFd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dirFd < 0)
+    return -1;
+  for(i = 0; i < count; i++) {
+    //Unique: the number and '_', then random characters to the length
+    length = 4 + benchRandom(seed) % 57;
+    k = snprintf(entry, sizeof(entry), "%lx_", i);
+    for(; k < length; k++)
+      entry[k] = letters[benchRandom(seed) % 49];
+    entry[length > k ? length : k] = '\0';
+    if((int)(benchRandom(seed) % 100) < dirPercent) {
+      if(mkdirat(dirFd, entry, 0755) != 0)
+	break;
+    } else {
+      fd = openat(dirFd, entry, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		  0644);
+      if(fd < 0)
+	break;
+      close(fd);
+    }
+  }
+  close(dirFd);
+  return i == count ? 0 : -1;
+}
+
+void benchRemove(int parentFd, const char *name) {
+//Deletes a generated directory; its subdirectories are empty.
+  char   *buffer = (char *)malloc(SCAN_BUFFER_SIZE);
+  struct linux_dirent64 *dir;
+  int     dirFd, nread, pos, removed = 1;
+
+  dirFd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  //Entries move while they are removed: read again until none is left
+  while(dirFd >= 0 && buffer != NULL && removed > 0) {
+    removed = 0;
+    lseek(dirFd, 0, SEEK_SET);
+    while((nread = syscall(SYS_getdents64, dirFd, buffer,
+			   SCAN_BUFFER_SIZE)) > 0)
+      for(pos = 0; pos < nread; pos += dir->d_reclen) {
+	dir = (struct linux_dirent64 *)(buffer + pos);
+	if(strcmp(dir->d_name, CURRENTDIR) != 0
+	   && strcmp(dir->d_name, CHANGEDIR) != 0
+	   && unlinkat(dirFd, dir->d_name,
+		       dir->d_type == DT_DIR ? AT_REMOVEDIR : 0) == 0)
+	  removed++;
       }
+  }
+  if(dirFd >= 0)
+    close(dirFd);
+  free(buffer);
+  unlinkat(parentFd, name, AT_REMOVEDIR);
+}
+
+static size_t benchAllocs(DIRLISTING * listing) {
+  return listing->entries.allocs + listing->names.allocs +
+      listing->metas.allocs;
+}
+
+static long benchRss(void) {
+//Resident set now, in KB: pages given back show here, not in the peak.
+  long    pages = 0;
+  FILE   *statm = fopen("/proc/self/statm", "r");
+
+  if(statm != NULL) {
+    if(fscanf(statm, "%*d %ld", &pages) != 1)
+      pages = 0;
+    fclose(statm);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+void benchReport(const char *phase, DIRLISTING * listing,
+		 unsigned long count, struct timespec *start,
+		 size_t allocs, unsigned long ops) {
+//One JSON line. ops: operations timed, per entry if 0.
+  double  seconds = elapsedSeconds(start);
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("{\"phase\":\"%s\",\"entries\":%lu,\"seconds\":%.6f,"
+	 "\"ns_per_%s\":%.1f,\"allocs\":%zu,\"listing_bytes\":%zu,"
+	 "\"spilled_bytes\":%zu,\"rss_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+	 phase, count, seconds, ops > 0 ? "op" : "entry",
+	 seconds * 1e9 / (ops > 0 ? ops : count > 0 ? count : 1),
+	 (listing != NULL ? benchAllocs(listing) : 0) - allocs,
+	 listing != NULL ? listingBytes(listing) : 0,
+	 listing != NULL && listing->names.spill > 0 ?
+	 listing->names.used - listing->names.spill : 0, benchRss(),
+	 usage.ru_maxrss);
+  fflush(stdout);
+}
+
+
+int benchMain(const char *sizes, const char *where, int dirPercent) {
+//Runs the benchmark for every size in "1k,10k,..." under where.
+  static volatile unsigned long benchSink __attribute__ ((unused));
+  unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+  unsigned long count, i, finds, sum = 0;
+  DIRLISTING *listing;
+  LISTCHOICE *head;
+  struct timespec start;
+  const char *next;
+  char   *end, name[64], *buffer;
+  int     baseFd, fd, mode, nread, savedSort = sortMode;
+  size_t  allocs;
+
+  baseFd = open(where, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  buffer = (char *)malloc(SCAN_BUFFER_SIZE);
+  if(baseFd < 0 || buffer == NULL
+     || arenaInit(&scratchArena, SCRATCH_ARENA_SIZE) != 0) {
+    fprintf(stderr, "Cannot use %s for the benchmark.\n", where);
+    return 1;
+  }
+  printf("{\"bench\":\"fbrowser\",\"dir\":\"%s\",\"dir_percent\":%d,"
+	 "\"cpus\":%ld}\n", where, dirPercent,
+	 sysconf(_SC_NPROCESSORS_ONLN));
+  for(next = sizes; *next != '\0'; next = *end == ',' ? end + 1 : end) {
+    count = strtoul(next, &end, 10);
+    if(*end == 'k' || *end == 'K') {
+      count *= 1000;
+      end++;
+    } else if(*end == 'm' || *end == 'M') {
+      count *= 1000000;
+      end++;
+    }
+    if(count == 0 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Bad size list: %s\n", sizes);
+      return 1;
+    }
+    snprintf(name, sizeof(name), "fbrowser-bench.%ld.%lu", (long)getpid(),
+	     count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(benchGenerate(baseFd, name, count, dirPercent, &seed) != 0) {
+      fprintf(stderr, "Cannot create %lu entries in %s: %s\n", count, where,
+	      strerror(errno));
+      benchRemove(baseFd, name);
+      return 1;
+    }
+    benchReport("generate", NULL, count, &start, 0, 0);
+
+    //Raw read: getdents64 only, the floor for any scan
+    fd = openat(baseFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while((nread = syscall(SYS_getdents64, fd, buffer,
+			   SCAN_BUFFER_SIZE)) > 0) ;
+    benchReport("read", NULL, count, &start, 0, 0);
+
+    //Build: read and make the records, as a directory is opened
+    lseek(fd, 0, SEEK_SET);
+    listing = newListing();
+    if(listing == NULL) {
+      benchRemove(baseFd, name);
+      return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    addDots(listing);
+    arenaReset(&scratchArena);
+    scanEntries(listing, fd, buffer, &scanStats, NULL);
+    benchReport("build", listing, count, &start, 0, 0);
+
+    //Every order; sizes and mtimes are stat'ed by the first that needs them
+    for(mode = 0; mode < SORT_MODES; mode++) {
+      char    phase[32];
+      sortMode = mode;
+      allocs = benchAllocs(listing);
+      snprintf(phase, sizeof(phase), "sort_%s", sortNames[mode]);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      listingArrange(listing, fd, NULL);
+      benchReport(phase, listing, count, &start, allocs, 0);
     }
-    closedir(d);
+    sortMode = savedSort;
+
+    //Lookups by name (linear) and by index (records are contiguous)
+    head = listingHead(listing);
+    finds = count > 1000000 ? BENCH_FINDS / 100 : count > 100000 ?
+	BENCH_FINDS / 10 : BENCH_FINDS;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < finds; i++)
+      sum += listingFind(listing,
+			 head[benchRandom(&seed) % listingLength(listing)].
+			 path);
+    benchReport("find", listing, count, &start, benchAllocs(listing),
+		finds);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++)
+      sum += head[benchRandom(&seed) % listingLength(listing)].path[0];
+    benchReport("index", listing, count, &start, benchAllocs(listing),
+		count);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deleteList(listing);
+    freeListing(listing);
+    benchReport("teardown", NULL, count, &start, 0, 0);
+    close(fd);
+    benchRemove(baseFd, name);
   }
+  close(baseFd);
+  free(buffer);
+  benchSink = sum;		//Keeps the lookups from being optimized out
   return 0;
 }
 
-void changeDir(SCROLLDATA * scrollData, char fullPath[MAX],
-	       char newDir[MAX]) {
-//Change dir
-  char    oldPath[MAX];
-  if(scrollData->isDirectory == DIRECTORY) {
-    if(scrollData->itemIndex == 1) {
-      //cd ..
-      cleanString(fullPath, MAX);
-      cleanString(oldPath, MAX);
-      cleanString(newDir, MAX);
-      chdir("..");
-      getcwd(oldPath, sizeof(oldPath));
-      strcpy(newDir, oldPath);
-      strcpy(fullPath, oldPath);
-    } else {
-      //cd newDir
-      cleanString(fullPath, MAX);
-      cleanString(newDir, MAX);
-      cleanString(oldPath, MAX);
-      getcwd(oldPath, sizeof(oldPath));
-      strcat(oldPath, "/");
-      strcat(oldPath, scrollData->path);
-      chdir(oldPath);
-      strcpy(newDir, oldPath);
-      strcpy(fullPath, oldPath);
+/* ---------------- */
+/* Navigation       */
+/* ---------------- */
+/*
+The way from the starting directory to the one on display is a stack of
+O_PATH fds. Entering a directory is openat() on the top and going up
+pops it, so a hop costs the same at any depth and no path is resolved
+again; the process never changes its working directory. The path is
+kept alongside, one component per level, only to be displayed. Only the
+last DIRSTACK_OPEN_FDS levels stay open: deeper trees do not run out of
+fds, and a closed level is reopened with ".." from the one below it.
+*/
+
+int dirStackInit(void) {
+//The stack starts at the working directory.
+  char   *cwd = getcwd(NULL, 0);	//As long as it needs
+
+  dirStack.size = 16;
+  dirStack.levels = (DIRLEVEL *) malloc(dirStack.size * sizeof(DIRLEVEL));
+  dirStack.pathSize = cwd != NULL ? strlen(cwd) + 256 : 256;
+  dirStack.path = (char *)malloc(dirStack.pathSize);
+  if(dirStack.levels == NULL || dirStack.path == NULL) {
+    free(cwd);
+    return -1;
+  }
+  strcpy(dirStack.path, cwd != NULL ? cwd : ".");
+  free(cwd);
+  dirStack.levels[0].fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  dirStack.levels[0].pathLength = strlen(dirStack.path);
+  dirStack.count = 1;
+  return dirStack.levels[0].fd < 0 ? -1 : 0;
+}
+
+int dirStackTop(void) {
+  return dirStack.levels[dirStack.count - 1].fd;
+}
+
+int dirOpenTop(void) {
+//A readable fd of its own on the directory on display, -1 if it is not
+//readable. Each scanner gets one: fds from dup() share the position.
+  return openat(dirStackTop(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+int dirEnter(const char *name) {
+//Pushes the subdirectory name. Returns -1 if it cannot be opened.
+  DIRLEVEL *levels;
+  size_t  length = dirStack.levels[dirStack.count - 1].pathLength;
+  size_t  need = length + strlen(name) + 2;
+  unsigned far;
+  char   *path;
+  int     fd;
+
+  fd = openat(dirStackTop(), name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0)
+    return -1;
+  if(dirStack.count == dirStack.size) {
+    levels = (DIRLEVEL *) realloc(dirStack.levels,
+				  dirStack.size * 2 * sizeof(DIRLEVEL));
+    if(levels == NULL) {
+      close(fd);
+      return -1;
+    }
+    dirStack.levels = levels;
+    dirStack.size *= 2;
+  }
+  if(need > dirStack.pathSize) {
+    path = (char *)realloc(dirStack.path, need * 2);
+    if(path == NULL) {
+      close(fd);
+      return -1;
+    }
+    dirStack.path = path;
+    dirStack.pathSize = need * 2;
+  }
+  if(length == 0 || dirStack.path[length - 1] != '/')
+    dirStack.path[length++] = '/';
+  strcpy(dirStack.path + length, name);
+  //Levels far below do not need their fd until we are back there
+  if(dirStack.count >= DIRSTACK_OPEN_FDS) {
+    far = dirStack.count - DIRSTACK_OPEN_FDS;
+    if(dirStack.levels[far].fd >= 0 && far > 0) {
+      close(dirStack.levels[far].fd);
+      dirStack.levels[far].fd = -1;
     }
   }
+  dirStack.levels[dirStack.count].fd = fd;
+  dirStack.levels[dirStack.count].pathLength = length + strlen(name);
+  dirStack.count++;
+  dirStack.hops++;
+  return 0;
+}
+
+int dirLeave(void) {
+//Pops the top. At the bottom the stack is replaced by its parent.
+//Returns -1 if the parent cannot be opened.
+  DIRLEVEL *top = &dirStack.levels[dirStack.count - 1], *below = top - 1;
+  char   *slash;
+  int     fd;
+
+  if(dirStack.count == 1) {
+    fd = openat(top->fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+      return -1;
+    close(top->fd);
+    top->fd = fd;
+    slash = strrchr(dirStack.path, '/');
+    if(slash != NULL)
+      *(slash == dirStack.path ? slash + 1 : slash) = '\0';
+    top->pathLength = strlen(dirStack.path);
+    dirStack.hops++;
+    return 0;
+  }
+  if(below->fd < 0) {
+    below->fd = openat(top->fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(below->fd < 0)
+      return -1;
+  }
+  close(top->fd);
+  dirStack.count--;
+  dirStack.path[below->pathLength] = '\0';
+  dirStack.hops++;
+  return 0;
+}
+
+void showTitle(void) {
+  cleanLine(1, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 1);
+  screenPrintf("-------> Choose current directory <.> to exit");
+}
+
+void showPath(void) {
+//Line 22: the path on display; the end of it when it does not fit.
+  size_t  length = strlen(dirStack.path);
+  size_t  room = screen.columns > 20 ? screen.columns - 17 : 3;
+
+  cleanLine(22, B_BLUE, F_BLUE);
+  outputcolor(F_WHITE, B_BLUE);
+  gotoxy(1, 22);
+  if(length <= room)
+    screenPrintf("Current Path: %s", dirStack.path);
+  else
+    screenPrintf("Current Path: ...%s", dirStack.path + length - room);
 }
 
 /* ---------------- */
@@ -751,17 +7592,209 @@ backcolor1, forecolor1, displayLimit); */
 
 /*========================================================================*/
 
-int main() {
+int main(int argc, char *argv[]) {
   SCROLLDATA scrollData;
+  sigset_t signals;
   char    ch;
-  char    fullPath[MAX];
-  char    newDir[MAX];
+  int     opt, cacheHit = 0, benchDirs = BENCH_DIR_PERCENT, searched = 0;
+  int     streamFormat = -1, recursive = 0, failed;
+  const char *bench = NULL, *benchDir = NULL;
+  const char *replayScript = NULL, *replayOut = NULL, *replaySize = NULL;
+  const char *indexPath = NULL;
+  static struct option options[] = {
+    {"cache-mb", required_argument, NULL, 'c'},
+    {"sort", required_argument, NULL, 's'},
+    {"meta", required_argument, NULL, 'm'},
+    {"width", required_argument, NULL, 'w'},
+    {"names-mb", required_argument, NULL, 'N'},
+    {"index", required_argument, NULL, 'i'},
+    {"replay", required_argument, NULL, 'r'},
+    {"replay-out", required_argument, NULL, 'O'},
+    {"replay-size", required_argument, NULL, 'S'},
+    {"bench", optional_argument, NULL, 'b'},
+    {"bench-dir", required_argument, NULL, 'B'},
+    {"bench-dirs", required_argument, NULL, 'D'},
+    {"list", no_argument, NULL, 'l'},
+    {"null", no_argument, NULL, '0'},
+    {"json", no_argument, NULL, 'j'},
+    {"recursive", no_argument, NULL, 'R'},
+    {"hud", no_argument, NULL, 'H'},
+    {"perf-out", required_argument, NULL, 'P'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  //Command line
+  dirCache.budget = (size_t)DEFAULT_CACHE_MB << 20;
+  if(getenv("TMPDIR") != NULL && *getenv("TMPDIR") != '\0')
+    spillDir = getenv("TMPDIR");
+  while((opt = getopt_long(argc, argv, "c:s:m:w:i:r:b::l0jRh", options,
+			   NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+	dirCache.budget = (size_t)strtoul(optarg, NULL, 10) << 20;
+	break;
+      case 'w':
+	itemWidth = atoi(optarg);
+	if(itemWidth < 4)
+	  itemWidth = 4;		//Room for [x] and a column
+	if(itemWidth > MAX_ITEM_WIDTH)
+	  itemWidth = MAX_ITEM_WIDTH;
+	break;
+      case 'N':
+	nameBudget = (size_t)strtoul(optarg, NULL, 10) << 20;
+	break;
+      case 'i':
+	indexPath = optarg;
+	break;
+      case 'r':
+	replayScript = optarg;
+	break;
+      case 'O':
+	replayOut = optarg;
+	break;
+      case 'S':
+	replaySize = optarg;
+	break;
+      case 'b':
+	bench = optarg != NULL ? optarg : BENCH_SIZES;
+	break;
+      case 'B':
+	benchDir = optarg;
+	break;
+      case 'D':
+	benchDirs = atoi(optarg);
+	break;
+      case 'l':
+	if(streamFormat < 0)
+	  streamFormat = STREAM_PLAIN;
+	break;
+      case '0':
+	streamFormat = STREAM_NUL;
+	break;
+      case 'j':
+	streamFormat = STREAM_JSON;
+	break;
+      case 'R':
+	recursive = 1;
+	break;
+      case 'H':
+	hudShown = 1;
+	break;
+      case 'P':
+	perf.outPath = optarg;
+	break;
+      case 's':
+	if((sortMode = parseSortMode(optarg)) >= 0)
+	  break;
+	fprintf(stderr, "Unknown sort order: %s\n", optarg);
+	opt = '?';
+	//Fall through
+      case 'm':
+	if(opt == 'm' && (metaColumns = parseMetaColumns(optarg)) != 0) {
+	  metaShown = 1;
+	  break;
+	}
+	if(opt == 'm')
+	  fprintf(stderr, "Unknown columns: %s\n", optarg);
+	opt = '?';
+	//Fall through
+      default:
+	fprintf(stderr, "Usage: %s [-c|--cache-mb MB] [-s|--sort ORDER] "
+		"[-m|--meta COLUMNS] [-w|--width N]\n"
+		"       %*s [-i|--index FILE]\n"
+		"       %s -l|-0|-j [-R] [DIR]\n", argv[0],
+		(int)strlen(argv[0]), "", argv[0]);
+	fprintf(stderr, "  -c, --cache-mb MB   memory for cached "
+		"directory listings (default %d)\n", DEFAULT_CACHE_MB);
+	fprintf(stderr, "  -s, --sort ORDER    name, natural, size, mtime "
+		"or ext (default name)\n");
+	fprintf(stderr, "  -m, --meta COLUMNS  show size,mtime,perms,owner "
+		"(any of them, or all)\n");
+	fprintf(stderr, "  -w, --width N       columns of the names in "
+		"the list (default %d)\n", DEFAULT_ITEM_WIDTH);
+	fprintf(stderr, "      --names-mb MB   names of a directory kept "
+		"in RAM, the rest in a\n"
+		"                      temp file in $TMPDIR or %s "
+		"(default %d, 0 = all in RAM)\n", DEFAULT_SPILL_DIR,
+		DEFAULT_NAMES_MB);
+	fprintf(stderr, "  -i, --index FILE    keep the listings in FILE "
+		"across runs, served from it\n"
+		"                      while the directories are unchanged\n");
+	fprintf(stderr, "  -r, --replay SCRIPT run headless from a key "
+		"script, report latencies\n"
+		"      --replay-out FILE   keep the escape stream "
+		"(default: discarded)\n"
+		"      --replay-size CxR   fake terminal size "
+		"(default %dx%d)\n", DEFAULT_COLUMNS, DEFAULT_ROWS);
+	fprintf(stderr, "  -b, --bench[=SIZES] time the listing engine on "
+		"generated directories\n"
+		"                      (default %s), JSON lines on stdout\n"
+		"      --bench-dir DIR where to generate them (default "
+		"/dev/shm, else /tmp)\n"
+		"      --bench-dirs PCT share of subdirectories (default "
+		"%d)\n", BENCH_SIZES, BENCH_DIR_PERCENT);
+	fprintf(stderr, "  -l, --list          print DIR (default .) "
+		"one path per line, no browser\n"
+		"  -0, --null          the same, NUL after each path\n"
+		"  -j, --json          the same, one JSON object per line\n"
+		"  -R, --recursive     with -l, -0 or -j: the whole tree "
+		"below DIR\n");
+	fprintf(stderr, "      --hud           start with the performance "
+		"HUD on (p toggles it)\n"
+		"      --perf-out FILE write the counters to FILE as JSON "
+		"on exit\n");
+	return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(streamFormat >= 0)
+    return streamMain(optind < argc ? argv[optind] : CURRENTDIR,
+		      streamFormat, recursive);
+  if(bench != NULL) {
+    if(benchDir == NULL)
+      benchDir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    return benchMain(bench, benchDir, benchDirs);
+  }
+  if(replayScript != NULL
+     && replayInit(replayScript, replayOut, replaySize) != 0)
+    return 1;
+  //We start at current dir
+  if(dirStackInit() != 0) {
+    fprintf(stderr, "Cannot open the current directory.\n");
+    return 1;
+  }
+  //Reserve list storage
+  if(arenaInit(&scratchArena, SCRATCH_ARENA_SIZE) != 0) {
+    fprintf(stderr, "Not enough memory for the file list.\n");
+    return 1;
+  }
+  if(screenInit() != 0) {
+    fprintf(stderr, "Not enough memory for the screen buffer.\n");
+    return 1;
+  }
+  if(indexPath != NULL && indexOpen(indexPath) != 0) {
+    fprintf(stderr, "Cannot use %s as an index.\n", indexPath);
+    return 1;
+  }
+  if(!replay.active) {
+    initTermios(0);		//Raw mode for the whole session
+    atexit(restoreTerminal);
+    //SIGWINCH and the signals that end the session are read from a
+    //signalfd in fillInput(). Blocked before any thread starts, so
+    //that every thread inherits the mask.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGWINCH);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if(sigprocmask(SIG_BLOCK, &signals, NULL) == 0)
+      signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  }
   //Change background color
   outputcolor(F_WHITE, B_BLUE);
   clear();
 
-  strcpy(newDir, ".");		//We start at current dir
-  getcwd(fullPath, sizeof(fullPath));	//Get path
   scrollData.scrollActive=0;	//To know whether scroll is active or not.
   scrollData.scrollLimit=0;		//Last index for scroll.
   scrollData.listLength=0;		//Total no. of items in the list
@@ -780,43 +7813,95 @@ int main() {
   scrollData.path =NULL;
   scrollData.itemIndex=0;
   //LISTCHOICE *head;		//store head of the list
-  gotoxy(1,1);
-  printf("-------> Choose current directory <.> to exit");
+  showTitle();
   //Directories loop
   do {
-    draw_window(9, 7, 31, 19, B_BLACK);	//shadow
-    draw_window(8, 6, 30, 18, B_WHITE);	//window
+    drawListWindow();
 
     //Add items to list
-    if(listBox1 == NULL) 
-      listFiles(&listBox1, newDir);
+    if(listBox1 == NULL && search.listing != NULL && !search.stopping) {
+      //Results of a search take the place of the directory for now
+      watchDirectory(NULL);
+      listing1 = search.listing;
+      listBox1 = listingHead(listing1);
+      scrollData.itemIndex = 0;
+      showSearchStatus();
+    }
+    if(listBox1 == NULL) {
+      watchDirectory(NULL);
+      listing1 = openListing(dirOpenTop(), &cacheHit);
+      if(listing1 == NULL)
+	break;
+      dirWatch.listing = listing1;
+      listBox1 = listingHead(listing1);
+      //Small directories are read before the first paint; big ones
+      //are shown while they are being read.
+      if(waitScan(SCAN_FIRST_WAIT))
+	finishScan();
+      //Start on the top, or on the search match that led here
+      scrollData.itemIndex = 0;
+      if(search.select != NULL && listingFind(listing1, search.select) > 0)
+	scrollData.itemIndex = listingFind(listing1, search.select);
+      search.select = NULL;
+      showScanStatus(cacheHit);
+      showSortStatus();
+      if(activeScan == NULL)
+	indexRevalidate();	//Once the first listing is complete
+    }
     ch = listBox(listBox1, 10, 7, &scrollData, B_WHITE, F_BLACK, B_BLUE,
 		 FH_WHITE, 10);
+    //Leaving while it is still being read: the listing is incomplete
+    cancelScan();
+    indexStore(listing1, dirStack.path);
+    duStop();
+    if(filter.active) {
+      filterClear();
+      showFilterStatus();
+    }
+    if(ch == QUIT_LIST)
+      break;			//Interrupted
 
-    //Change Dir. New directory is copied in newDir
-    if (scrollData.itemIndex!=0) changeDir(&scrollData, fullPath, newDir);
+    //Change Dir. The new directory is on top of dirStack
+    searched = ch != NEW_LIST && listing1 == search.listing;
+    failed = 0;
+    if(searched)
+      searchSelect(&scrollData);
+    else if (ch != NEW_LIST && scrollData.itemIndex!=0
+	     && changeDir(&scrollData) != 0)
+      failed = errno;		//Stays where it was
 
     //Display current path
-    cleanLine(22, B_BLUE, F_BLUE);
-    outputcolor(F_WHITE, B_BLUE);
-    gotoxy(1, 22);
-    printf("Current Path: %s", fullPath);
+    showPath();
 
     //Info Item selected.
+    if(ch == NEW_LIST) {
+      listBox1 = NULL;
+      continue;			//Nothing was selected
+    }
     cleanLine(21, B_BLUE, F_BLUE);
     gotoxy(1, 21);
     outputcolor(FH_WHITE, B_BLUE);
-    printf("Item selected: %s | Index: %u | Key : %u\n",
-	   scrollData.path, scrollData.itemIndex, ch);
+    if(failed != 0)
+      screenPrintf("Cannot open %s: %s", scrollData.path, strerror(failed));
+    else
+      screenPrintf("Item selected: %s | Index: %u | Key : %u\n",
+		   scrollData.path, scrollData.itemIndex, ch);
 
-    if(listBox1 != NULL) {
-		deleteList(&listBox1);
-		listBox1 = NULL;
-    }
-  } while(scrollData.itemIndex != 0);
+    //The listing stays in the directory cache
+    listBox1 = NULL;
+  } while(ch == NEW_LIST || searched || scrollData.itemIndex != 0);
+  prefetchDrop();
+  duStop();
+  searchStop();
+  metaStop();
+  indexClose();
  //Restore colors.
-  outputcolor(F_WHITE, B_BLACK);
-  clear();
+  screenEnd();
+  if(replay.active)
+    replayReport();
+  else
+    resetTermios();
+  perfDump();
   printf("\n");
   return 0;
 